@@ -0,0 +1,47 @@
+#!/bin/sh
+# try_resume on a full pool: starts nginx with busy_test.conf, fills the pool
+# with two /hold requests, then checks that /retry gets "busy" and can retry
+# with the same buffer argument. Prints "ok" or "FAIL: <response>", and exits
+# with a failure status in the latter case.
+#
+# environment:
+#   NGINX      nginx binary built with this module (default: nginx)
+#   CURL       curl binary (default: curl)
+#   PORT       listening port (default: 12347)
+
+set -e
+
+NGINX=${NGINX:-nginx}
+CURL=${CURL:-curl}
+PORT=${PORT:-12347}
+
+here=$(cd "$(dirname "$0")" && pwd)
+prefix=$(mktemp -d)
+trap 'kill $pid 2>/dev/null; rm -rf "$prefix"' EXIT INT TERM
+mkdir -p "$prefix/logs" "$prefix/conf"
+
+sed -e "s/@PORT@/$PORT/" "$here/busy_test.conf" > "$prefix/conf/nginx.conf"
+
+"$NGINX" -p "$prefix" -c conf/nginx.conf &
+pid=$!
+sleep 1
+
+url="http://127.0.0.1:$PORT"
+
+# the first run takes the thread, the second one the queue
+"$CURL" -s "$url/hold?s=1" > /dev/null &
+hold1=$!
+sleep 0.2
+"$CURL" -s "$url/hold?s=1" > /dev/null &
+hold2=$!
+sleep 0.2
+
+res=$("$CURL" -s "$url/retry")
+wait $hold1 $hold2 || true
+
+if [ "$res" = ok ]; then
+    echo ok
+else
+    echo "FAIL: $res"
+    exit 1
+fi
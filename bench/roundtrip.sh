@@ -0,0 +1,64 @@
+#!/bin/sh
+# End to end create -> resume -> result benchmark: starts nginx with
+# roundtrip.conf for each threads/max_queue combination and measures tasks/sec
+# and latency percentiles with wrk. Each request runs exactly one task.
+#
+# environment:
+#   NGINX      nginx binary built with this module (default: nginx)
+#   WRK        wrk binary (default: wrk)
+#   THREADS    thread counts to test (default: "1 4 16")
+#   QUEUES     max_queue values to test (default: "64 65536")
+#   LOCATIONS  locations to test (default: "baseline noop sum echo")
+#   CONNS      concurrent connections (default: 64)
+#   DURATION   duration of each run (default: 10s)
+#   PORT       listening port (default: 12346)
+
+set -e
+
+NGINX=${NGINX:-nginx}
+WRK=${WRK:-wrk}
+THREADS=${THREADS:-"1 4 16"}
+QUEUES=${QUEUES:-"64 65536"}
+LOCATIONS=${LOCATIONS:-"baseline noop sum echo"}
+CONNS=${CONNS:-64}
+DURATION=${DURATION:-10s}
+PORT=${PORT:-12346}
+
+here=$(cd "$(dirname "$0")" && pwd)
+prefix=$(mktemp -d)
+trap 'kill $pid 2>/dev/null; rm -rf "$prefix"' EXIT INT TERM
+mkdir -p "$prefix/logs" "$prefix/conf"
+
+printf '%-8s %-9s %-10s %12s %9s %9s %9s %7s\n' \
+       threads max_queue location 'tasks/s' p50 p90 p99 errors
+
+for threads in $THREADS; do
+    for queue in $QUEUES; do
+        sed -e "s/@THREADS@/$threads/" -e "s/@MAX_QUEUE@/$queue/" \
+            -e "s/@PORT@/$PORT/" "$here/roundtrip.conf" \
+            > "$prefix/conf/nginx.conf"
+
+        "$NGINX" -p "$prefix" -c conf/nginx.conf &
+        pid=$!
+        sleep 1
+
+        for location in $LOCATIONS; do
+            "$WRK" -t2 -c"$CONNS" -d"$DURATION" --latency \
+                   "http://127.0.0.1:$PORT/$location" > "$prefix/wrk.out"
+
+            awk -v t="$threads" -v q="$queue" -v l="$location" '
+                /Requests\/sec/    { rps = $2 }
+                /^ +50%/           { p50 = $2 }
+                /^ +90%/           { p90 = $2 }
+                /^ +99%/           { p99 = $2 }
+                /Non-2xx|Socket errors/ { err = "yes" }
+                END {
+                    printf "%-8s %-9s %-10s %12s %9s %9s %9s %7s\n",
+                           t, q, l, rps, p50, p90, p99, err ? err : "no"
+                }' "$prefix/wrk.out"
+        done
+
+        kill "$pid"
+        wait "$pid" 2>/dev/null || true
+    done
+done
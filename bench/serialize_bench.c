@@ -0,0 +1,145 @@
+/*
+Copyright (c) 2016, Julien Desgats
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* encode/decode throughput of serialize.c for a few representative payloads.
+ *
+ * usage: serialize_bench [seconds per payload]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include "serialize.h"
+
+typedef struct {
+  const char *name;
+  const char *code;  /* returns the payload */
+} payload;
+
+static const payload payloads[] = {
+  { "scalars",
+    "return 42, -1.5, true, 'short', 1e300" },
+  { "long string (1 MB)",
+    "return string.rep('x', 1024 * 1024)" },
+  { "wide array (100k)",
+    "local t = {} for i = 1, 100000 do t[i] = i * 3 end return t" },
+  { "string array (10k)",
+    "local t = {} for i = 1, 10000 do t[i] = 'item ' .. i end return t" },
+  { "deep hash (8x8 levels)",
+    "local function mk(d)\n"
+    "  if d == 0 then return 'leaf' end\n"
+    "  local t = {}\n"
+    "  for i = 1, 8 do t['k' .. i] = (i == 1) and mk(d - 1) or i end\n"
+    "  return t\n"
+    "end\n"
+    "return mk(8)" },
+  { "records (1k, shared)",
+    "local meta = { kind = 'record', version = 3 }\n"
+    "local t = {}\n"
+    "for i = 1, 1000 do\n"
+    "  t[i] = { id = i, name = 'user' .. i, score = i / 7, meta = meta }\n"
+    "end\n"
+    "return t" },
+  { "function",
+    "return function(a, b)\n"
+    "  local s = 0\n"
+    "  for i = a, b do s = s + i * i end\n"
+    "  return s\n"
+    "end" },
+  { NULL, NULL }
+};
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(lua_State *L, const payload *p, double duration) {
+  luaser_buffer buf = { NULL, 0, 0, 0 };
+  double start, elapsed;
+  long n, iter;
+  int nvalues, top;
+
+  lua_settop(L, 0);
+  if (luaL_dostring(L, p->code) != 0) {
+    fprintf(stderr, "%s: %s\n", p->name, lua_tostring(L, -1));
+    exit(1);
+  }
+  nvalues = lua_gettop(L);
+
+  /* encode */
+  iter = 0;
+  start = now();
+  do {
+    for (n = 0; n < 16; n++) {
+      buf.len = 0;
+      luaser_encode_values(L, 1, nvalues, &buf);
+    }
+    iter += n;
+    elapsed = now() - start;
+  } while (elapsed < duration);
+
+  printf("%-24s %8zu bytes  encode %10.0f ops/s %9.1f MB/s",
+         p->name, buf.len, iter / elapsed, buf.len * iter / elapsed / 1e6);
+
+  /* decode (values are dropped right away, the GC cost is included) */
+  top = lua_gettop(L);
+  iter = 0;
+  start = now();
+  do {
+    for (n = 0; n < 16; n++) {
+      luaser_decode(L, buf.data, buf.len);
+      lua_settop(L, top);
+    }
+    iter += n;
+    elapsed = now() - start;
+  } while (elapsed < duration);
+
+  printf("  decode %10.0f ops/s %9.1f MB/s\n",
+         iter / elapsed, buf.len * iter / elapsed / 1e6);
+
+  luaser_buffer_free(&buf);
+}
+
+int main(int argc, char **argv) {
+  const payload *p;
+  double duration = argc > 1 ? atof(argv[1]) : 1.0;
+  lua_State *L = luaL_newstate();
+
+  luaL_openlibs(L);
+  for (p = payloads; p->name != NULL; p++) {
+    bench(L, p, duration);
+  }
+
+  lua_close(L);
+  return 0;
+}
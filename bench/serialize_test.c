@@ -0,0 +1,284 @@
+/*
+Copyright (c) 2016, Julien Desgats
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/* round trip checks of serialize.c: each case is a Lua chunk asserting on
+ * the values decoded from the frames it encodes. The cdata cases only run
+ * under LuaJIT.
+ *
+ * usage: serialize_test
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include "serialize.h"
+
+typedef struct {
+  const char *name;
+  const char *code;
+} testcase;
+
+/* helpers available to the cases: enc(...) returns the frame of its
+ * arguments, enc_ref(...) the frame by reference (strings from 16 bytes) and
+ * its anchors, move(anchors) detaches the buffers of such a frame, dec(frame)
+ * the decoded values, tag(frame) the type of the first value */
+static const char prelude[] =
+  "function roundtrip(...) return dec(enc(...)) end\n"
+  "function tag(frame) return frame:byte(8) end\n";
+
+static const testcase cases[] = {
+  { "FIXINT boundaries",
+    "assert(tag(enc(0)) == 0x40)\n"
+    "assert(tag(enc(63)) == 0x7f)\n"
+    "assert(tag(enc(64)) == 0x03)\n"
+    "assert(tag(enc(-1)) == 0x03)\n"
+    "for _, v in ipairs({ 0, 1, 62, 63 }) do\n"
+    "  assert(roundtrip(v) == v)\n"
+    "end" },
+  { "INT boundaries",
+    "local max = 2 ^ 53\n"
+    "assert(tag(enc(max)) == 0x03)\n"
+    "assert(tag(enc(-max)) == 0x03)\n"
+    "assert(tag(enc(max * 2)) == 0x04)\n"
+    "for _, v in ipairs({ 64, -1, -64, 127, 128, 2 ^ 31, -2 ^ 31, 2 ^ 32,\n"
+    "                     max, -max, max - 1, -max + 1 }) do\n"
+    "  assert(roundtrip(v) == v, v)\n"
+    "end" },
+  { "NUM boundaries",
+    "assert(tag(enc(0.5)) == 0x04)\n"
+    "for _, v in ipairs({ 0.5, -0.5, 1e-300, 1e300, 2 ^ 53 * 2, -2 ^ 60,\n"
+    "                     math.huge, -math.huge, 1 / 3 }) do\n"
+    "  assert(roundtrip(v) == v, v)\n"
+    "end" },
+  { "negative zero and NaN",
+    "local nz = -1 / math.huge\n"
+    "assert(tag(enc(nz)) == 0x04)\n"
+    "assert(1 / roundtrip(nz) == -math.huge)\n"
+    "assert(1 / roundtrip(0) == math.huge)\n"
+    "local nan = roundtrip(0 / 0)\n"
+    "assert(type(nan) == 'number' and nan ~= nan)" },
+  { "FIXSTR and STR",
+    "assert(tag(enc('')) == 0x80)\n"
+    "assert(tag(enc(('a'):rep(31))) == 0x9f)\n"
+    "assert(tag(enc(('a'):rep(32))) == 0x05)\n"
+    "for _, n in ipairs({ 0, 1, 31, 32, 127, 128, 16384, 100000 }) do\n"
+    "  local s = ('x'):rep(n)\n"
+    "  assert(roundtrip(s) == s, n)\n"
+    "end\n"
+    "assert(roundtrip('a\\0b') == 'a\\0b')" },
+  { "multiple values and nils",
+    "local a, b, c, d = roundtrip(nil, true, false, nil)\n"
+    "assert(select('#', roundtrip(nil, true, false, nil)) == 4)\n"
+    "assert(a == nil and b == true and c == false and d == nil)\n"
+    "assert(select('#', roundtrip()) == 0)" },
+  { "tables",
+    "local t = roundtrip({ 1, 2, 3, x = 'y', [10] = 10, [true] = {} })\n"
+    "assert(#t == 3 and t[3] == 3 and t.x == 'y' and t[10] == 10)\n"
+    "assert(type(t[true]) == 'table')" },
+  { "table refs and cycles",
+    "local shared = { 'shared' }\n"
+    "local t = { shared, shared, inner = { shared } }\n"
+    "t.self = t\n"
+    "local r = roundtrip(t)\n"
+    "assert(r.self == r)\n"
+    "assert(r[1] == r[2] and r.inner[1] == r[1] and r[1][1] == 'shared')\n"
+    "local x, y = roundtrip(shared, shared)\n"
+    "assert(x == y)" },
+  { "registered metatables",
+    "local mt = { __index = { kind = function() return 'point' end } }\n"
+    "register_metatable('point', mt)\n"
+    "local p = roundtrip(setmetatable({ x = 1 }, mt))\n"
+    "assert(getmetatable(p) == mt and p:kind() == 'point' and p.x == 1)\n"
+    "assert(not pcall(enc, setmetatable({}, {})))" },
+  { "functions",
+    "local f = roundtrip(function(a, b) return a * b end)\n"
+    "assert(f(6, 7) == 42)" },
+  { "BYTES",
+    "local b = buffer('abc')\n"
+    "local r = roundtrip(b)\n"
+    "assert(r ~= b and r:tostring() == 'abc' and #r == 3)\n"
+    "b:write(1, 'x')\n"
+    "assert(r:tostring() == 'abc' and b:tostring() == 'xbc')\n"
+    "assert(#roundtrip(buffer(0)) == 0)" },
+  { "BYTESREF and STRREF",
+    "local b = buffer('hello')\n"
+    "local s = ('y'):rep(100)\n"
+    "local frame, anchors = enc_ref(b, s, b)\n"
+    "assert(#frame < 100 and b:len() == 5)\n"
+    "move(anchors)\n"
+    "assert(not pcall(function() return b:len() end))\n"
+    "assert(not pcall(enc, b))\n"
+    "local r, rs, r2 = dec(frame)\n"
+    "anchors = nil\n"
+    "collectgarbage()\n"
+    "assert(r:tostring() == 'hello' and r2:tostring() == 'hello')\n"
+    "assert(rs == s)" },
+  { "BYTESREF dropped then encoded again",
+    "local b = buffer('hello')\n"
+    "local frame, anchors = enc_ref(b)\n"
+    "frame, anchors = nil, nil\n"
+    "collectgarbage()\n"
+    "b:write(1, 'j')\n"
+    "frame, anchors = enc_ref(b)\n"
+    "local frame2, anchors2 = enc_ref(b)\n"
+    "move(anchors2)\n"
+    "move(anchors)\n"
+    "assert(not pcall(function() return b:len() end))\n"
+    "anchors2 = nil\n"
+    "collectgarbage()\n"
+    "local r = dec(frame)\n"
+    "anchors = nil\n"
+    "collectgarbage()\n"
+    "assert(r:tostring() == 'jello')" },
+  { "CDATA",
+    "local ok, ffi = pcall(require, 'ffi')\n"
+    "if not ok then return end\n"
+    "ffi.cdef[[\n"
+    "  struct test_point { double x, y; };\n"
+    "  typedef struct { int a; } test_anon_t;\n"
+    "]]\n"
+    "local a = roundtrip(ffi.new('int[4]', 1, 2, 3, 4))\n"
+    "assert(a[0] == 1 and a[3] == 4)\n"
+    "assert(tonumber(roundtrip(ffi.new('double', 1.5))) == 1.5)\n"
+    "assert(tonumber(roundtrip(ffi.new('int64_t', -5))) == -5)\n"
+    "assert(not pcall(enc, ffi.new('struct test_point')))\n"
+    "register_cdata('struct test_point')\n"
+    "local p = roundtrip(ffi.new('struct test_point', 1, 2))\n"
+    "assert(p.x == 1 and p.y == 2)\n"
+    "local ps = roundtrip(ffi.new('struct test_point[2]', {{ 3, 4 }}))\n"
+    "assert(ps[0].y == 4)\n"
+    "assert(not pcall(enc, ffi.new('test_anon_t')))\n"
+    "assert(not pcall(register_cdata, 'struct 12'))\n"
+    "assert(not pcall(register_cdata, 'int'))\n"
+    "assert(not pcall(enc, ffi.new('int *')))\n"
+    "assert(not pcall(enc, ffi.cast('void (*)(void)', 0)))" },
+  { "truncated frames",
+    "local frames = {\n"
+    "  enc(1, 64, -1, 0.5, 'str', ('x'):rep(40), true, nil),\n"
+    "  enc({ 1, { 2, 3 }, x = { y = 'z' } }),\n"
+    "  enc(function() return 1 end),\n"
+    "  enc(buffer('abcdef')),\n"
+    "}\n"
+    "for n, frame in ipairs(frames) do\n"
+    "  assert(pcall(dec, frame))\n"
+    "  for i = 0, #frame - 1 do\n"
+    "    assert(not pcall(dec, frame:sub(1, i)), n .. ':' .. i)\n"
+    "  end\n"
+    "end\n"
+    "assert(not pcall(dec, '\\255' .. frames[1]:sub(2)))" },
+  { NULL, NULL }
+};
+
+static int l_enc(lua_State *L) {
+  luaser_buffer buf = { NULL, 0, 0, 0 };
+  luaser_encode_values(L, 1, lua_gettop(L), &buf);
+  lua_pushlstring(L, buf.data, buf.len);
+  luaser_buffer_free(&buf);
+  return 1;
+}
+
+static int l_enc_ref(lua_State *L) {
+  luaser_buffer buf = { NULL, 0, 0, 0 };
+  int n = lua_gettop(L);
+  lua_newtable(L);
+  luaser_encode_values_ref(L, 1, n, &buf, 16, n + 1);
+  lua_pushlstring(L, buf.data, buf.len);
+  luaser_buffer_free(&buf);
+  lua_pushvalue(L, n + 1);
+  return 2;
+}
+
+static int l_move(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  luaser_move_bytes(L, 1, 1, (int)lua_objlen(L, 1));
+  return 0;
+}
+
+static int l_dec(lua_State *L) {
+  size_t len;
+  const char *frame = luaL_checklstring(L, 1, &len);
+  int top = lua_gettop(L);
+  if (luaser_decode(L, frame, len) != len) {
+    return luaL_error(L, "trailing bytes");
+  }
+  return lua_gettop(L) - top;
+}
+
+static int l_register_metatable(lua_State *L) {
+  luaser_register_metatable(L, luaL_checkstring(L, 1), 2);
+  return 0;
+}
+
+static int l_register_cdata(lua_State *L) {
+  luaser_register_cdata(L, luaL_checkstring(L, 1));
+  return 0;
+}
+
+static const luaL_Reg helpers[] = {
+  { "enc", l_enc },
+  { "enc_ref", l_enc_ref },
+  { "move", l_move },
+  { "dec", l_dec },
+  { "buffer", luaser_bytes_new },
+  { "register_metatable", l_register_metatable },
+  { "register_cdata", l_register_cdata },
+  { NULL, NULL }
+};
+
+int main(void) {
+  const testcase *c;
+  const luaL_Reg *h;
+  int failed = 0;
+  lua_State *L = luaL_newstate();
+
+  luaL_openlibs(L);
+  for (h = helpers; h->name != NULL; h++) {
+    lua_register(L, h->name, h->func);
+  }
+  if (luaL_dostring(L, prelude) != 0) {
+    fprintf(stderr, "prelude: %s\n", lua_tostring(L, -1));
+    return 1;
+  }
+
+  for (c = cases; c->name != NULL; c++) {
+    if (luaL_loadbuffer(L, c->code, strlen(c->code), c->name) != 0
+        || lua_pcall(L, 0, 0, 0) != 0) {
+      printf("FAIL %s: %s\n", c->name, lua_tostring(L, -1));
+      lua_pop(L, 1);
+      failed++;
+    } else {
+      printf("ok   %s\n", c->name);
+    }
+  }
+
+  lua_close(L);
+  return failed ? 1 : 0;
+}
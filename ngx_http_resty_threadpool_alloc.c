@@ -0,0 +1,314 @@
+/*
+Copyright (c) 2016, Julien Desgats
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "ngx_http_resty_threadpool_alloc.h"
+
+/* Allocator of the task states: small blocks come from arenas owned by the
+ * state, so the threads running tasks do not fight over the malloc() locks,
+ * and closing a state releases its arenas in one go instead of block by
+ * block. Freed blocks are kept in free lists per size class for the next
+ * allocations of the same state; a state only runs in one thread at a time,
+ * so none of this is locked. Bigger blocks go to malloc().
+ *
+ * The allocator also counts the memory of the state: while a task runs (see
+ * alloc_enforce), allocations going over the limit fail, which raises a
+ * "not enough memory" error in the task.
+ *
+ * LuaJIT only accepts custom allocators in its GC64 mode on 64-bit targets:
+ * the default allocator is used otherwise.
+ */
+
+#define LUA_THREADPOOL_ALLOC_ALIGN    16
+#define LUA_THREADPOOL_ALLOC_CLASSES  6     /* 16 to 512 bytes */
+#define LUA_THREADPOOL_ALLOC_SMALL    512
+
+typedef struct ngx_http_resty_threadpool_chunk_s
+    ngx_http_resty_threadpool_chunk_t;
+
+struct ngx_http_resty_threadpool_chunk_s {
+    ngx_http_resty_threadpool_chunk_t  *next;
+    u_char                              pad[LUA_THREADPOOL_ALLOC_ALIGN
+                                            - sizeof(void *)];
+};
+
+typedef struct {
+    size_t                              used;     /* given to the state */
+    size_t                              limit;    /* 0 for none */
+    size_t                              exceeded; /* size of the allocation
+                                                     that failed, if any */
+    size_t                              chunk_size;
+    u_char                             *pos;      /* free space of the last */
+    u_char                             *last;     /* chunk */
+    ngx_http_resty_threadpool_chunk_t  *chunks;
+    void                               *free[LUA_THREADPOOL_ALLOC_CLASSES];
+    unsigned                            enforce:1;
+    unsigned                            closing:1;
+} ngx_http_resty_threadpool_arena_t;
+
+static ngx_uint_t
+ngx_http_resty_threadpool_alloc_class(size_t size)
+{
+    ngx_uint_t  c;
+
+    for (c = 0; (size_t) (16 << c) < size; c++) { /* void */ }
+    return c;
+}
+
+static void *
+ngx_http_resty_threadpool_alloc_small(ngx_http_resty_threadpool_arena_t *a,
+    ngx_uint_t c)
+{
+    ngx_http_resty_threadpool_chunk_t  *chunk;
+    void                               *p;
+    size_t                              size;
+
+    p = a->free[c];
+    if (p != NULL) {
+        a->free[c] = *(void **) p;
+        return p;
+    }
+
+    size = (size_t) 16 << c;
+    if ((size_t) (a->last - a->pos) < size) {
+        /* the rest of the current chunk is lost until the state is closed */
+        chunk = malloc(a->chunk_size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+
+        chunk->next = a->chunks;
+        a->chunks = chunk;
+        a->pos = (u_char *) (chunk + 1);
+        a->last = (u_char *) chunk + a->chunk_size;
+    }
+
+    p = a->pos;
+    a->pos += size;
+    return p;
+}
+
+static void
+ngx_http_resty_threadpool_alloc_release(ngx_http_resty_threadpool_arena_t *a,
+    void *p, size_t size)
+{
+    ngx_uint_t  c;
+
+    if (size > LUA_THREADPOOL_ALLOC_SMALL) {
+        free(p);
+        return;
+    }
+
+    if (a->closing) {
+        return; /* the chunks go away at once */
+    }
+
+    c = ngx_http_resty_threadpool_alloc_class(size);
+    *(void **) p = a->free[c];
+    a->free[c] = p;
+}
+
+static void *
+ngx_http_resty_threadpool_alloc(void *ud, void *ptr, size_t osize,
+    size_t nsize)
+{
+    ngx_http_resty_threadpool_arena_t *a = ud;
+    void                              *p;
+
+    if (ptr == NULL) {
+        osize = 0;
+    }
+
+    if (nsize == 0) {
+        if (ptr != NULL) {
+            a->used -= osize;
+            ngx_http_resty_threadpool_alloc_release(a, ptr, osize);
+        }
+
+        return NULL;
+    }
+
+    /* shrinking must not fail */
+    if (a->enforce && a->limit && nsize > osize
+        && a->used + (nsize - osize) > a->limit)
+    {
+        a->exceeded = nsize;
+        return NULL;
+    }
+
+    if (nsize > LUA_THREADPOOL_ALLOC_SMALL) {
+        if (osize > LUA_THREADPOOL_ALLOC_SMALL || ptr == NULL) {
+            p = realloc(ptr, nsize);
+            if (p == NULL) {
+                return NULL;
+            }
+
+        } else {
+            p = malloc(nsize);
+            if (p == NULL) {
+                return NULL;
+            }
+
+            ngx_memcpy(p, ptr, osize);
+            ngx_http_resty_threadpool_alloc_release(a, ptr, osize);
+        }
+
+    } else {
+        if (ptr != NULL
+            && osize <= LUA_THREADPOOL_ALLOC_SMALL
+            && ngx_http_resty_threadpool_alloc_class(osize)
+               == ngx_http_resty_threadpool_alloc_class(nsize))
+        {
+            a->used += nsize - osize;
+            return ptr;
+        }
+
+        p = ngx_http_resty_threadpool_alloc_small(a,
+                                  ngx_http_resty_threadpool_alloc_class(nsize));
+        if (p == NULL) {
+            if (ptr != NULL && nsize <= osize
+                && osize <= LUA_THREADPOOL_ALLOC_SMALL)
+            {
+                /* shrinking: keep the block */
+                a->used -= osize - nsize;
+                return ptr;
+            }
+
+            return NULL;
+        }
+
+        if (ptr != NULL) {
+            ngx_memcpy(p, ptr, ngx_min(osize, nsize));
+            ngx_http_resty_threadpool_alloc_release(a, ptr, osize);
+        }
+    }
+
+    a->used += nsize - osize;
+    return p;
+}
+
+/* creates a state using an arena allocator with chunks of the given size,
+ * and the given memory limit for tasks (0 for none) */
+lua_State *
+ngx_http_resty_threadpool_alloc_newstate(size_t arena, size_t limit,
+    ngx_log_t *log)
+{
+    static ngx_uint_t                  warned;
+    ngx_http_resty_threadpool_arena_t *a;
+    lua_State                         *L;
+
+    if (arena == 0 && limit == 0) {
+        return luaL_newstate();
+    }
+
+    a = ngx_calloc(sizeof(ngx_http_resty_threadpool_arena_t), log);
+    if (a == NULL) {
+        return NULL;
+    }
+
+    a->limit = limit;
+    a->chunk_size = ngx_max(arena, 4 * LUA_THREADPOOL_ALLOC_SMALL);
+
+    L = lua_newstate(ngx_http_resty_threadpool_alloc, a);
+    if (L == NULL) {
+        ngx_free(a);
+
+        if (!warned) {
+            ngx_log_error(NGX_LOG_WARN, log, 0,
+                          "custom Lua allocators are not supported, task "
+                          "states use the default one");
+            warned = 1;
+        }
+
+        return luaL_newstate();
+    }
+
+    return L;
+}
+
+static ngx_http_resty_threadpool_arena_t *
+ngx_http_resty_threadpool_alloc_arena(lua_State *L)
+{
+    void  *ud;
+
+    if (lua_getallocf(L, &ud) != ngx_http_resty_threadpool_alloc) {
+        return NULL;
+    }
+
+    return ud;
+}
+
+/* closes a state and releases its arenas */
+void
+ngx_http_resty_threadpool_alloc_close(lua_State *L)
+{
+    ngx_http_resty_threadpool_arena_t *a;
+    ngx_http_resty_threadpool_chunk_t *chunk;
+
+    a = ngx_http_resty_threadpool_alloc_arena(L);
+    if (a == NULL) {
+        lua_close(L);
+        return;
+    }
+
+    a->enforce = 0;
+    a->closing = 1;
+    lua_close(L);
+
+    while (a->chunks != NULL) {
+        chunk = a->chunks;
+        a->chunks = chunk->next;
+        free(chunk);
+    }
+
+    ngx_free(a);
+}
+
+/* the memory limit only applies while a task runs: restoring the state
+ * after it must not fail */
+void
+ngx_http_resty_threadpool_alloc_enforce(lua_State *L, ngx_uint_t on)
+{
+    ngx_http_resty_threadpool_arena_t *a;
+
+    a = ngx_http_resty_threadpool_alloc_arena(L);
+    if (a != NULL) {
+        a->enforce = on;
+        if (on) {
+            a->exceeded = 0;
+        }
+    }
+}
+
+/* size of the allocation refused by the memory limit, 0 if none was */
+size_t
+ngx_http_resty_threadpool_alloc_exceeded(lua_State *L)
+{
+    ngx_http_resty_threadpool_arena_t *a;
+
+    a = ngx_http_resty_threadpool_alloc_arena(L);
+    return a != NULL ? a->exceeded : 0;
+}
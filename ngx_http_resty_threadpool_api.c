@@ -0,0 +1,581 @@
+/*
+Copyright (c) 2016, Julien Desgats
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <ngx_md5.h>
+#include <ngx_sha1.h>
+
+#include "ngx_http_resty_threadpool_api.h"
+#include "ngx_http_resty_threadpool_regex.h"
+#include "ngx_http_resty_threadpool_resources.h"
+
+/* The ngx.* APIs of the task states. These states have no request nor event
+ * loop, so only the APIs making sense from any thread are provided, as a
+ * global ngx table created with each state:
+ *
+ * - ngx.shared.DICT: get, set, incr and delete on the lua_shared_dict zones,
+ *   under the slab mutex of the zone, as in the workers. The zone of a dict
+ *   is looked up on first use and kept in ngx.shared.
+ * - ngx.log and the log levels: the messages go to the log of the thread pool
+ *   running the task (ngx_log_error() is safe from any thread).
+ * - ngx.now, ngx.time and ngx.update_time, reading the cached time of the
+ *   worker like the other threads of nginx.
+ * - ngx.re.match, find and gsub (see ngx_http_resty_threadpool_regex.c).
+ * - ngx.md5, ngx.md5_bin, ngx.sha1_bin, ngx.encode_base64 and
+ *   ngx.decode_base64.
+ */
+
+/* registry key of the log of the running task */
+static char  ngx_http_resty_threadpool_api_log;
+
+#define LUA_THREADPOOL_SHDICT_MT_NAME "resty.threadpool.shdict"
+
+/* lua-nginx-module does not declare these in its headers: they are the C side
+ * of the shared dict API of lua-resty-core (as of lua-nginx-module 0.10.13) */
+int ngx_http_lua_ffi_shdict_get(ngx_shm_zone_t *zone, u_char *key,
+    size_t key_len, int *value_type, u_char **str_value_buf,
+    size_t *str_value_len, double *num_value, int *user_flags,
+    int get_stale, int *is_stale, char **errmsg);
+int ngx_http_lua_ffi_shdict_store(ngx_shm_zone_t *zone, int op,
+    u_char *key, size_t key_len, int value_type, u_char *str_value_buf,
+    size_t str_value_len, double num_value, long exptime, int user_flags,
+    char **errmsg, int *forcible);
+int ngx_http_lua_ffi_shdict_incr(ngx_shm_zone_t *zone, u_char *key,
+    size_t key_len, double *value, char **err, int has_init, double init,
+    long init_ttl, int *forcible);
+
+static ngx_shm_zone_t *
+ngx_http_resty_threadpool_api_shdict_check(lua_State *L, ngx_str_t *key)
+{
+    ngx_shm_zone_t  **zone;
+
+    zone = luaL_checkudata(L, 1, LUA_THREADPOOL_SHDICT_MT_NAME);
+    key->data = (u_char *) luaL_checklstring(L, 2, &key->len);
+
+    if (key->len == 0) {
+        luaL_argerror(L, 2, "empty key");
+        return NULL;
+    }
+
+    if (key->len > 65535) {
+        luaL_argerror(L, 2, "key too long");
+        return NULL;
+    }
+
+    return *zone;
+}
+
+static int
+ngx_http_resty_threadpool_api_shdict_get(lua_State *L)
+{
+    ngx_shm_zone_t  *zone;
+    ngx_str_t        key;
+    u_char           buf[256], *p;
+    size_t           len;
+    double           num;
+    int              type, flags, stale, rc;
+    char            *err;
+
+    zone = ngx_http_resty_threadpool_api_shdict_check(L, &key);
+
+    /* strings that do not fit in buf are copied to a malloc()ed buffer */
+    p = buf;
+    len = sizeof(buf);
+    flags = 0;
+    err = NULL;
+    rc = ngx_http_lua_ffi_shdict_get(zone, key.data, key.len, &type, &p, &len,
+                                     &num, &flags, 0, &stale, &err);
+    if (rc != NGX_OK) {
+        lua_pushnil(L);
+        lua_pushstring(L, err != NULL ? err : "no memory");
+        return 2;
+    }
+
+    switch (type) {
+    case LUA_TNIL:
+        lua_pushnil(L);
+        return 1;
+    case LUA_TBOOLEAN:
+        lua_pushboolean(L, *p);
+        break;
+    case LUA_TNUMBER:
+        lua_pushnumber(L, num);
+        break;
+    case LUA_TSTRING:
+        lua_pushlstring(L, (char *) p, len);
+        if (p != buf) {
+            ngx_free(p);
+        }
+        break;
+    default:
+        lua_pushnil(L);
+        lua_pushliteral(L, "value is a list");
+        return 2;
+    }
+
+    if (flags) {
+        lua_pushinteger(L, flags);
+        return 2;
+    }
+
+    return 1;
+}
+
+static int
+ngx_http_resty_threadpool_api_shdict_store(lua_State *L, ngx_shm_zone_t *zone,
+    ngx_str_t *key, int vidx, long exptime, int flags)
+{
+    /* stores the value at vidx (nil deletes the key), returns ok, err and
+     * forcible */
+    u_char  *str;
+    size_t   len;
+    double   num;
+    int      type, forcible, rc;
+    char    *err;
+
+    str = NULL;
+    len = 0;
+    num = 0;
+
+    type = lua_type(L, vidx);
+    switch (type) {
+    case LUA_TSTRING:
+        str = (u_char *) lua_tolstring(L, vidx, &len);
+        break;
+    case LUA_TNUMBER:
+        num = lua_tonumber(L, vidx);
+        break;
+    case LUA_TBOOLEAN:
+        num = lua_toboolean(L, vidx);
+        break;
+    case LUA_TNIL:
+    case LUA_TNONE:
+        type = LUA_TNIL;
+        break;
+    default:
+        return luaL_argerror(L, vidx, "bad value type");
+    }
+
+    forcible = 0;
+    err = NULL;
+    rc = ngx_http_lua_ffi_shdict_store(zone, 0, key->data, key->len, type,
+                                       str, len, num, exptime, flags, &err,
+                                       &forcible);
+    if (rc != NGX_OK) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, err != NULL ? err : "no memory");
+        lua_pushboolean(L, forcible);
+        return 3;
+    }
+
+    lua_pushboolean(L, 1);
+    lua_pushnil(L);
+    lua_pushboolean(L, forcible);
+    return 3;
+}
+
+static int
+ngx_http_resty_threadpool_api_shdict_set(lua_State *L)
+{
+    ngx_shm_zone_t  *zone;
+    ngx_str_t        key;
+    lua_Number       exptime;
+    lua_Integer      flags;
+
+    zone = ngx_http_resty_threadpool_api_shdict_check(L, &key);
+    exptime = luaL_optnumber(L, 4, 0);
+    luaL_argcheck(L, exptime >= 0, 4, "bad exptime");
+    flags = luaL_optinteger(L, 5, 0);
+
+    return ngx_http_resty_threadpool_api_shdict_store(L, zone, &key, 3,
+                                                      (long) (exptime * 1000),
+                                                      (int) flags);
+}
+
+static int
+ngx_http_resty_threadpool_api_shdict_delete(lua_State *L)
+{
+    ngx_shm_zone_t  *zone;
+    ngx_str_t        key;
+
+    zone = ngx_http_resty_threadpool_api_shdict_check(L, &key);
+    lua_settop(L, 2);
+    return ngx_http_resty_threadpool_api_shdict_store(L, zone, &key, 3, 0, 0);
+}
+
+static int
+ngx_http_resty_threadpool_api_shdict_incr(lua_State *L)
+{
+    ngx_shm_zone_t  *zone;
+    ngx_str_t        key;
+    double           value, init;
+    lua_Number       ttl;
+    int              has_init, forcible, rc;
+    char            *err;
+
+    zone = ngx_http_resty_threadpool_api_shdict_check(L, &key);
+    value = luaL_checknumber(L, 3);
+
+    has_init = !lua_isnoneornil(L, 4);
+    init = has_init ? luaL_checknumber(L, 4) : 0;
+    ttl = luaL_optnumber(L, 5, 0);
+    luaL_argcheck(L, ttl >= 0, 5, "bad init_ttl");
+
+    forcible = 0;
+    err = NULL;
+    rc = ngx_http_lua_ffi_shdict_incr(zone, key.data, key.len, &value, &err,
+                                      has_init, init, (long) (ttl * 1000),
+                                      &forcible);
+    if (rc != NGX_OK) {
+        lua_pushnil(L);
+        lua_pushstring(L, err != NULL ? err : "no memory");
+        return 2;
+    }
+
+    lua_pushnumber(L, value);
+    lua_pushnil(L);
+    lua_pushboolean(L, forcible);
+    return 3;
+}
+
+static int
+ngx_http_resty_threadpool_api_shared_index(lua_State *L)
+{
+    /* ngx.shared.DICT: looks the zone up and keeps it for the next uses */
+    ngx_shm_zone_t  **ud, *zone;
+    const char       *name;
+    size_t            len;
+
+    name = luaL_checklstring(L, 2, &len);
+    zone = ngx_http_lua_find_zone((u_char *) name, len);
+    if (zone == NULL) {
+        return 0;
+    }
+
+    ud = lua_newuserdata(L, sizeof(ngx_shm_zone_t *));
+    *ud = zone;
+    luaL_getmetatable(L, LUA_THREADPOOL_SHDICT_MT_NAME);
+    lua_setmetatable(L, -2);
+
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, 1);
+    return 1;
+}
+
+static const luaL_Reg  ngx_http_resty_threadpool_api_shdict[] = {
+    { "get", ngx_http_resty_threadpool_api_shdict_get },
+    { "set", ngx_http_resty_threadpool_api_shdict_set },
+    { "incr", ngx_http_resty_threadpool_api_shdict_incr },
+    { "delete", ngx_http_resty_threadpool_api_shdict_delete },
+    { NULL, NULL }
+};
+
+/* log of the running task, or of the cycle */
+ngx_log_t *
+ngx_http_resty_threadpool_api_get_log(lua_State *L)
+{
+    ngx_log_t  *log;
+
+    lua_pushlightuserdata(L, &ngx_http_resty_threadpool_api_log);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    log = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    return log != NULL ? log : ngx_cycle->log;
+}
+
+/* ngx.log(level, ...) */
+static int
+ngx_http_resty_threadpool_api_log_msg(lua_State *L)
+{
+    ngx_log_t    *log;
+    lua_Debug     ar;
+    luaL_Buffer   b;
+    const char   *msg;
+    size_t        len;
+    lua_Integer   level;
+    int           i, n;
+
+    level = luaL_checkinteger(L, 1);
+    if (level < NGX_LOG_STDERR || level > NGX_LOG_DEBUG) {
+        return luaL_error(L, "bad log level: %d", (int) level);
+    }
+
+    log = ngx_http_resty_threadpool_api_get_log(L);
+    if (log->log_level < (ngx_uint_t) level) {
+        return 0;
+    }
+
+    n = lua_gettop(L);
+    luaL_buffinit(L, &b);
+    luaL_addstring(&b, "[lua task] ");
+
+    if (lua_getstack(L, 1, &ar) && lua_getinfo(L, "Sl", &ar)) {
+        lua_pushfstring(L, "%s:%d: ", ar.short_src, ar.currentline);
+        luaL_addvalue(&b);
+    }
+
+    for (i = 2; i <= n; i++) {
+        switch (lua_type(L, i)) {
+        case LUA_TSTRING:
+        case LUA_TNUMBER:
+            lua_pushvalue(L, i);
+            break;
+        case LUA_TNIL:
+            lua_pushliteral(L, "nil");
+            break;
+        case LUA_TBOOLEAN:
+            lua_pushstring(L, lua_toboolean(L, i) ? "true" : "false");
+            break;
+        default:
+            if (!luaL_callmeta(L, i, "__tostring")
+                || !lua_isstring(L, -1))
+            {
+                return luaL_argerror(L, i, "string, number, boolean or nil "
+                                     "expected");
+            }
+        }
+
+        luaL_addvalue(&b);
+    }
+
+    luaL_pushresult(&b);
+    msg = lua_tolstring(L, -1, &len);
+    ngx_log_error((ngx_uint_t) level, log, 0, "%*s", len, msg);
+    return 0;
+}
+
+/* ngx.now() */
+static int
+ngx_http_resty_threadpool_api_now(lua_State *L)
+{
+    ngx_time_t  *tp;
+
+    tp = ngx_timeofday();
+    lua_pushnumber(L, tp->sec + tp->msec / 1000.0);
+    return 1;
+}
+
+/* ngx.time() */
+static int
+ngx_http_resty_threadpool_api_time(lua_State *L)
+{
+    lua_pushnumber(L, (lua_Number) ngx_time());
+    return 1;
+}
+
+/* ngx.update_time() */
+static int
+ngx_http_resty_threadpool_api_update_time(lua_State *L)
+{
+    /* skipped if another thread is already updating the time */
+    ngx_time_update();
+    return 0;
+}
+
+static void
+ngx_http_resty_threadpool_api_md5_digest(lua_State *L, u_char *digest)
+{
+    ngx_md5_t    md5;
+    const char  *s;
+    size_t       len;
+
+    s = luaL_optlstring(L, 1, "", &len);
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, s, len);
+    ngx_md5_final(digest, &md5);
+}
+
+/* ngx.md5(str) */
+static int
+ngx_http_resty_threadpool_api_md5(lua_State *L)
+{
+    u_char  digest[16], hex[32];
+
+    ngx_http_resty_threadpool_api_md5_digest(L, digest);
+    ngx_hex_dump(hex, digest, sizeof(digest));
+    lua_pushlstring(L, (char *) hex, sizeof(hex));
+    return 1;
+}
+
+/* ngx.md5_bin(str) */
+static int
+ngx_http_resty_threadpool_api_md5_bin(lua_State *L)
+{
+    u_char  digest[16];
+
+    ngx_http_resty_threadpool_api_md5_digest(L, digest);
+    lua_pushlstring(L, (char *) digest, sizeof(digest));
+    return 1;
+}
+
+/* ngx.sha1_bin(str) */
+static int
+ngx_http_resty_threadpool_api_sha1_bin(lua_State *L)
+{
+    ngx_sha1_t   sha;
+    u_char       digest[20];
+    const char  *s;
+    size_t       len;
+
+    s = luaL_optlstring(L, 1, "", &len);
+    ngx_sha1_init(&sha);
+    ngx_sha1_update(&sha, s, len);
+    ngx_sha1_final(digest, &sha);
+    lua_pushlstring(L, (char *) digest, sizeof(digest));
+    return 1;
+}
+
+/* ngx.encode_base64(str, no_padding?) */
+static int
+ngx_http_resty_threadpool_api_encode_base64(lua_State *L)
+{
+    ngx_str_t  src, dst;
+
+    src.data = (u_char *) luaL_optlstring(L, 1, "", &src.len);
+    dst.data = lua_newuserdata(L, ngx_base64_encoded_length(src.len));
+    ngx_encode_base64(&dst, &src);
+
+    if (lua_toboolean(L, 2)) {
+        while (dst.len > 0 && dst.data[dst.len - 1] == '=') {
+            dst.len--;
+        }
+    }
+
+    lua_pushlstring(L, (char *) dst.data, dst.len);
+    return 1;
+}
+
+/* ngx.decode_base64(str) */
+static int
+ngx_http_resty_threadpool_api_decode_base64(lua_State *L)
+{
+    ngx_str_t  src, dst;
+
+    src.data = (u_char *) luaL_checklstring(L, 1, &src.len);
+    dst.data = lua_newuserdata(L, ngx_base64_decoded_length(src.len) + 1);
+
+    if (ngx_decode_base64(&dst, &src) != NGX_OK) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lua_pushlstring(L, (char *) dst.data, dst.len);
+    return 1;
+}
+
+static const luaL_Reg  ngx_http_resty_threadpool_api_funcs[] = {
+    { "log", ngx_http_resty_threadpool_api_log_msg },
+    { "now", ngx_http_resty_threadpool_api_now },
+    { "time", ngx_http_resty_threadpool_api_time },
+    { "update_time", ngx_http_resty_threadpool_api_update_time },
+    { "md5", ngx_http_resty_threadpool_api_md5 },
+    { "md5_bin", ngx_http_resty_threadpool_api_md5_bin },
+    { "sha1_bin", ngx_http_resty_threadpool_api_sha1_bin },
+    { "encode_base64", ngx_http_resty_threadpool_api_encode_base64 },
+    { "decode_base64", ngx_http_resty_threadpool_api_decode_base64 },
+    { NULL, NULL }
+};
+
+static const struct {
+    const char  *name;
+    ngx_uint_t   level;
+} ngx_http_resty_threadpool_api_levels[] = {
+    { "STDERR", NGX_LOG_STDERR },
+    { "EMERG", NGX_LOG_EMERG },
+    { "ALERT", NGX_LOG_ALERT },
+    { "CRIT", NGX_LOG_CRIT },
+    { "ERR", NGX_LOG_ERR },
+    { "WARN", NGX_LOG_WARN },
+    { "NOTICE", NGX_LOG_NOTICE },
+    { "INFO", NGX_LOG_INFO },
+    { "DEBUG", NGX_LOG_DEBUG },
+    { NULL, 0 }
+};
+
+/* binds ngx.log to the log of the thread running the task (NULL when the
+ * task is over) */
+void
+ngx_http_resty_threadpool_api_set_log(lua_State *L, ngx_log_t *log)
+{
+    lua_pushlightuserdata(L, &ngx_http_resty_threadpool_api_log);
+    if (log != NULL) {
+        lua_pushlightuserdata(L, log);
+    } else {
+        lua_pushnil(L);
+    }
+    lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+/* require "resty.threadpool.buffer" */
+static int
+ngx_http_resty_threadpool_api_open_buffer(lua_State *L)
+{
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, luaser_bytes_new);
+    lua_setfield(L, -2, "new");
+    return 1;
+}
+
+/* sets the ngx global of a new task state */
+void
+ngx_http_resty_threadpool_api_init(lua_State *L)
+{
+    ngx_uint_t  i;
+
+    luaL_newmetatable(L, LUA_THREADPOOL_SHDICT_MT_NAME);
+    luaL_register(L, NULL, ngx_http_resty_threadpool_api_shdict);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    lua_newtable(L);             /* ngx */
+    luaL_register(L, NULL, ngx_http_resty_threadpool_api_funcs);
+
+    for (i = 0; ngx_http_resty_threadpool_api_levels[i].name; i++) {
+        lua_pushinteger(L, ngx_http_resty_threadpool_api_levels[i].level);
+        lua_setfield(L, -2, ngx_http_resty_threadpool_api_levels[i].name);
+    }
+
+    ngx_http_resty_threadpool_regex_init(L);
+    ngx_http_resty_threadpool_resources_init(L);
+
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "preload");
+    lua_pushcfunction(L, ngx_http_resty_threadpool_api_open_buffer);
+    lua_setfield(L, -2, "resty.threadpool.buffer");
+    lua_pop(L, 2);
+
+    lua_newtable(L);             /* ngx.shared */
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, ngx_http_resty_threadpool_api_shared_index);
+    lua_setfield(L, -2, "__index");
+    lua_setmetatable(L, -2);
+    lua_setfield(L, -2, "shared");
+
+    lua_setglobal(L, "ngx");
+}
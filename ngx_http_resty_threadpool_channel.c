@@ -0,0 +1,696 @@
+/*
+Copyright (c) 2016, Julien Desgats
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "ngx_http_resty_threadpool_channel.h"
+#include "ngx_http_resty_threadpool_wait.h"
+#include "serialize.h"
+
+#if (NGX_HAVE_EVENTFD)
+#include <sys/eventfd.h>
+#include <poll.h>
+#endif
+
+/* Channels stream values from a running task to the request: the task sends
+ * messages while it keeps running, the request coroutine receives them one
+ * by one.
+ *
+ * A channel is a ring of serialized messages with a single producer (the
+ * task, in a worker thread) and a single consumer (the request, in the main
+ * thread), so it needs no lock: each side only moves its own index. The
+ * message buffers are swapped rather than freed, a channel allocates nothing
+ * once its buffers are big enough.
+ *
+ * A side about to sleep sets its waiting flag, then checks the ring again;
+ * the other side clears the flag after moving its index and, if it was set,
+ * writes to the eventfd of the sleeper. The consumer eventfd is watched by the
+ * event loop, the producer one is polled by the worker thread: the memory
+ * taken by a stream is bounded by the size of the ring.
+ *
+ * The channel is shared by the consumer userdata, the task and the producer
+ * userdata in the task state, and freed by the last one to let it go.
+ */
+
+#define LUA_THREADPOOL_CHANNEL_MT_NAME  "resty.threadpool.channel"
+#define LUA_THREADPOOL_PRODUCER_MT_NAME "resty.threadpool.channel.producer"
+
+#define LUA_THREADPOOL_CHANNEL_SIZE     16
+#define LUA_THREADPOOL_CHANNEL_MAX      4096
+#define LUA_THREADPOOL_CHANNEL_POLL     1000    /* ms, to see cancellations */
+
+typedef struct {
+    luaser_buffer  buf;
+    ngx_int_t      n;
+} ngx_http_resty_threadpool_message_t;
+
+struct ngx_http_resty_threadpool_channel_s {
+    ngx_atomic_t                         refs;
+    ngx_atomic_t                         head;    /* next message to read */
+    ngx_atomic_t                         tail;    /* next message to write */
+    ngx_atomic_t                         producer_closed;
+    ngx_atomic_t                         consumer_closed;
+    ngx_atomic_t                         recv_waiting;
+    ngx_atomic_t                         send_waiting;
+    int                                  recv_fd; /* eventfd, event loop */
+    int                                  send_fd; /* eventfd, polled */
+    ngx_connection_t                    *conn;    /* of recv_fd */
+    ngx_http_request_t                  *r;       /* waiting consumer */
+    ngx_http_lua_co_ctx_t               *coctx;
+    ngx_int_t                            nres;
+    luaser_buffer                        current; /* last message read */
+    ngx_uint_t                           size;
+    ngx_http_resty_threadpool_message_t  ring[1];
+};
+
+#if (NGX_HAVE_EVENTFD)
+
+static void
+ngx_http_resty_threadpool_channel_signal(int fd)
+{
+    uint64_t  one = 1;
+
+    (void) write(fd, &one, sizeof(uint64_t));
+}
+
+static void
+ngx_http_resty_threadpool_channel_drain(int fd)
+{
+    uint64_t  n;
+
+    (void) read(fd, &n, sizeof(uint64_t));
+}
+
+void
+ngx_http_resty_threadpool_channel_unref(
+    ngx_http_resty_threadpool_channel_t *ch)
+{
+    /* from any thread */
+    ngx_uint_t  i;
+
+    if (ngx_atomic_fetch_add(&ch->refs, -1) != 1) {
+        return;
+    }
+
+    close(ch->recv_fd);
+    close(ch->send_fd);
+
+    for (i = 0; i < ch->size; i++) {
+        luaser_buffer_free(&ch->ring[i].buf);
+    }
+
+    luaser_buffer_free(&ch->current);
+    ngx_free(ch);
+}
+
+void
+ngx_http_resty_threadpool_channel_close_producer(
+    ngx_http_resty_threadpool_channel_t *ch)
+{
+    /* from any thread: the consumer gets the messages left, then nil */
+    if (ngx_atomic_cmp_set(&ch->producer_closed, 0, 1)
+        && ngx_atomic_cmp_set(&ch->recv_waiting, 1, 0))
+    {
+        ngx_http_resty_threadpool_channel_signal(ch->recv_fd);
+    }
+}
+
+void
+ngx_http_resty_threadpool_channel_interrupt(
+    ngx_http_resty_threadpool_channel_t *ch)
+{
+    /* the task is cancelled: wakes it up if it waits for room */
+    ngx_http_resty_threadpool_channel_signal(ch->send_fd);
+}
+
+static ngx_int_t
+ngx_http_resty_threadpool_channel_pop(lua_State *L, lua_State *co,
+    ngx_http_resty_threadpool_channel_t *ch, ngx_log_t *log)
+{
+    /* main thread: pushes the values of the next message into co and returns
+     * their count, NGX_DECLINED if there is none */
+    ngx_http_resty_threadpool_message_t *msg;
+    luaser_buffer                        buf;
+    ngx_atomic_uint_t                    head;
+    ngx_int_t                            n;
+
+    head = ch->head;
+    if (head == ch->tail) {
+        return NGX_DECLINED;
+    }
+
+    ngx_memory_barrier();
+
+    /* the message buffer is kept to decode it, the producer gets the one of
+     * the previous message instead */
+    msg = &ch->ring[head % ch->size];
+    buf = ch->current;
+    ch->current = msg->buf;
+    msg->buf = buf;
+    n = msg->n;
+
+    ngx_memory_barrier();
+    ch->head = head + 1;
+
+    if (ngx_atomic_cmp_set(&ch->send_waiting, 1, 0)) {
+        ngx_http_resty_threadpool_channel_signal(ch->send_fd);
+    }
+
+    if (ngx_http_resty_threadpool_decode_values(L, co, &ch->current, n, log)
+        != NGX_OK)
+    {
+        lua_pushnil(co);
+        lua_pushliteral(co, "failed to deserialize message");
+        return 2;
+    }
+
+    return n;
+}
+
+static ngx_int_t
+ngx_http_resty_threadpool_channel_resume_handler(ngx_http_request_t *r)
+{
+    ngx_http_lua_ctx_t                  *ctx;
+    ngx_http_resty_threadpool_channel_t *ch;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ch = ctx->cur_co_ctx->data;
+    return ngx_http_resty_threadpool_wait_run(r, ctx, ch->nres);
+}
+
+static void
+ngx_http_resty_threadpool_channel_cleanup(void *data)
+{
+    /* the receiving coroutine is gone */
+    ngx_http_lua_co_ctx_t               *coctx = data;
+    ngx_http_resty_threadpool_channel_t *ch = coctx->data;
+
+    (void) ngx_atomic_cmp_set(&ch->recv_waiting, 1, 0);
+    ch->r = NULL;
+    ch->coctx = NULL;
+}
+
+static ngx_int_t
+ngx_http_resty_threadpool_channel_sleep(
+    ngx_http_resty_threadpool_channel_t *ch)
+{
+    /* main thread: arms the wakeup of the consumer, NGX_DECLINED if there is
+     * something to read already */
+    (void) ngx_atomic_cmp_set(&ch->recv_waiting, 0, 1);
+
+    if (ch->head != ch->tail || ch->producer_closed) {
+        (void) ngx_atomic_cmp_set(&ch->recv_waiting, 1, 0);
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_resty_threadpool_channel_event(ngx_event_t *ev)
+{
+    /* the producer sent a message or closed the channel */
+    ngx_connection_t                    *c = ev->data;
+    ngx_http_resty_threadpool_channel_t *ch = c->data;
+    ngx_http_request_t                  *r;
+    ngx_http_lua_ctx_t                  *luactx;
+    ngx_http_lua_co_ctx_t               *coctx;
+    lua_State                           *vm;
+    ngx_int_t                            n;
+
+    ngx_http_resty_threadpool_channel_drain(ch->recv_fd);
+    ev->ready = 0;
+    (void) ngx_handle_read_event(ev, 0);
+
+    r = ch->r;
+    coctx = ch->coctx;
+    if (coctx == NULL) {
+        return;
+    }
+
+    if (ngx_http_resty_threadpool_channel_sleep(ch) == NGX_OK) {
+        return; /* spurious */
+    }
+
+    luactx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (luactx == NULL) {
+        return;
+    }
+
+    ch->r = NULL;
+    ch->coctx = NULL;
+    coctx->cleanup = NULL;
+
+    vm = ngx_http_lua_get_lua_vm(r, luactx);
+    n = ngx_http_resty_threadpool_channel_pop(vm, coctx->co, ch,
+                                              r->connection->log);
+    if (n == NGX_DECLINED) {
+        /* closed and drained */
+        lua_pushnil(coctx->co);
+        lua_pushliteral(coctx->co, "closed");
+        n = 2;
+    }
+
+    ch->nres = n;
+    c = r->connection;
+    ngx_http_resty_threadpool_wait_continue(r, luactx, coctx,
+                            ngx_http_resty_threadpool_channel_resume_handler);
+    ngx_http_run_posted_requests(c);
+}
+
+static void
+ngx_http_resty_threadpool_channel_close_consumer(
+    ngx_http_resty_threadpool_channel_t *ch)
+{
+    /* main thread: the producer gets "closed" from now on */
+    ngx_connection_t  *c = ch->conn;
+
+    ch->consumer_closed = 1;
+    ngx_memory_barrier();
+    ngx_http_resty_threadpool_channel_signal(ch->send_fd);
+
+    /* the eventfd is closed with the channel, the producer may still write
+     * to it */
+    if (c->read->active) {
+        (void) ngx_del_event(c->read, NGX_READ_EVENT, 0);
+    }
+
+    if (c->read->posted) {
+        ngx_delete_posted_event(c->read);
+    }
+
+    ngx_free_connection(c);
+    ch->conn = NULL;
+}
+
+static ngx_http_resty_threadpool_channel_t *
+ngx_http_resty_threadpool_channel_new(ngx_uint_t size, size_t max,
+    ngx_log_t *log)
+{
+    ngx_http_resty_threadpool_channel_t *ch;
+    ngx_connection_t                    *c;
+    ngx_uint_t                           i;
+
+    ch = ngx_calloc(sizeof(ngx_http_resty_threadpool_channel_t)
+                    + (size - 1) * sizeof(ngx_http_resty_threadpool_message_t),
+                    log);
+    if (ch == NULL) {
+        return NULL;
+    }
+
+    ch->size = size;
+    ch->current.max = max;
+    for (i = 0; i < size; i++) {
+        ch->ring[i].buf.max = max;
+    }
+
+    ch->recv_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ch->send_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ch->recv_fd == -1 || ch->send_fd == -1) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno, "eventfd() failed");
+        goto failed;
+    }
+
+    c = ngx_get_connection(ch->recv_fd, log);
+    if (c == NULL) {
+        goto failed;
+    }
+
+    c->data = ch;
+    c->read->handler = ngx_http_resty_threadpool_channel_event;
+    c->read->log = log;
+    ch->conn = c;
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_free_connection(c);
+        goto failed;
+    }
+
+    /* the consumer and the task */
+    ch->refs = 2;
+    return ch;
+
+failed:
+    if (ch->recv_fd != -1) {
+        close(ch->recv_fd);
+    }
+
+    if (ch->send_fd != -1) {
+        close(ch->send_fd);
+    }
+
+    ngx_free(ch);
+    return NULL;
+}
+
+/*****************/
+/* Producer side */
+/*****************/
+
+/* out:send(...) */
+static int
+ngx_http_resty_threadpool_channel_send(lua_State *L)
+{
+    ngx_http_resty_threadpool_channel_t **ud, *ch;
+    ngx_http_resty_threadpool_message_t  *msg;
+    ngx_http_resty_threadpool_state_t    *thread;
+    ngx_atomic_uint_t                     tail;
+    struct pollfd                         pfd;
+    int                                   n;
+
+    ud = luaL_checkudata(L, 1, LUA_THREADPOOL_PRODUCER_MT_NAME);
+    ch = *ud;
+    n = lua_gettop(L) - 1;
+
+    if (ch == NULL || ch->producer_closed) {
+        return luaL_error(L, "channel closed");
+    }
+
+    thread = ngx_http_resty_threadpool_task_current(L);
+
+    for ( ;; ) {
+        if (ch->consumer_closed) {
+            lua_pushnil(L);
+            lua_pushliteral(L, "closed");
+            return 2;
+        }
+
+        if (thread != NULL && thread->cancelled) {
+            return luaL_error(L, "lua task cancelled");
+        }
+
+        tail = ch->tail;
+        if (tail - ch->head < ch->size) {
+            break;
+        }
+
+        /* full: wait for the consumer to make room */
+        (void) ngx_atomic_cmp_set(&ch->send_waiting, 0, 1);
+        if (tail - ch->head >= ch->size && !ch->consumer_closed) {
+            pfd.fd = ch->send_fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            (void) poll(&pfd, 1, LUA_THREADPOOL_CHANNEL_POLL);
+        }
+
+        (void) ngx_atomic_cmp_set(&ch->send_waiting, 1, 0);
+        ngx_http_resty_threadpool_channel_drain(ch->send_fd);
+    }
+
+    /* the slot at tail belongs to the producer until tail moves */
+    msg = &ch->ring[tail % ch->size];
+    msg->buf.len = 0;
+    luaser_encode_values(L, 2, n, &msg->buf);
+    msg->n = n;
+
+    ngx_memory_barrier();
+    ch->tail = tail + 1;
+
+    if (ngx_atomic_cmp_set(&ch->recv_waiting, 1, 0)) {
+        ngx_http_resty_threadpool_channel_signal(ch->recv_fd);
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/* out:close() */
+static int
+ngx_http_resty_threadpool_channel_producer_close(lua_State *L)
+{
+    ngx_http_resty_threadpool_channel_t **ud;
+
+    ud = luaL_checkudata(L, 1, LUA_THREADPOOL_PRODUCER_MT_NAME);
+    if (*ud != NULL) {
+        ngx_http_resty_threadpool_channel_close_producer(*ud);
+    }
+
+    return 0;
+}
+
+static int
+ngx_http_resty_threadpool_channel_producer_gc(lua_State *L)
+{
+    ngx_http_resty_threadpool_channel_t **ud;
+
+    ud = luaL_checkudata(L, 1, LUA_THREADPOOL_PRODUCER_MT_NAME);
+    if (*ud != NULL) {
+        ngx_http_resty_threadpool_channel_close_producer(*ud);
+        ngx_http_resty_threadpool_channel_unref(*ud);
+        *ud = NULL;
+    }
+
+    return 0;
+}
+
+static const luaL_Reg  ngx_http_resty_threadpool_producer_mt[] = {
+    { "send", ngx_http_resty_threadpool_channel_send },
+    { "close", ngx_http_resty_threadpool_channel_producer_close },
+    { "__gc", ngx_http_resty_threadpool_channel_producer_gc },
+    { NULL, NULL }
+};
+
+/* pushes the producer end of the channel into co, the first argument of a
+ * streaming task */
+void
+ngx_http_resty_threadpool_channel_push(lua_State *co,
+    ngx_http_resty_threadpool_channel_t *ch)
+{
+    ngx_http_resty_threadpool_channel_t **ud;
+
+    ud = lua_newuserdata(co, sizeof(ngx_http_resty_threadpool_channel_t *));
+    *ud = ch;
+    (void) ngx_atomic_fetch_add(&ch->refs, 1);
+
+    if (luaL_newmetatable(co, LUA_THREADPOOL_PRODUCER_MT_NAME)) {
+        luaL_register(co, NULL, ngx_http_resty_threadpool_producer_mt);
+        lua_pushvalue(co, -1);
+        lua_setfield(co, -2, "__index");
+    }
+
+    lua_setmetatable(co, -2);
+}
+
+/*****************/
+/* Consumer side */
+/*****************/
+
+/* ch:recv() */
+static int
+ngx_http_resty_threadpool_channel_recv(lua_State *L)
+{
+    ngx_http_resty_threadpool_channel_t **ud, *ch;
+    ngx_http_request_t                   *r;
+    ngx_http_lua_ctx_t                   *luactx;
+    ngx_http_lua_co_ctx_t                *coctx;
+    ngx_int_t                             n;
+
+    ud = luaL_checkudata(L, 1, LUA_THREADPOOL_CHANNEL_MT_NAME);
+    ch = *ud;
+    lua_settop(L, 1);  /* keeps the channel alive while waiting */
+
+    if (ch == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    if (ch->coctx != NULL) {
+        return luaL_error(L, "channel already waited on");
+    }
+
+    coctx = ngx_http_resty_threadpool_wait_current(L, &r, &luactx);
+
+    for ( ;; ) {
+        n = ngx_http_resty_threadpool_channel_pop(L, L, ch,
+                                                  r->connection->log);
+        if (n != NGX_DECLINED) {
+            return (int) n;
+        }
+
+        if (ch->producer_closed) {
+            /* messages sent before the close are in the ring by now */
+            n = ngx_http_resty_threadpool_channel_pop(L, L, ch,
+                                                      r->connection->log);
+            if (n != NGX_DECLINED) {
+                return (int) n;
+            }
+
+            lua_pushnil(L);
+            lua_pushliteral(L, "closed");
+            return 2;
+        }
+
+        if (ngx_http_resty_threadpool_channel_sleep(ch) == NGX_OK) {
+            break;
+        }
+    }
+
+    ch->r = r;
+    ch->coctx = coctx;
+
+    ngx_http_lua_cleanup_pending_operation(coctx);
+    coctx->cleanup = ngx_http_resty_threadpool_channel_cleanup;
+    coctx->data = ch;
+
+    return lua_yield(L, 0);
+}
+
+/* ch:close() */
+static int
+ngx_http_resty_threadpool_channel_close(lua_State *L)
+{
+    ngx_http_resty_threadpool_channel_t **ud, *ch;
+
+    ud = luaL_checkudata(L, 1, LUA_THREADPOOL_CHANNEL_MT_NAME);
+    ch = *ud;
+    if (ch == NULL) {
+        return 0;
+    }
+
+    if (ch->coctx != NULL) {
+        return luaL_error(L, "channel is waited on");
+    }
+
+    ngx_http_resty_threadpool_channel_close_consumer(ch);
+    ngx_http_resty_threadpool_channel_unref(ch);
+    *ud = NULL;
+    return 0;
+}
+
+static int
+ngx_http_resty_threadpool_channel_gc(lua_State *L)
+{
+    ngx_http_resty_threadpool_channel_t **ud;
+
+    ud = luaL_checkudata(L, 1, LUA_THREADPOOL_CHANNEL_MT_NAME);
+    if (*ud != NULL) {
+        ngx_http_resty_threadpool_channel_close_consumer(*ud);
+        ngx_http_resty_threadpool_channel_unref(*ud);
+        *ud = NULL;
+    }
+
+    return 0;
+}
+
+static const luaL_Reg  ngx_http_resty_threadpool_channel_mt[] = {
+    { "recv", ngx_http_resty_threadpool_channel_recv },
+    { "close", ngx_http_resty_threadpool_channel_close },
+    { "__gc", ngx_http_resty_threadpool_channel_gc },
+    { NULL, NULL }
+};
+
+/* task:stream(size?): attaches a channel to a task that has not run yet and
+ * starts it, returns the consumer end */
+int
+ngx_http_resty_threadpool_channel_open(lua_State *L)
+{
+    ngx_http_resty_threadpool_channel_t **ud, *ch;
+    ngx_http_resty_threadpool_state_t    *thread;
+    lua_Integer                           size;
+
+    thread = luaL_checkudata(L, 1, LUA_THREADPOOL_MT_NAME);
+    size = luaL_optinteger(L, 2, LUA_THREADPOOL_CHANNEL_SIZE);
+    luaL_argcheck(L, size > 0 && size <= LUA_THREADPOOL_CHANNEL_MAX, 2,
+                  "bad channel size");
+
+    if (thread->status != LUA_THREADPOOL_TASK_CREATED
+        || thread->channel != NULL || thread->map || thread->group != NULL)
+    {
+        return luaL_error(L, "task already started");
+    }
+
+    ch = ngx_http_resty_threadpool_channel_new((ngx_uint_t) size,
+                                               thread->res.max,
+                                               ngx_cycle->log);
+    if (ch == NULL) {
+        return luaL_error(L, "failed to create channel");
+    }
+
+    ud = lua_newuserdata(L, sizeof(ngx_http_resty_threadpool_channel_t *));
+    *ud = ch;
+    luaL_getmetatable(L, LUA_THREADPOOL_CHANNEL_MT_NAME);
+    lua_setmetatable(L, -2);
+
+    thread->channel = ch;
+    if (ngx_http_resty_threadpool_wait_start(L, 1) != NGX_OK) {
+        thread->channel = NULL;
+        ngx_http_resty_threadpool_channel_unref(ch);
+        return luaL_error(L, "failed to post task to queue");
+    }
+
+    return 1;
+}
+
+#else /* !NGX_HAVE_EVENTFD */
+
+void
+ngx_http_resty_threadpool_channel_push(lua_State *co,
+    ngx_http_resty_threadpool_channel_t *ch)
+{
+}
+
+void
+ngx_http_resty_threadpool_channel_close_producer(
+    ngx_http_resty_threadpool_channel_t *ch)
+{
+}
+
+void
+ngx_http_resty_threadpool_channel_interrupt(
+    ngx_http_resty_threadpool_channel_t *ch)
+{
+}
+
+void
+ngx_http_resty_threadpool_channel_unref(
+    ngx_http_resty_threadpool_channel_t *ch)
+{
+}
+
+int
+ngx_http_resty_threadpool_channel_open(lua_State *L)
+{
+    return luaL_error(L, "channels need eventfd support");
+}
+
+#endif /* NGX_HAVE_EVENTFD */
+
+/* creates the metatable of the consumer end in the request VM */
+void
+ngx_http_resty_threadpool_channel_init(lua_State *L)
+{
+#if (NGX_HAVE_EVENTFD)
+    luaL_newmetatable(L, LUA_THREADPOOL_CHANNEL_MT_NAME);
+    luaL_register(L, NULL, ngx_http_resty_threadpool_channel_mt);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+#endif
+}
@@ -0,0 +1,45 @@
+/*
+Copyright (c) 2016, Julien Desgats
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef _NGX_HTTP_RESTY_THREADPOOL_CHANNEL_H_INCLUDED_
+#define _NGX_HTTP_RESTY_THREADPOOL_CHANNEL_H_INCLUDED_
+
+#include "ngx_http_resty_threadpool_common.h"
+
+void ngx_http_resty_threadpool_channel_init(lua_State *L);
+void ngx_http_resty_threadpool_channel_push(lua_State *co,
+    ngx_http_resty_threadpool_channel_t *ch);
+void ngx_http_resty_threadpool_channel_close_producer(
+    ngx_http_resty_threadpool_channel_t *ch);
+void ngx_http_resty_threadpool_channel_interrupt(
+    ngx_http_resty_threadpool_channel_t *ch);
+void ngx_http_resty_threadpool_channel_unref(
+    ngx_http_resty_threadpool_channel_t *ch);
+
+int ngx_http_resty_threadpool_channel_open(lua_State *L);
+
+#endif /* _NGX_HTTP_RESTY_THREADPOOL_CHANNEL_H_INCLUDED_ */
@@ -0,0 +1,560 @@
+/*
+Copyright (c) 2016, Julien Desgats
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "ngx_http_resty_threadpool_code.h"
+#include "ngx_http_resty_threadpool_resident.h"
+#include "serialize.h"
+
+/* Task function caches. The same functions are usually spawned over and over,
+ * so both sides of the serialization are cached:
+ *
+ * - in the request VM, the serialized function is kept in a weak table keyed
+ *   by the function itself (saves lua_dump);
+ * - in the task states, the loaded function is kept in a table keyed by its
+ *   serialized form, which identifies the bytecode exactly (saves
+ *   luaL_loadbuffer). This also works for closures created again for each
+ *   request, as their bytecode is the same.
+ */
+
+/* Named tasks: functions registered with threadpool.register() at init time.
+ * The definitions are kept in the request VM and loaded once in each task
+ * state; spawning a named task only sends the name. Task states can be created
+ * by the threads of the pools, so they load the definitions from a copy made
+ * by the main thread (code_save), which only changes at init time.
+ *
+ * Metatables registered with threadpool.register_metatable() are loaded the
+ * same way, and registered into the serializer of each state so tables using
+ * them can be passed to and returned by tasks. So are the cdata types
+ * registered with threadpool.register_cdata(), kept in the same table.
+ */
+
+#define LUA_THREADPOOL_NAMED_KEY "resty.threadpool.named"
+#define LUA_THREADPOOL_NAMED_GEN_KEY "resty.threadpool.named.gen"
+#define LUA_THREADPOOL_METATABLES_KEY "resty.threadpool.metatables"
+#define LUA_THREADPOOL_DUMPS_KEY "resty.threadpool.dumps"
+#define LUA_THREADPOOL_FUNCTIONS_KEY "resty.threadpool.functions"
+#define LUA_THREADPOOL_FUNCTIONS_MAX 256
+
+typedef struct {
+    const char  *name;
+    size_t       namelen;
+    const char  *code;      /* serialized function, or */
+    size_t       codelen;
+    const char  *module;    /* module returning the function */
+    const char  *field;     /* or the table holding it */
+    unsigned     metatable:1;
+    unsigned     cdata:1;
+} ngx_http_resty_threadpool_named_t;
+
+typedef struct {
+    ngx_http_resty_threadpool_named_t  *defs;  /* metatables first */
+    ngx_uint_t                          ndefs;
+    lua_Integer                         gen;
+} ngx_http_resty_threadpool_defs_t;
+
+static ngx_http_resty_threadpool_defs_t  ngx_http_resty_threadpool_defs;
+
+/* the request side runs in the main thread only, the load counters are shared
+ * by all threads */
+static ngx_uint_t     ngx_http_resty_threadpool_dump_hits;
+static ngx_uint_t     ngx_http_resty_threadpool_dump_misses;
+static ngx_atomic_t   ngx_http_resty_threadpool_load_hits;
+static ngx_atomic_t   ngx_http_resty_threadpool_load_misses;
+
+/* prepares the loaded functions cache of a task state */
+void
+ngx_http_resty_threadpool_code_init(lua_State *L)
+{
+    lua_newtable(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, LUA_THREADPOOL_FUNCTIONS_KEY);
+    lua_newtable(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, LUA_THREADPOOL_NAMED_KEY);
+}
+
+static void
+ngx_http_resty_threadpool_code_require(lua_State *L, const char *module,
+    const char *field)
+{
+    /* pushes require(module)[field] */
+    lua_getglobal(L, "require");
+    lua_pushstring(L, module);
+    lua_call(L, 1, 1);
+
+    if (field != NULL) {
+        if (!lua_istable(L, -1)) {
+            luaL_error(L, "module '%s' did not return a table", module);
+            return;
+        }
+
+        lua_getfield(L, -1, field);
+        lua_remove(L, -2);
+    }
+}
+
+static int
+ngx_http_resty_threadpool_code_define(lua_State *L)
+{
+    /* protected call in the task state: loads one named function or
+     * metatable */
+    ngx_http_resty_threadpool_named_t *def = lua_touserdata(L, 1);
+
+    if (def->cdata) {
+        luaser_register_cdata(L, def->name);
+        return 0;
+    }
+
+    if (def->metatable) {
+        ngx_http_resty_threadpool_code_require(L, def->module, def->field);
+        if (!lua_istable(L, -1)) {
+            return luaL_error(L, "module '%s' did not provide a table",
+                              def->module);
+        }
+
+        luaser_register_metatable(L, def->name, -1);
+        return 0;
+    }
+
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_THREADPOOL_NAMED_KEY);
+    lua_pushlstring(L, def->name, def->namelen);
+
+    if (def->code != NULL) {
+        luaser_decode(L, def->code, def->codelen);
+
+    } else {
+        ngx_http_resty_threadpool_code_require(L, def->module, def->field);
+        if (!lua_isfunction(L, -1)) {
+            return luaL_error(L, "module '%s' did not provide a function",
+                              def->module);
+        }
+    }
+
+    lua_rawset(L, -3);
+    return 0;
+}
+
+static size_t
+ngx_http_resty_threadpool_code_copy(lua_State *from, u_char **p,
+    const char **str, size_t *len)
+{
+    /* pops the string on top of from (or nil), and copies it to *p if not
+     * NULL; returns the size of the copy */
+    const char  *s;
+    size_t       n;
+
+    s = lua_tolstring(from, -1, &n);
+    if (s == NULL) {
+        lua_pop(from, 1);
+        return 0;
+    }
+
+    if (*p != NULL) {
+        *str = (const char *) *p;
+        if (len != NULL) {
+            *len = n;
+        }
+
+        *p = ngx_cpymem(*p, s, n);
+        *(*p)++ = '\0';
+    }
+
+    lua_pop(from, 1);
+    return n + 1;
+}
+
+static size_t
+ngx_http_resty_threadpool_code_walk(lua_State *from, ngx_uint_t metatables,
+    ngx_http_resty_threadpool_named_t *defs, u_char *p, ngx_uint_t *n)
+{
+    /* counts the definitions of the given registry table of the request VM,
+     * and returns the size of their strings; copies them to defs[*n] and p
+     * as well if defs is not NULL */
+    ngx_http_resty_threadpool_named_t  *def, scratch;
+    size_t                              size;
+
+    size = 0;
+
+    lua_getfield(from, LUA_REGISTRYINDEX,
+                 metatables ? LUA_THREADPOOL_METATABLES_KEY
+                            : LUA_THREADPOOL_NAMED_KEY);
+    if (lua_istable(from, -1)) {
+        lua_pushnil(from);
+        while (lua_next(from, -2) != 0) {
+            /* from = (defs, name, def) */
+            def = defs != NULL ? &defs[*n] : &scratch;
+            ngx_memzero(def, sizeof(ngx_http_resty_threadpool_named_t));
+            def->metatable = metatables;
+
+            lua_pushvalue(from, -2);
+            size += ngx_http_resty_threadpool_code_copy(from, &p, &def->name,
+                                                        &def->namelen);
+            lua_getfield(from, -1, "code");
+            size += ngx_http_resty_threadpool_code_copy(from, &p, &def->code,
+                                                        &def->codelen);
+            lua_getfield(from, -1, "module");
+            size += ngx_http_resty_threadpool_code_copy(from, &p, &def->module,
+                                                        NULL);
+            lua_getfield(from, -1, "field");
+            size += ngx_http_resty_threadpool_code_copy(from, &p, &def->field,
+                                                        NULL);
+            lua_getfield(from, -1, "cdata");
+            def->cdata = lua_toboolean(from, -1);
+
+            (*n)++;
+            lua_pop(from, 2);
+        }
+    }
+
+    lua_pop(from, 1);
+    return size;
+}
+
+/* copies the named functions and metatables registered in the request VM
+ * from, for the task states created from now on (main thread only, while no
+ * task runs: definitions are only registered at init time) */
+ngx_int_t
+ngx_http_resty_threadpool_code_save(lua_State *from, ngx_log_t *log)
+{
+    ngx_http_resty_threadpool_defs_t   *saved;
+    ngx_http_resty_threadpool_named_t  *defs;
+    ngx_uint_t                          n;
+    size_t                              size;
+    u_char                             *p;
+
+    saved = &ngx_http_resty_threadpool_defs;
+
+    n = 0;
+    size = ngx_http_resty_threadpool_code_walk(from, 1, NULL, NULL, &n)
+           + ngx_http_resty_threadpool_code_walk(from, 0, NULL, NULL, &n);
+
+    defs = ngx_alloc(n * sizeof(ngx_http_resty_threadpool_named_t) + size,
+                     log);
+    if (defs == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* metatables first: named tasks may use them at load time */
+    p = (u_char *) (defs + n);
+    n = 0;
+    p += ngx_http_resty_threadpool_code_walk(from, 1, defs, p, &n);
+    (void) ngx_http_resty_threadpool_code_walk(from, 0, defs, p, &n);
+
+    if (saved->defs != NULL) {
+        ngx_free(saved->defs);
+    }
+
+    saved->defs = defs;
+    saved->ndefs = n;
+    saved->gen++;
+
+    return NGX_OK;
+}
+
+/* loads in the task state L the definitions saved since its last
+ * synchronization; called by the thread running the state, or by the main
+ * thread at init time */
+void
+ngx_http_resty_threadpool_code_sync(lua_State *L, ngx_log_t *log)
+{
+    ngx_http_resty_threadpool_defs_t   *saved;
+    ngx_http_resty_threadpool_named_t  *def;
+    ngx_uint_t                          i;
+
+    saved = &ngx_http_resty_threadpool_defs;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_THREADPOOL_NAMED_GEN_KEY);
+    if (lua_tointeger(L, -1) == saved->gen) {
+        lua_pop(L, 1);
+        return;
+    }
+
+    lua_pop(L, 1);
+
+    for (i = 0; i < saved->ndefs; i++) {
+        def = &saved->defs[i];
+
+        if (lua_cpcall(L, ngx_http_resty_threadpool_code_define, def) != 0) {
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "failed to load lua %s \"%s\": %s",
+                          def->cdata ? "cdata type"
+                          : def->metatable ? "metatable" : "task",
+                          def->name, lua_tostring(L, -1));
+            lua_pop(L, 1);
+        }
+    }
+
+    lua_pushinteger(L, saved->gen);
+    lua_setfield(L, LUA_REGISTRYINDEX, LUA_THREADPOOL_NAMED_GEN_KEY);
+}
+
+/* pushes the function registered under the given name, or nil */
+void
+ngx_http_resty_threadpool_code_load_named(lua_State *L, const u_char *name,
+    size_t len)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_THREADPOOL_NAMED_KEY);
+    lua_pushlstring(L, (const char *) name, len);
+    lua_rawget(L, -2);
+    lua_remove(L, -2);
+}
+
+static int
+ngx_http_resty_threadpool_code_check_init(lua_State *L)
+{
+    ngx_http_request_t  *r;
+    ngx_http_lua_ctx_t  *luactx;
+
+    /* the threads running the tasks load a copy of the definitions without
+     * locking: only allow this before any task can run */
+    r = ngx_http_lua_get_req(L);
+    if (r != NULL) {
+        luactx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+        if (luactx == NULL
+            || !(luactx->context & NGX_HTTP_LUA_CONTEXT_INIT_WORKER))
+        {
+            return luaL_error(L, "definitions can only be registered from "
+                              "init_by_lua* or init_worker_by_lua*");
+        }
+    }
+
+    return 0;
+}
+
+static void
+ngx_http_resty_threadpool_code_add(lua_State *L, const char *key)
+{
+    /* L = (name, ..., def): stores def under name in the given registry
+     * table, and sends it to the existing states */
+    lua_getfield(L, LUA_REGISTRYINDEX, key);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, key);
+    }
+
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, -3);
+    lua_rawset(L, -3);
+    lua_pop(L, 2);
+
+    if (ngx_http_resty_threadpool_code_save(L, ngx_cycle->log) != NGX_OK) {
+        luaL_error(L, "failed to save definitions");
+        return;
+    }
+
+    /* resident VMs of this worker already exist (init_worker_by_lua) */
+    ngx_http_resty_threadpool_resident_sync((ngx_cycle_t *) ngx_cycle);
+}
+
+/* Lua API: threadpool.register(name, func)
+ *          threadpool.register(name, module [, field]) */
+int
+ngx_http_resty_threadpool_code_register(lua_State *L)
+{
+    luaL_checkstring(L, 1);
+    ngx_http_resty_threadpool_code_check_init(L);
+
+    lua_settop(L, 3);
+    lua_createtable(L, 0, 2); /* L = (name, func|module, field, def) */
+
+    if (lua_isfunction(L, 2)) {
+        luaser_encode(L, 2);
+        lua_setfield(L, 4, "code");
+
+    } else {
+        luaL_checkstring(L, 2);
+        lua_pushvalue(L, 2);
+        lua_setfield(L, 4, "module");
+
+        if (!lua_isnil(L, 3)) {
+            luaL_checkstring(L, 3);
+            lua_pushvalue(L, 3);
+            lua_setfield(L, 4, "field");
+        }
+    }
+
+    ngx_http_resty_threadpool_code_add(L, LUA_THREADPOOL_NAMED_KEY);
+    return 0;
+}
+
+/* Lua API: threadpool.register_metatable(name, module [, field]) */
+int
+ngx_http_resty_threadpool_code_register_metatable(lua_State *L)
+{
+    const char  *name, *module, *field;
+
+    name = luaL_checkstring(L, 1);
+    module = luaL_checkstring(L, 2);
+    field = luaL_optstring(L, 3, NULL);
+    ngx_http_resty_threadpool_code_check_init(L);
+
+    lua_settop(L, 3);
+
+    /* the request VM serializes these tables too */
+    ngx_http_resty_threadpool_code_require(L, module, field);
+    if (!lua_istable(L, -1)) {
+        return luaL_error(L, "module '%s' did not provide a table", module);
+    }
+
+    luaser_register_metatable(L, name, -1);
+    lua_pop(L, 1);
+
+    lua_createtable(L, 0, 2); /* L = (name, module, field, def) */
+    lua_pushvalue(L, 2);
+    lua_setfield(L, 4, "module");
+    if (field != NULL) {
+        lua_pushvalue(L, 3);
+        lua_setfield(L, 4, "field");
+    }
+
+    ngx_http_resty_threadpool_code_add(L, LUA_THREADPOOL_METATABLES_KEY);
+    return 0;
+}
+
+/* Lua API: threadpool.register_cdata(name) */
+int
+ngx_http_resty_threadpool_code_register_cdata(lua_State *L)
+{
+    const char  *name;
+
+    name = luaL_checkstring(L, 1);
+    ngx_http_resty_threadpool_code_check_init(L);
+
+    lua_settop(L, 1);
+    luaser_register_cdata(L, name);
+
+    lua_createtable(L, 0, 1); /* L = (name, def) */
+    lua_pushboolean(L, 1);
+    lua_setfield(L, 2, "cdata");
+
+    ngx_http_resty_threadpool_code_add(L, LUA_THREADPOOL_METATABLES_KEY);
+    return 0;
+}
+
+/* pushes the serialized form of the function at idx (request VM) */
+void
+ngx_http_resty_threadpool_code_dump(lua_State *L, int idx)
+{
+    if (idx < 0) {
+        idx = lua_gettop(L) + idx + 1;
+    }
+
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_THREADPOOL_DUMPS_KEY);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_createtable(L, 0, 1);
+        lua_pushliteral(L, "k");
+        lua_setfield(L, -2, "__mode");
+        lua_setmetatable(L, -2);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, LUA_THREADPOOL_DUMPS_KEY);
+    }
+
+    lua_pushvalue(L, idx);
+    lua_rawget(L, -2);
+    if (lua_type(L, -1) == LUA_TSTRING) {
+        ngx_http_resty_threadpool_dump_hits++;
+        lua_remove(L, -2);
+        return;
+    }
+
+    ngx_http_resty_threadpool_dump_misses++;
+    lua_pop(L, 1);
+    luaser_encode(L, idx);  /* cache, code */
+    lua_pushvalue(L, idx);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -4);
+    lua_remove(L, -2);
+}
+
+/* pushes the function loaded from its serialized form (task state) */
+void
+ngx_http_resty_threadpool_code_load(lua_State *L, const u_char *code,
+    size_t len)
+{
+    int  cache, key;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_THREADPOOL_FUNCTIONS_KEY);
+    cache = lua_gettop(L);
+    lua_pushlstring(L, (const char *) code, len);
+    key = lua_gettop(L);
+
+    lua_pushvalue(L, key);
+    lua_rawget(L, cache);
+    if (lua_isfunction(L, -1)) {
+        (void) ngx_atomic_fetch_add(&ngx_http_resty_threadpool_load_hits, 1);
+        lua_replace(L, cache);
+        lua_settop(L, cache);
+        return;
+    }
+
+    (void) ngx_atomic_fetch_add(&ngx_http_resty_threadpool_load_misses, 1);
+    lua_pop(L, 1);
+    luaser_decode(L, (const char *) code, len);  /* cache, key, func */
+
+    /* the cache stays small in practice, it is just dropped if some code
+     * keeps spawning new functions */
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_THREADPOOL_FUNCTIONS_KEY ".n");
+    if (lua_tointeger(L, -1) >= LUA_THREADPOOL_FUNCTIONS_MAX) {
+        lua_newtable(L);
+        lua_replace(L, cache);
+        lua_pushvalue(L, cache);
+        lua_setfield(L, LUA_REGISTRYINDEX, LUA_THREADPOOL_FUNCTIONS_KEY);
+        lua_pushinteger(L, 0);
+        lua_replace(L, -2);
+    }
+
+    lua_pushinteger(L, lua_tointeger(L, -1) + 1);
+    lua_setfield(L, LUA_REGISTRYINDEX, LUA_THREADPOOL_FUNCTIONS_KEY ".n");
+    lua_pop(L, 1);
+
+    lua_pushvalue(L, key);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, cache);
+
+    lua_replace(L, cache);
+    lua_settop(L, cache);
+}
+
+/* Lua API: threadpool.cache_stats() */
+int
+ngx_http_resty_threadpool_code_stats(lua_State *L)
+{
+    lua_createtable(L, 0, 4);
+
+    lua_pushnumber(L, (lua_Number) ngx_http_resty_threadpool_dump_hits);
+    lua_setfield(L, -2, "dump_hits");
+    lua_pushnumber(L, (lua_Number) ngx_http_resty_threadpool_dump_misses);
+    lua_setfield(L, -2, "dump_misses");
+    lua_pushnumber(L, (lua_Number) ngx_http_resty_threadpool_load_hits);
+    lua_setfield(L, -2, "load_hits");
+    lua_pushnumber(L, (lua_Number) ngx_http_resty_threadpool_load_misses);
+    lua_setfield(L, -2, "load_misses");
+
+    return 1;
+}
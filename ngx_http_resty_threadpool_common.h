@@ -0,0 +1,194 @@
+/*
+Copyright (c) 2016, Julien Desgats
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef _NGX_HTTP_RESTY_THREADPOOL_COMMON_H_INCLUDED_
+#define _NGX_HTTP_RESTY_THREADPOOL_COMMON_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include "serialize.h"
+
+#include <api/ngx_http_lua_api.h>
+/* FIXME: this modules goes far beyond what the lua-nginx-module public API
+ * provides and uses the actual headers for now. */
+#include <ddebug.h>
+#include <ngx_http_lua_common.h>
+#include <ngx_http_lua_util.h>
+
+#ifndef NGX_THREADS
+# error thread support required
+#endif
+
+typedef enum {
+    LUA_THREADPOOL_TASK_CREATED,
+    LUA_THREADPOOL_TASK_YIELDED,
+    LUA_THREADPOOL_TASK_RUNNING,
+    LUA_THREADPOOL_TASK_SUCCESS,
+    LUA_THREADPOOL_TASK_FAILED,
+    LUA_THREADPOOL_TASK_DESTROYED,
+} ngx_http_resty_threadpool_thread_status_t;
+
+/* why the current run of a task has been stopped */
+#define LUA_THREADPOOL_CANCELLED  1
+#define LUA_THREADPOOL_TIMEDOUT   2
+
+typedef struct ngx_http_resty_threadpool_slot_s
+    ngx_http_resty_threadpool_slot_t;
+
+typedef struct ngx_http_resty_threadpool_group_s
+    ngx_http_resty_threadpool_group_t;
+
+typedef struct ngx_http_resty_threadpool_stats_s
+    ngx_http_resty_threadpool_stats_t;
+
+typedef struct ngx_http_resty_threadpool_channel_s
+    ngx_http_resty_threadpool_channel_t;
+
+typedef struct ngx_http_resty_threadpool_memo_s
+    ngx_http_resty_threadpool_memo_t;
+
+typedef struct {
+    ngx_str_t                          name;
+    ngx_thread_pool_t                 *tp;
+    ngx_uint_t                         nslots; /* resident VMs, 0 to use
+                                                  states from the pool */
+    ngx_http_resty_threadpool_slot_t  *slots;
+} ngx_http_resty_threadpool_pool_t;
+
+typedef struct {
+    ngx_uint_t       state_pool_size; /* states created at worker startup */
+    ngx_uint_t       state_pool_max;  /* max idle states kept for reuse */
+    size_t           max_serialized;  /* size limit of serialized values */
+    size_t           read_file_max;   /* size limit of threadpool.read_file */
+    size_t           arena_size;      /* arena chunks of the task states */
+    size_t           memory_limit;    /* per task state, 0 for none */
+    ngx_str_t        init_file;       /* run in each new task state */
+    ngx_uint_t       result_cache_size; /* memoized results per worker */
+    ngx_array_t      pools;           /* ngx_http_resty_threadpool_pool_t */
+    ngx_shm_zone_t  *stats_zone;      /* NULL if stats are disabled */
+} ngx_http_resty_threadpool_conf_t;
+
+typedef struct {
+    ngx_thread_pool_t                        *tp;
+    ngx_http_resty_threadpool_slot_t         *slot; /* home VM (resident) */
+    lua_State                                *L;    /* own state (pooled) */
+    lua_State                                *co;   /* running coroutine */
+    int                                       co_ref; /* anchor of co in the
+                                                         resident VM */
+    u_char                                   *code; /* serialized function,
+                                                       until the first run */
+    size_t                                    codelen;
+    luaser_buffer                             args; /* serialized arguments
+                                                       of create() and
+                                                       resume(), until the
+                                                       next run */
+    size_t                                    argslen; /* arguments of
+                                                          create() */
+    ngx_int_t                                 nargs;
+    int                                       nanchors; /* anchors of the
+                                                           arguments */
+    int                                       argsanchors; /* anchors of
+                                                              the arguments
+                                                              of create() */
+    luaser_buffer                             res;  /* serialized results of
+                                                       the last run */
+    ngx_int_t                                 nres;
+    ngx_http_resty_threadpool_group_t        *group; /* waiting for the
+                                                        current run */
+    int                                       ref;  /* anchor of the
+                                                       userdata in the request
+                                                       VM while it is used */
+    ngx_event_t                               timer; /* run timeout */
+    ngx_msec_t                                timeout;
+    ngx_uint_t                                priority; /* run queue class */
+    ngx_atomic_t                              cancelled; /* set by the main
+                                                            thread to stop the
+                                                            task */
+    ngx_uint_t                                first; /* map chunk: index
+                                                        of the first item */
+    ngx_uint_t                                nitems; /* map chunk: item
+                                                         count */
+    ngx_http_resty_threadpool_stats_t        *stats; /* NULL if disabled */
+    ngx_uint_t                                posted_at; /* time of the last
+                                                            post (us) */
+    ngx_http_resty_threadpool_channel_t      *channel; /* streaming task: given
+                                                          to the function */
+    ngx_http_resty_threadpool_memo_t         *memo; /* memoized run in
+                                                       flight */
+    ngx_http_resty_threadpool_thread_status_t status;
+    unsigned                                  named:1; /* code is the name
+                                                          of a registered
+                                                          task */
+    unsigned                                  buffered:1; /* results of the
+                                                             last run not
+                                                             consumed yet */
+    unsigned                                  map:1; /* map chunk: the
+                                                        function is called
+                                                        on each item */
+    unsigned                                  memoized:1; /* results must
+                                                             not reference
+                                                             the state */
+} ngx_http_resty_threadpool_state_t;
+
+typedef struct {
+    ngx_queue_t                        queue; /* run queue */
+    ngx_http_resty_threadpool_state_t *thread;
+} ngx_thread_lua_task_ctx_t;
+
+#define LUA_THREADPOOL_MT_NAME "resty.threadpool"
+
+void ngx_http_resty_threadpool_task_run(ngx_thread_lua_task_ctx_t *ctx,
+    lua_State *L, ngx_log_t *log);
+void ngx_http_resty_threadpool_task_done(ngx_thread_lua_task_ctx_t *ctx);
+ngx_http_resty_threadpool_state_t *ngx_http_resty_threadpool_task_current(
+    lua_State *L);
+ngx_http_resty_threadpool_state_t *ngx_http_resty_threadpool_thread_new(
+    lua_State *L, ngx_str_t *pool, int fidx);
+void ngx_http_resty_threadpool_thread_encode_args(lua_State *L, int idx,
+    int first, int n);
+void ngx_http_resty_threadpool_thread_rewind_args(lua_State *L, int idx);
+void ngx_http_resty_threadpool_thread_move_args(lua_State *L, int idx);
+ngx_int_t ngx_http_resty_threadpool_thread_post(
+    ngx_http_resty_threadpool_state_t *thread, ngx_log_t *log);
+void ngx_http_resty_threadpool_thread_release(
+    ngx_http_resty_threadpool_state_t *thread, ngx_log_t *log);
+void ngx_http_resty_threadpool_thread_interrupt(
+    ngx_http_resty_threadpool_state_t *thread, ngx_uint_t reason);
+ngx_int_t ngx_http_resty_threadpool_decode_values(lua_State *L,
+    lua_State *co, luaser_buffer *buf, ngx_int_t n, ngx_log_t *log);
+ngx_http_resty_threadpool_pool_t *ngx_http_resty_threadpool_pool_find(
+    ngx_cycle_t *cycle, ngx_str_t *name);
+
+extern ngx_module_t  ngx_http_resty_threadpool_module;
+
+#endif /* _NGX_HTTP_RESTY_THREADPOOL_COMMON_H_INCLUDED_ */
@@ -0,0 +1,501 @@
+/*
+Copyright (c) 2016, Julien Desgats
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "ngx_http_resty_threadpool_file.h"
+#include "ngx_http_resty_threadpool_wait.h"
+
+/* File operations run by the threads of a pool without any Lua state: the
+ * request coroutine is suspended while a thread does the system calls, and is
+ * resumed with the result. Nothing goes through the serializer: read data
+ * lands in a buffer that is copied once into the result string, and the data
+ * written is taken straight from the Lua string given by the caller, which is
+ * anchored until the write is over.
+ *
+ * Operations are allocated from the heap and outlive the request if it goes
+ * away meanwhile: the coroutine cleanup only detaches them, and the
+ * completion handler frees them.
+ *
+ * The coroutine always gets two values: the result and nil, or nil and an
+ * error message.
+ *
+ * Reads are capped by threadpool_read_file_max_size. Files without a size
+ * (procfs, pipes) are read up to their end by chunks, in a buffer growing up
+ * to the cap.
+ */
+
+#define LUA_THREADPOOL_FILE_CHUNK  16384
+
+typedef enum {
+    LUA_THREADPOOL_FILE_READ,
+    LUA_THREADPOOL_FILE_WRITE,
+    LUA_THREADPOOL_FILE_STAT,
+} ngx_http_resty_threadpool_file_op_t;
+
+typedef struct {
+    ngx_thread_task_t                    task;
+    ngx_http_resty_threadpool_file_op_t  op;
+    ngx_http_request_t                  *r;      /* NULL once the coroutine */
+    ngx_http_lua_co_ctx_t               *coctx;  /* is gone */
+    lua_State                           *vm;     /* request VM */
+    int                                  ref;    /* anchor of the data to
+                                                    write */
+    u_char                              *data;   /* read: buffer allocated by
+                                                    the thread */
+    off_t                                offset; /* -1 to replace the file */
+    size_t                               len;    /* read: 0 up to the end */
+    size_t                               max;    /* read: size limit */
+    size_t                               nbytes; /* read or written */
+    ngx_file_info_t                      fi;     /* stat */
+    const char                          *failed; /* system call */
+    ngx_err_t                            err;
+    unsigned                             toobig:1; /* read: over max */
+    u_char                               path[1];
+} ngx_http_resty_threadpool_file_t;
+
+static ssize_t
+ngx_http_resty_threadpool_file_pread(ngx_http_resty_threadpool_file_t *f,
+    ngx_fd_t fd, u_char *buf, size_t len)
+{
+    ssize_t  n;
+
+    /* from the start, the reads are sequential: this also works for pipes */
+    for ( ;; ) {
+        n = f->offset == 0 ? read(fd, buf, len)
+                           : pread(fd, buf, len, f->offset + f->nbytes);
+        if (n == -1 && ngx_errno == NGX_EINTR) {
+            continue;
+        }
+
+        if (n == -1) {
+            f->failed = f->offset == 0 ? "read()" : "pread()";
+            f->err = ngx_errno;
+        }
+
+        return n;
+    }
+}
+
+static void
+ngx_http_resty_threadpool_file_read_fd(ngx_http_resty_threadpool_file_t *f,
+    ngx_fd_t fd, ngx_log_t *log)
+{
+    /* reads f->len bytes, or up to the end of the file if 0, into f->data */
+    size_t    len, size;
+    ssize_t   n;
+    u_char   *p, c;
+    unsigned  eof;
+
+    len = f->len;
+    eof = 0;
+
+    if (len == 0) {
+        if (ngx_fd_info(fd, &f->fi) == NGX_FILE_ERROR) {
+            f->failed = ngx_fd_info_n;
+            f->err = ngx_errno;
+            return;
+        }
+
+        if (ngx_file_size(&f->fi) > f->offset) {
+            len = (size_t) (ngx_file_size(&f->fi) - f->offset);
+
+        } else if (ngx_file_size(&f->fi) == 0) {
+            /* no size: read up to the end */
+            eof = 1;
+        }
+    }
+
+    if (len > f->max) {
+        f->toobig = 1;
+        return;
+    }
+
+    size = eof ? ngx_min(LUA_THREADPOOL_FILE_CHUNK, f->max) : len;
+
+    f->data = ngx_alloc(size ? size : 1, log);
+    if (f->data == NULL) {
+        goto nomem;
+    }
+
+    for ( ;; ) {
+        while (f->nbytes < size) {
+            n = ngx_http_resty_threadpool_file_pread(f, fd,
+                                                     f->data + f->nbytes,
+                                                     size - f->nbytes);
+            if (n == -1) {
+                return;
+            }
+
+            if (n == 0) {
+                return; /* end of file */
+            }
+
+            f->nbytes += n;
+        }
+
+        if (!eof) {
+            return;
+        }
+
+        if (size == f->max) {
+            /* full: anything left is over the limit */
+            n = ngx_http_resty_threadpool_file_pread(f, fd, &c, 1);
+            if (n > 0) {
+                f->toobig = 1;
+            }
+
+            return;
+        }
+
+        size = size > f->max / 2 ? f->max : size * 2;
+
+        p = ngx_alloc(size, log);
+        if (p == NULL) {
+            goto nomem;
+        }
+
+        ngx_memcpy(p, f->data, f->nbytes);
+        ngx_free(f->data);
+        f->data = p;
+    }
+
+nomem:
+
+    f->failed = "malloc()";
+    f->err = NGX_ENOMEM;
+}
+
+static void
+ngx_http_resty_threadpool_file_handler(void *data, ngx_log_t *log)
+{
+    /* called from inside a worker thread */
+    ngx_http_resty_threadpool_file_t *f = data;
+    ngx_fd_t                          fd;
+    ssize_t                           n;
+
+    if (f->op == LUA_THREADPOOL_FILE_STAT) {
+        if (ngx_file_info(f->path, &f->fi) == NGX_FILE_ERROR) {
+            f->failed = ngx_file_info_n;
+            f->err = ngx_errno;
+        }
+
+        return;
+    }
+
+    if (f->op == LUA_THREADPOOL_FILE_READ) {
+        fd = ngx_open_file(f->path, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    } else {
+        fd = ngx_open_file(f->path, NGX_FILE_WRONLY,
+                           (f->offset < 0 ? NGX_FILE_TRUNCATE
+                                          : NGX_FILE_CREATE_OR_OPEN),
+                           NGX_FILE_DEFAULT_ACCESS);
+    }
+
+    if (fd == NGX_INVALID_FILE) {
+        f->failed = ngx_open_file_n;
+        f->err = ngx_errno;
+        return;
+    }
+
+    if (f->op == LUA_THREADPOOL_FILE_READ) {
+        ngx_http_resty_threadpool_file_read_fd(f, fd, log);
+
+    } else {
+        while (f->nbytes < f->len) {
+            n = pwrite(fd, f->data + f->nbytes, f->len - f->nbytes,
+                       ngx_max(f->offset, 0) + f->nbytes);
+            if (n == -1) {
+                if (ngx_errno == NGX_EINTR) {
+                    continue;
+                }
+
+                f->failed = "pwrite()";
+                f->err = ngx_errno;
+                goto done;
+            }
+
+            f->nbytes += n;
+        }
+    }
+
+done:
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR && f->failed == NULL) {
+        f->failed = ngx_close_file_n;
+        f->err = ngx_errno;
+    }
+}
+
+static ngx_int_t
+ngx_http_resty_threadpool_file_resume_handler(ngx_http_request_t *r)
+{
+    ngx_http_lua_ctx_t  *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    return ngx_http_resty_threadpool_wait_run(r, ctx, 2);
+}
+
+static void
+ngx_http_resty_threadpool_file_cleanup(void *data)
+{
+    /* the waiting coroutine is gone, the operation completes on its own */
+    ngx_http_lua_co_ctx_t            *coctx = data;
+    ngx_http_resty_threadpool_file_t *f = coctx->data;
+
+    f->r = NULL;
+    f->coctx = NULL;
+}
+
+static void
+ngx_http_resty_threadpool_file_push(lua_State *co,
+    ngx_http_resty_threadpool_file_t *f)
+{
+    u_char  *p, errstr[NGX_MAX_ERROR_STR];
+
+    if (f->toobig) {
+        lua_pushnil(co);
+        lua_pushfstring(co, "file \"%s\" is bigger than %f bytes", f->path,
+                        (lua_Number) f->max);
+        return;
+    }
+
+    if (f->failed != NULL) {
+        p = ngx_strerror(f->err, errstr, sizeof(errstr) - 1);
+        *p = '\0';
+
+        lua_pushnil(co);
+        lua_pushfstring(co, "%s \"%s\" failed (%d: %s)", f->failed,
+                        f->path, (int) f->err, errstr);
+        return;
+    }
+
+    switch (f->op) {
+
+    case LUA_THREADPOOL_FILE_READ:
+        lua_pushlstring(co, (char *) f->data, f->nbytes);
+        break;
+
+    case LUA_THREADPOOL_FILE_WRITE:
+        lua_pushinteger(co, (lua_Integer) f->nbytes);
+        break;
+
+    default: /* LUA_THREADPOOL_FILE_STAT */
+        lua_createtable(co, 0, 4);
+        lua_pushnumber(co, (lua_Number) ngx_file_size(&f->fi));
+        lua_setfield(co, -2, "size");
+        lua_pushnumber(co, (lua_Number) ngx_file_mtime(&f->fi));
+        lua_setfield(co, -2, "mtime");
+        lua_pushboolean(co, ngx_is_file(&f->fi));
+        lua_setfield(co, -2, "is_file");
+        lua_pushboolean(co, ngx_is_dir(&f->fi));
+        lua_setfield(co, -2, "is_dir");
+    }
+
+    lua_pushnil(co);
+}
+
+static void
+ngx_http_resty_threadpool_file_event_handler(ngx_event_t *ev)
+{
+    /* called in the main event loop */
+    ngx_http_resty_threadpool_file_t *f = ev->data;
+    ngx_http_request_t               *r;
+    ngx_http_lua_ctx_t               *luactx;
+    ngx_http_lua_co_ctx_t            *coctx;
+    ngx_connection_t                 *c;
+
+    r = f->r;
+    coctx = f->coctx;
+
+    if (f->ref != LUA_NOREF) {
+        luaL_unref(f->vm, LUA_REGISTRYINDEX, f->ref);
+    }
+
+    luactx = r != NULL ? ngx_http_get_module_ctx(r, ngx_http_lua_module)
+                       : NULL;
+
+    if (luactx != NULL) {
+        coctx->cleanup = NULL;
+        ngx_http_resty_threadpool_file_push(coctx->co, f);
+    }
+
+    if (f->op == LUA_THREADPOOL_FILE_READ && f->data != NULL) {
+        ngx_free(f->data);
+    }
+
+    ngx_free(f);
+
+    if (luactx != NULL) {
+        c = r->connection;
+        ngx_http_resty_threadpool_wait_continue(r, luactx, coctx,
+                                ngx_http_resty_threadpool_file_resume_handler);
+        ngx_http_run_posted_requests(c);
+    }
+}
+
+/* posts the operation and suspends the running coroutine, the path is at idx
+ * 2 (the pool name at 1) */
+static int
+ngx_http_resty_threadpool_file_post(lua_State *L,
+    ngx_http_resty_threadpool_file_op_t op, off_t offset, size_t len,
+    size_t max, int data)
+{
+    ngx_http_resty_threadpool_file_t *f;
+    ngx_http_resty_threadpool_pool_t *tpool;
+    ngx_http_request_t               *r;
+    ngx_http_lua_ctx_t               *luactx;
+    ngx_http_lua_co_ctx_t            *coctx;
+    ngx_thread_pool_t                *tp;
+    ngx_str_t                         pool;
+    const char                       *path;
+    size_t                            plen;
+
+    pool.data = (u_char *) luaL_checklstring(L, 1, &pool.len);
+    path = luaL_checklstring(L, 2, &plen);
+
+    coctx = ngx_http_resty_threadpool_wait_current(L, &r, &luactx);
+
+    tpool = ngx_http_resty_threadpool_pool_find((ngx_cycle_t *) ngx_cycle,
+                                                &pool);
+    tp = tpool != NULL ? tpool->tp
+                       : ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, &pool);
+    if (tp == NULL) {
+        return luaL_error(L, "no pool '%s' found", pool.data);
+    }
+
+    f = ngx_calloc(sizeof(ngx_http_resty_threadpool_file_t) + plen,
+                   r->connection->log);
+    if (f == NULL) {
+        return luaL_error(L, "no memory");
+    }
+
+    ngx_memcpy(f->path, path, plen + 1);
+    f->op = op;
+    f->offset = offset;
+    f->len = len;
+    f->max = max;
+    f->ref = LUA_NOREF;
+    f->vm = ngx_http_lua_get_lua_vm(r, luactx);
+
+    f->task.ctx = f;
+    f->task.handler = ngx_http_resty_threadpool_file_handler;
+    f->task.event.data = f;
+    f->task.event.handler = ngx_http_resty_threadpool_file_event_handler;
+
+    if (data) {
+        f->data = (u_char *) lua_tostring(L, data);
+        lua_pushvalue(L, data);
+        f->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+    if (ngx_thread_task_post(tp, &f->task) != NGX_OK) {
+        luaL_unref(L, LUA_REGISTRYINDEX, f->ref);
+        ngx_free(f);
+        lua_pushnil(L);
+        lua_pushliteral(L, "failed to post the file task");
+        return 2;
+    }
+
+    f->r = r;
+    f->coctx = coctx;
+
+    ngx_http_lua_cleanup_pending_operation(coctx);
+    coctx->cleanup = ngx_http_resty_threadpool_file_cleanup;
+    coctx->data = f;
+
+    return lua_yield(L, 0);
+}
+
+static off_t
+ngx_http_resty_threadpool_file_offset(lua_State *L, int idx)
+{
+    lua_Number  offset;
+
+    offset = luaL_optnumber(L, idx, 0);
+    if (offset < 0) {
+        luaL_argerror(L, idx, "negative offset");
+    }
+
+    return (off_t) offset;
+}
+
+/* threadpool.read_file(pool, path, offset?, len?) */
+int
+ngx_http_resty_threadpool_file_read(lua_State *L)
+{
+    ngx_http_resty_threadpool_conf_t *tpcf;
+    off_t                             offset;
+    lua_Number                        len;
+
+    offset = ngx_http_resty_threadpool_file_offset(L, 3);
+    len = luaL_optnumber(L, 4, 0);
+    if (len < 0) {
+        return luaL_argerror(L, 4, "negative length");
+    }
+
+    tpcf = ngx_http_cycle_get_module_main_conf((ngx_cycle_t *) ngx_cycle,
+                                      ngx_http_resty_threadpool_module);
+
+    if (len > (lua_Number) tpcf->read_file_max) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "read of %f bytes over the limit of %f bytes", len,
+                        (lua_Number) tpcf->read_file_max);
+        return 2;
+    }
+
+    return ngx_http_resty_threadpool_file_post(L, LUA_THREADPOOL_FILE_READ,
+                                               offset, (size_t) len,
+                                               tpcf->read_file_max, 0);
+}
+
+/* threadpool.write_file(pool, path, data, offset?): without offset, the file
+ * is replaced by data */
+int
+ngx_http_resty_threadpool_file_write(lua_State *L)
+{
+    off_t   offset;
+    size_t  len;
+
+    luaL_checklstring(L, 3, &len);
+    offset = lua_isnoneornil(L, 4)
+             ? -1 : ngx_http_resty_threadpool_file_offset(L, 4);
+
+    return ngx_http_resty_threadpool_file_post(L, LUA_THREADPOOL_FILE_WRITE,
+                                               offset, len, 0, 3);
+}
+
+/* threadpool.stat(pool, path) */
+int
+ngx_http_resty_threadpool_file_stat(lua_State *L)
+{
+    return ngx_http_resty_threadpool_file_post(L, LUA_THREADPOOL_FILE_STAT,
+                                               0, 0, 0, 0);
+}
@@ -0,0 +1,420 @@
+/*
+Copyright (c) 2016, Julien Desgats
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "ngx_http_resty_threadpool_memo.h"
+#include "ngx_http_resty_threadpool_wait.h"
+#include "serialize.h"
+
+/* Memoized tasks (threadpool.run_cached): tasks that are pure functions of
+ * their arguments are identified by a key given by the caller.
+ *
+ * - While a run for a key is in flight, the other coroutines asking for the
+ *   same key do not post anything: they wait for that run (the leader) and
+ *   get the same results, decoded from its frame.
+ * - Once the run succeeded, its results are kept for ttl seconds, and served
+ *   from there without touching the pool.
+ *
+ * If the leader goes away (request aborted) while others wait, the run is not
+ * cancelled: it goes on for them. Without waiters, it is cancelled and the
+ * entry forgotten, so later calls start their own run rather than inherit
+ * the cancellation.
+ *
+ * The results of memoized runs are serialized without references to the task
+ * state (big strings and buffers are copied in the frame), so the frame can
+ * outlive the run. Entries live in the main thread only, in a table of the
+ * request VM registry (key -> entry) and in a LRU list of the completed
+ * entries, capped by threadpool_result_cache_size.
+ */
+
+#define LUA_THREADPOOL_MEMO_KEY "resty.threadpool.memo"
+
+struct ngx_http_resty_threadpool_memo_s {
+    ngx_queue_t                        lru;     /* completed entries */
+    ngx_queue_t                        waiters; /* coroutines waiting for
+                                                   the run in flight */
+    ngx_http_resty_threadpool_state_t *thread;  /* run in flight */
+    lua_State                         *vm;      /* request VM */
+    luaser_buffer                      res;     /* frames of the results */
+    ngx_int_t                          nres;
+    ngx_msec_t                         ttl;
+    ngx_msec_t                         expires;
+    size_t                             keylen;
+    u_char                             key[1];
+};
+
+typedef struct {
+    ngx_queue_t                        queue;
+    ngx_http_request_t                *r;
+    ngx_http_lua_co_ctx_t             *coctx;
+    ngx_int_t                          nres;
+} ngx_http_resty_threadpool_memo_waiter_t;
+
+/* completed entries, most recently used first (main thread only) */
+static ngx_queue_t  ngx_http_resty_threadpool_memo_lru;
+static ngx_uint_t   ngx_http_resty_threadpool_memo_count;
+
+static void
+ngx_http_resty_threadpool_memo_free(lua_State *L,
+    ngx_http_resty_threadpool_memo_t *m)
+{
+    /* drops a completed entry */
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_THREADPOOL_MEMO_KEY);
+    lua_pushlstring(L, (char *) m->key, m->keylen);
+    lua_pushnil(L);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+
+    ngx_queue_remove(&m->lru);
+    ngx_http_resty_threadpool_memo_count--;
+
+    luaser_buffer_free(&m->res);
+    ngx_free(m);
+}
+
+static ngx_http_resty_threadpool_memo_t *
+ngx_http_resty_threadpool_memo_find(lua_State *L, int key)
+{
+    ngx_http_resty_threadpool_memo_t *m;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_THREADPOOL_MEMO_KEY);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, LUA_THREADPOOL_MEMO_KEY);
+        ngx_queue_init(&ngx_http_resty_threadpool_memo_lru);
+    }
+
+    lua_pushvalue(L, key);
+    lua_rawget(L, -2);
+    m = lua_touserdata(L, -1);
+    lua_pop(L, 2);
+
+    return m;
+}
+
+static ngx_int_t
+ngx_http_resty_threadpool_memo_push(lua_State *L, lua_State *co,
+    ngx_http_resty_threadpool_memo_t *m, ngx_log_t *log)
+{
+    /* pushes the results of the entry into co, returns their count */
+    ngx_http_resty_threadpool_state_t *thread = m->thread;
+
+    if (thread != NULL && thread->cancelled
+        && thread->status == LUA_THREADPOOL_TASK_FAILED)
+    {
+        lua_pushnil(co);
+        lua_pushstring(co, thread->cancelled == LUA_THREADPOOL_TIMEDOUT
+                           ? "timeout" : "cancelled");
+        return 2;
+    }
+
+    if (m->nres == 0) {
+        return 0;
+    }
+
+    if (ngx_http_resty_threadpool_decode_values(L, co, &m->res, m->nres, log)
+        != NGX_OK)
+    {
+        lua_pushnil(co);
+        lua_pushliteral(co, "failed to deserialize results");
+        return 2;
+    }
+
+    return m->nres;
+}
+
+static ngx_int_t
+ngx_http_resty_threadpool_memo_resume_handler(ngx_http_request_t *r)
+{
+    ngx_http_lua_ctx_t                      *ctx;
+    ngx_http_resty_threadpool_memo_waiter_t *w;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    w = ctx->cur_co_ctx->data;
+    return ngx_http_resty_threadpool_wait_run(r, ctx, w->nres);
+}
+
+static void
+ngx_http_resty_threadpool_memo_cleanup(void *data)
+{
+    /* a waiting coroutine is gone */
+    ngx_http_lua_co_ctx_t                   *coctx = data;
+    ngx_http_resty_threadpool_memo_waiter_t *w = coctx->data;
+
+    ngx_queue_remove(&w->queue);
+    ngx_free(w);
+}
+
+static void
+ngx_http_resty_threadpool_memo_wake(ngx_http_resty_threadpool_memo_t *m)
+{
+    /* resumes the coroutines waiting for the run with its results */
+    ngx_http_resty_threadpool_memo_waiter_t *w;
+    ngx_http_lua_ctx_t                      *luactx;
+    ngx_http_lua_co_ctx_t                   *coctx;
+    ngx_http_request_t                      *r;
+    ngx_connection_t                        *c;
+    ngx_queue_t                             *q;
+
+    while (!ngx_queue_empty(&m->waiters)) {
+        q = ngx_queue_head(&m->waiters);
+        ngx_queue_remove(q);
+        w = ngx_queue_data(q, ngx_http_resty_threadpool_memo_waiter_t, queue);
+
+        r = w->r;
+        coctx = w->coctx;
+        coctx->cleanup = NULL;
+
+        luactx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+        if (luactx == NULL) {
+            ngx_free(w);
+            continue;
+        }
+
+        c = r->connection;
+        w->nres = ngx_http_resty_threadpool_memo_push(m->vm, coctx->co, m,
+                                                      c->log);
+
+        ngx_http_resty_threadpool_wait_continue(r, luactx, coctx,
+                               ngx_http_resty_threadpool_memo_resume_handler);
+        ngx_free(w);
+        ngx_http_run_posted_requests(c);
+    }
+}
+
+/* called in the main event loop when the run of a memoized task is over,
+ * before its results are handed to the leader */
+void
+ngx_http_resty_threadpool_memo_done(ngx_http_resty_threadpool_state_t *thread)
+{
+    ngx_http_resty_threadpool_conf_t *tpcf;
+    ngx_http_resty_threadpool_memo_t *m = thread->memo;
+    lua_State                        *L;
+    ngx_queue_t                      *q;
+    ngx_uint_t                        keep;
+
+    thread->memo = NULL;
+    L = m->vm;
+
+    tpcf = ngx_http_cycle_get_module_main_conf((ngx_cycle_t *) ngx_cycle,
+                                      ngx_http_resty_threadpool_module);
+
+    keep = thread->status == LUA_THREADPOOL_TASK_SUCCESS
+           && !thread->cancelled
+           && m->ttl > 0
+           && tpcf->result_cache_size > 0;
+
+    if (thread->res.len > 0) {
+        m->res.data = ngx_alloc(thread->res.len, ngx_cycle->log);
+        if (m->res.data != NULL) {
+            ngx_memcpy(m->res.data, thread->res.data, thread->res.len);
+            m->res.len = thread->res.len;
+            m->res.size = thread->res.len;
+            m->nres = thread->nres;
+
+        } else {
+            keep = 0;
+        }
+    }
+
+    /* the waiters see the same outcome as the leader */
+    m->thread = thread;
+    ngx_http_resty_threadpool_memo_wake(m);
+    m->thread = NULL;
+
+    if (!keep) {
+        lua_getfield(L, LUA_REGISTRYINDEX, LUA_THREADPOOL_MEMO_KEY);
+        lua_pushlstring(L, (char *) m->key, m->keylen);
+        lua_pushnil(L);
+        lua_rawset(L, -3);
+        lua_pop(L, 1);
+
+        luaser_buffer_free(&m->res);
+        ngx_free(m);
+        return;
+    }
+
+    m->expires = ngx_current_msec + m->ttl;
+    ngx_queue_insert_head(&ngx_http_resty_threadpool_memo_lru, &m->lru);
+    ngx_http_resty_threadpool_memo_count++;
+
+    while (ngx_http_resty_threadpool_memo_count > tpcf->result_cache_size) {
+        q = ngx_queue_last(&ngx_http_resty_threadpool_memo_lru);
+        ngx_http_resty_threadpool_memo_free(L,
+            ngx_queue_data(q, ngx_http_resty_threadpool_memo_t, lru));
+    }
+}
+
+/* called in the main event loop when the coroutine that started the run of a
+ * memoized task goes away: returns 1 if the run goes on for the coroutines
+ * waiting for it, 0 if it can be cancelled (the entry is dropped) */
+ngx_uint_t
+ngx_http_resty_threadpool_memo_orphan(
+    ngx_http_resty_threadpool_state_t *thread)
+{
+    ngx_http_resty_threadpool_memo_t *m = thread->memo;
+    lua_State                        *L;
+
+    if (!ngx_queue_empty(&m->waiters)) {
+        return 1;
+    }
+
+    L = m->vm;
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_THREADPOOL_MEMO_KEY);
+    lua_pushlstring(L, (char *) m->key, m->keylen);
+    lua_pushnil(L);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+
+    thread->memo = NULL;
+    ngx_free(m);
+    return 0;
+}
+
+/* threadpool.run_cached(pool, key, ttl, func, ...): same as
+ * threadpool.create(pool, func, ...):resume(), for tasks whose results only
+ * depend on key */
+int
+ngx_http_resty_threadpool_memo_run(lua_State *L)
+{
+    ngx_http_resty_threadpool_memo_waiter_t *w;
+    ngx_http_resty_threadpool_memo_t        *m;
+    ngx_http_resty_threadpool_state_t       *ud;
+    ngx_http_request_t                      *r;
+    ngx_http_lua_ctx_t                      *luactx;
+    ngx_http_lua_co_ctx_t                   *coctx;
+    ngx_str_t                                pool, key;
+    lua_Number                               ttl;
+    int                                      nargs, rc;
+
+    nargs = lua_gettop(L) - 4;
+    pool.data = (u_char *) luaL_checklstring(L, 1, &pool.len);
+    key.data = (u_char *) luaL_checklstring(L, 2, &key.len);
+    ttl = luaL_checknumber(L, 3);
+    luaL_argcheck(L, ttl >= 0, 3, "ttl must not be negative");
+    if (lua_type(L, 4) != LUA_TSTRING) {
+        luaL_checktype(L, 4, LUA_TFUNCTION);
+    }
+
+    coctx = ngx_http_resty_threadpool_wait_current(L, &r, &luactx);
+
+    m = ngx_http_resty_threadpool_memo_find(L, 2);
+
+    if (m != NULL && m->thread == NULL
+        && (ngx_msec_int_t) (m->expires - ngx_current_msec) <= 0)
+    {
+        ngx_http_resty_threadpool_memo_free(L, m);
+        m = NULL;
+    }
+
+    if (m != NULL && m->thread == NULL) {
+        /* cached */
+        ngx_queue_remove(&m->lru);
+        ngx_queue_insert_head(&ngx_http_resty_threadpool_memo_lru, &m->lru);
+
+        lua_settop(L, 0);
+        return (int) ngx_http_resty_threadpool_memo_push(L, L, m,
+                                                         r->connection->log);
+    }
+
+    if (m != NULL) {
+        /* in flight: wait for it */
+        w = ngx_calloc(sizeof(ngx_http_resty_threadpool_memo_waiter_t),
+                       r->connection->log);
+        if (w == NULL) {
+            return luaL_error(L, "no memory");
+        }
+
+        w->r = r;
+        w->coctx = coctx;
+        ngx_queue_insert_tail(&m->waiters, &w->queue);
+
+        ngx_http_lua_cleanup_pending_operation(coctx);
+        coctx->cleanup = ngx_http_resty_threadpool_memo_cleanup;
+        coctx->data = w;
+
+        lua_settop(L, 0);
+        return lua_yield(L, 0);
+    }
+
+    /* first one: run the task, as create() then resume() would */
+    ud = ngx_http_resty_threadpool_thread_new(L, &pool, 4);
+    if (nargs > 0) {
+        ngx_http_resty_threadpool_thread_encode_args(L, lua_gettop(L), 5,
+                                                     nargs);
+        ud->argslen = ud->args.len;
+        ud->argsanchors = ud->nanchors;
+    }
+
+    ud->memoized = 1;
+
+    /* the key stays referenced until the entry is recorded (a placeholder is
+     * left behind if the run cannot be posted) */
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_THREADPOOL_MEMO_KEY);
+    lua_pushvalue(L, 2);
+    lua_pushboolean(L, 0);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+
+    lua_replace(L, 1);
+    lua_settop(L, 1);
+    rc = ngx_http_resty_threadpool_wait_resume(L);
+
+    /* the run is posted (or it raised an error, and nothing is recorded) */
+    if (ud->group == NULL) {
+        return rc;
+    }
+
+    m = ngx_calloc(sizeof(ngx_http_resty_threadpool_memo_t) + key.len,
+                   r->connection->log);
+    if (m == NULL) {
+        return rc; /* not coalesced, no harm done */
+    }
+
+    ngx_queue_init(&m->waiters);
+    ngx_queue_init(&m->lru);
+    m->thread = ud;
+    m->vm = ngx_http_lua_get_lua_vm(r, luactx);
+    m->ttl = (ngx_msec_t) (ttl * 1000);
+    m->keylen = key.len;
+    ngx_memcpy(m->key, key.data, key.len);
+    ud->memo = m;
+
+    /* the coroutine may be suspended by now: its stack is left alone */
+    lua_getfield(m->vm, LUA_REGISTRYINDEX, LUA_THREADPOOL_MEMO_KEY);
+    lua_pushlstring(m->vm, (char *) m->key, m->keylen);
+    lua_pushlightuserdata(m->vm, m);
+    lua_rawset(m->vm, -3);
+    lua_pop(m->vm, 1);
+
+    return rc;
+}
@@ -25,64 +25,147 @@ LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
 OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
-#include <ngx_config.h>
-#include <ngx_core.h>
-#include <ngx_http.h>
+#include "ngx_http_resty_threadpool_common.h"
+#include "ngx_http_resty_threadpool_vm.h"
+#include "ngx_http_resty_threadpool_resident.h"
+#include "ngx_http_resty_threadpool_code.h"
+#include "ngx_http_resty_threadpool_wait.h"
+#include "ngx_http_resty_threadpool_queue.h"
+#include "ngx_http_resty_threadpool_stats.h"
+#include "ngx_http_resty_threadpool_api.h"
+#include "ngx_http_resty_threadpool_channel.h"
+#include "ngx_http_resty_threadpool_alloc.h"
+#include "ngx_http_resty_threadpool_resources.h"
+#include "ngx_http_resty_threadpool_file.h"
+#include "ngx_http_resty_threadpool_memo.h"
+#include "serialize.h"
 
-#include <lua.h>
-#include <lualib.h>
-#include <lauxlib.h>
+/* strings from this size are handed over to the other side (task state for
+ * the arguments, main thread for the results) without intermediate copies */
+#define NGX_HTTP_RESTY_THREADPOOL_REF_MIN  4096
 
-#include <api/ngx_http_lua_api.h>
-/* FIXME: this modules goes far beyond what the lua-nginx-module public API
- * provides and uses the actual headers for now. */
-#include <ddebug.h>
-#include <ngx_http_lua_common.h>
-#include <ngx_http_lua_util.h>
+/* registry table of the request VM: task -> table anchoring the strings and
+ * buffers passed by reference in its pending arguments (weak keys) */
+#define NGX_HTTP_RESTY_THREADPOOL_ARGS_KEY "resty.threadpool.args"
 
-#include "serialize.h"
+/* idle serialization buffers kept per worker, and their max size */
+#define NGX_HTTP_RESTY_THREADPOOL_BUF_CACHE  64
+#define NGX_HTTP_RESTY_THREADPOOL_BUF_KEEP   (64 * 1024)
 
-#ifndef NGX_THREADS
-# error thread support required
-#endif
-
-typedef enum {
-    LUA_THREADPOOL_TASK_CREATED,
-    LUA_THREADPOOL_TASK_YIELDED,
-    LUA_THREADPOOL_TASK_RUNNING,
-    LUA_THREADPOOL_TASK_SUCCESS,
-    LUA_THREADPOOL_TASK_FAILED,
-    LUA_THREADPOOL_TASK_DESTROYED,
-} ngx_http_resty_threadpool_thread_status_t;
-
-typedef struct {
-} ngx_http_resty_threadpool_conf_t;
-
-typedef struct {
-    ngx_thread_pool_t                        *tp;
-    lua_State                                *L;
-    ngx_http_resty_threadpool_thread_status_t status;
-} ngx_http_resty_threadpool_state_t;
-
-typedef struct {
-    ngx_http_lua_co_ctx_t       *coctx;
-    ngx_http_request_t *r;
-    ngx_int_t nres; /* result count */
-    ngx_http_resty_threadpool_state_t *thread;
-} ngx_thread_lua_task_ctx_t;
+static void
+ngx_http_resty_threadpool_thread_timeout(ngx_event_t *ev);
 
 static ngx_int_t
-ngx_http_resty_threadpool_resume(ngx_http_request_t *r);
+ngx_http_resty_threadpool_inject_api(ngx_conf_t *cf);
+
+static void *
+ngx_http_resty_threadpool_create_conf(ngx_conf_t *cf);
+
+static char *
+ngx_http_resty_threadpool_init_conf(ngx_conf_t *cf, void *conf);
+
+static char *
+ngx_http_resty_threadpool_resident(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+static char *
+ngx_http_resty_threadpool_init_file(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 
 static ngx_int_t
-ngx_http_resty_threadpool_inject_api(ngx_conf_t *cf);
+ngx_http_resty_threadpool_init_process(ngx_cycle_t *cycle);
+
+static void
+ngx_http_resty_threadpool_exit_process(ngx_cycle_t *cycle);
+
+static ngx_command_t  ngx_http_resty_threadpool_commands[] = {
+
+    { ngx_string("threadpool_state_pool_size"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_resty_threadpool_conf_t, state_pool_size),
+      NULL },
+
+    { ngx_string("threadpool_state_pool_max"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_resty_threadpool_conf_t, state_pool_max),
+      NULL },
+
+    { ngx_string("threadpool_max_serialized_size"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_resty_threadpool_conf_t, max_serialized),
+      NULL },
+
+    { ngx_string("threadpool_read_file_max_size"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_resty_threadpool_conf_t, read_file_max),
+      NULL },
+
+    { ngx_string("threadpool_state_arena"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_resty_threadpool_conf_t, arena_size),
+      NULL },
+
+    { ngx_string("threadpool_task_memory_limit"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_resty_threadpool_conf_t, memory_limit),
+      NULL },
+
+    { ngx_string("threadpool_init_by_lua_file"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_resty_threadpool_init_file,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("threadpool_result_cache_size"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_resty_threadpool_conf_t, result_cache_size),
+      NULL },
+
+    { ngx_string("threadpool_resident"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE2,
+      ngx_http_resty_threadpool_resident,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("threadpool_stats_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_resty_threadpool_stats_zone,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("threadpool_stats"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_resty_threadpool_stats_location,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
 
 static ngx_http_module_t  ngx_http_resty_threadpool_module_ctx = {
     NULL,                                  /* preconfiguration */
     ngx_http_resty_threadpool_inject_api,  /* postconfiguration */
 
-    NULL,                                  /* create main configuration */
-    NULL,                                  /* init main configuration */
+    ngx_http_resty_threadpool_create_conf, /* create main configuration */
+    ngx_http_resty_threadpool_init_conf,   /* init main configuration */
 
     NULL,                                  /* create server configuration */
     NULL,                                  /* merge server configuration */
@@ -94,331 +177,977 @@ static ngx_http_module_t  ngx_http_resty_threadpool_module_ctx = {
 ngx_module_t  ngx_http_resty_threadpool_module = {
     NGX_MODULE_V1,
     &ngx_http_resty_threadpool_module_ctx, /* module context */
-    NULL,                                  /* module directives */
+    ngx_http_resty_threadpool_commands,    /* module directives */
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_resty_threadpool_init_process, /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
-    NULL,                                  /* exit process */
+    ngx_http_resty_threadpool_exit_process, /* exit process */
     NULL,                                  /* exit master */
     NGX_MODULE_V1_PADDING
 };
 
+/* serialization buffers of finished tasks, kept for reuse by the next ones
+ * (only used from the main thread) */
+static luaser_buffer  ngx_http_resty_threadpool_bufs[
+    NGX_HTTP_RESTY_THREADPOOL_BUF_CACHE];
+static ngx_uint_t     ngx_http_resty_threadpool_nbufs;
+
 static void
-ngx_http_resty_threadpool_task_handler(void *data, ngx_log_t *log)
+ngx_http_resty_threadpool_buf_get(luaser_buffer *buf)
 {
-    /* called from inside the worker thread: responsible to run the actual Lua
-     * code in the thread state.
-     */
-    const char                *code;
-    ngx_thread_lua_task_ctx_t *ctx = data;
-    lua_State                 *L = ctx->thread->L;
-    lua_State                 *co;
-    size_t                     codelen;
-    ngx_int_t                  i, nres;
-
-    if (ctx->thread->status == LUA_THREADPOOL_TASK_CREATED) {
-        /* new task, setup the state (only the serialized code is on the stack) */
-        luaL_openlibs(L);
-
-        ngx_http_lua_assert(lua_type(L, 1) == LUA_TSTRING);
-        code = lua_tolstring(L, 1, &codelen);
+    if (ngx_http_resty_threadpool_nbufs > 0) {
+        *buf = ngx_http_resty_threadpool_bufs[
+                   --ngx_http_resty_threadpool_nbufs];
+        buf->len = 0;
+        return;
+    }
+
+    ngx_memzero(buf, sizeof(luaser_buffer));
+}
+
+static void
+ngx_http_resty_threadpool_buf_put(luaser_buffer *buf)
+{
+    if (buf->data == NULL) {
+        return;
+    }
+
+    if (buf->size > NGX_HTTP_RESTY_THREADPOOL_BUF_KEEP
+        || ngx_http_resty_threadpool_nbufs
+           == NGX_HTTP_RESTY_THREADPOOL_BUF_CACHE)
+    {
+        luaser_buffer_free(buf);
+        return;
+    }
+
+    ngx_http_resty_threadpool_bufs[ngx_http_resty_threadpool_nbufs++] = *buf;
+    ngx_memzero(buf, sizeof(luaser_buffer));
+}
+
+static int
+ngx_http_resty_threadpool_decode_frames(lua_State *L)
+{
+    /* protected call: pushes the values serialized in the given buffer */
+    luaser_buffer  *buf = lua_touserdata(L, 1);
+    const char     *p, *end;
+
+    lua_settop(L, 0);
+    p = buf->data;
+    end = p + buf->len;
+    while (p < end) {
+        p += luaser_decode(L, p, end - p);
+    }
+
+    return lua_gettop(L);
+}
+
+/* pushes into co the n values serialized in buf (one or more frames). The
+ * deserialization can fail (bad metatable, ...), it is done in L, an idle
+ * state of the same VM (or co itself), to catch errors. */
+ngx_int_t
+ngx_http_resty_threadpool_decode_values(lua_State *L, lua_State *co,
+    luaser_buffer *buf, ngx_int_t n, ngx_log_t *log)
+{
+    int  top;
+
+    if (!lua_checkstack(L, n + 2) || !lua_checkstack(co, n)) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "too many values to deserialize");
+        return NGX_ERROR;
+    }
+
+    top = lua_gettop(L);
+    lua_pushcfunction(L, ngx_http_resty_threadpool_decode_frames);
+    lua_pushlightuserdata(L, buf);
+    if (lua_pcall(L, 1, LUA_MULTRET, 0) != 0) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "failed to deserialize values: %s",
+                      lua_tostring(L, -1));
+        lua_settop(L, top);
+        return NGX_ERROR;
+    }
+
+    lua_xmove(L, co, lua_gettop(L) - top);
+    return NGX_OK;
+}
+
+static int
+ngx_http_resty_threadpool_encode_results(lua_State *L)
+{
+    /* protected call: serializes the results into the task buffer, returns
+     * them followed by the table anchoring the big strings */
+    ngx_http_resty_threadpool_state_t *thread = lua_touserdata(L, 1);
+    int                                n;
+
+    n = lua_gettop(L) - 1;
+    lua_newtable(L);
+
+    if (thread->memoized) {
+        /* the frame is kept after the run */
+        luaser_encode_values(L, 2, n, &thread->res);
+
+    } else {
+        luaser_encode_values_ref(L, 2, n, &thread->res,
+                                 NGX_HTTP_RESTY_THREADPOOL_REF_MIN, -1);
+
+        /* the results are handed over as soon as the run is done */
+        luaser_move_bytes(L, -1, 1, (int) lua_objlen(L, -1));
+    }
+
+    lua_remove(L, 1);
+    return n + 1;
+}
+
+/* registry key of the task running in a state, for the interrupt hook */
+static char  ngx_http_resty_threadpool_current;
+
+static void
+ngx_http_resty_threadpool_task_enter(lua_State *L,
+    ngx_http_resty_threadpool_state_t *thread, ngx_log_t *log)
+{
+    lua_pushlightuserdata(L, &ngx_http_resty_threadpool_current);
+    lua_pushlightuserdata(L, thread);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    ngx_http_resty_threadpool_api_set_log(L, log);
+    ngx_http_resty_threadpool_resources_expire(L, log);
+
+    /* the memory limit is per task: resident VMs are not held to it */
+    if (thread->slot == NULL) {
+        ngx_http_resty_threadpool_alloc_enforce(L, 1);
+    }
+}
+
+static void
+ngx_http_resty_threadpool_task_leave(lua_State *L)
+{
+    ngx_http_resty_threadpool_alloc_enforce(L, 0);
+    ngx_http_resty_threadpool_api_set_log(L, NULL);
+
+    /* the hook can be set by the main thread after the task is over, the next
+     * task would run under it for nothing */
+    if (lua_gethook(L) != NULL) {
+        lua_sethook(L, NULL, 0, 0);
+    }
+}
+
+static int
+ngx_http_resty_threadpool_task_load(lua_State *co)
+{
+    /* pushes the function of a new task */
+    ngx_http_resty_threadpool_state_t *thread = lua_touserdata(co, 1);
+
+    if (!thread->named) {
+        ngx_http_resty_threadpool_code_load(co, thread->code,
+                                            thread->codelen);
+        return 1;
+    }
+
+    ngx_http_resty_threadpool_code_load_named(co, thread->code,
+                                              thread->codelen);
+    if (!lua_isfunction(co, -1)) {
+        lua_pushliteral(co, "unknown lua task \"");
+        lua_pushlstring(co, (char *) thread->code, thread->codelen);
+        lua_pushliteral(co, "\"");
+        lua_concat(co, 3);
+        return lua_error(co);
+    }
+
+    return 1;
+}
+
+/* task running in the given state, NULL if none */
+ngx_http_resty_threadpool_state_t *
+ngx_http_resty_threadpool_task_current(lua_State *L)
+{
+    ngx_http_resty_threadpool_state_t *thread;
+
+    lua_pushlightuserdata(L, &ngx_http_resty_threadpool_current);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    thread = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    return thread;
+}
+
+static void
+ngx_http_resty_threadpool_interrupt_hook(lua_State *L, lua_Debug *ar)
+{
+    /* set by the main thread, runs in the worker thread: raises an error in
+     * the current task if it has been cancelled. The hook stays until the end
+     * of the run, so the error cannot be caught for good by a pcall. */
+    ngx_http_resty_threadpool_state_t *thread;
+
+    thread = ngx_http_resty_threadpool_task_current(L);
+    if (thread != NULL && thread->cancelled) {
+        luaL_error(L, "lua task cancelled");
+    }
+}
+
+static int
+ngx_http_resty_threadpool_task_map(lua_State *co,
+    ngx_http_resty_threadpool_state_t *thread, ngx_log_t *log)
+{
+    /* map chunk: calls the function at the bottom of the stack on each item
+     * of the table above it, and replaces the item by the result. Returns like
+     * lua_resume(). */
+    ngx_uint_t  i;
+
+    if (!lua_istable(co, 2) || !lua_checkstack(co, 3)) {
+        lua_settop(co, 0);
+        lua_pushliteral(co, "bad map items");
+        return LUA_ERRRUN;
+    }
+
+    for (i = 1; i <= thread->nitems; i++) {
+        if (thread->cancelled) {
+            lua_settop(co, 0);
+            lua_pushliteral(co, "lua task cancelled");
+            return LUA_ERRRUN;
+        }
+
+        lua_pushvalue(co, 1);
+        lua_rawgeti(co, 2, i);
+        if (lua_pcall(co, 1, 1, 0) != 0) {
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "failed to run lua map function on item %ui: %s",
+                          thread->first + i - 1, lua_tostring(co, -1));
+            lua_pop(co, 1);
+            lua_pushnil(co);
+        }
+
+        lua_rawseti(co, 2, i);
+    }
+
+    lua_remove(co, 1);
+    return 0;
+}
+
+static void
+ngx_http_resty_threadpool_task_exec(ngx_http_resty_threadpool_state_t *thread,
+    lua_State *L, ngx_log_t *log)
+{
+    lua_State                         *co;
+    ngx_int_t                          nargs, nres;
+    ngx_uint_t                         start;
+    int                                top, rc;
+
+    if (thread->cancelled) {
+        /* cancelled while queued: do not even start */
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "lua task %p cancelled before running", thread);
+        ngx_http_resty_threadpool_task_leave(L);
+        thread->res.len = 0;
+        thread->nres = 0;
+        thread->status = LUA_THREADPOOL_TASK_FAILED;
+        return;
+    }
+
+    ngx_http_resty_threadpool_task_enter(L, thread, log);
+
+    if (thread->status == LUA_THREADPOOL_TASK_CREATED) {
+        /* new task: load the function in a new coroutine */
         co = lua_newthread(L);
-        luaser_decode(co, code, codelen);
-        lua_remove(L, 1); /* the parameters can be GCed now */
-        ngx_http_lua_assert(lua_gettop(L) == 1);
+        if (thread->slot != NULL) {
+            /* shared VM: anchor the coroutine in the registry */
+            thread->co_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        } else {
+            /* own state: the coroutine stays at the bottom of the stack */
+            ngx_http_lua_assert(lua_gettop(L) == 1);
+        }
+
+        thread->co = co;
+
+        /* the code is loaded under a protected call: a raised error would
+         * unwind to the panic handler, and take the worker down */
+        lua_pushcfunction(co, ngx_http_resty_threadpool_task_load);
+        lua_pushlightuserdata(co, thread);
+        if (lua_pcall(co, 1, 1, 0) != 0) {
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "failed to load lua task: %s",
+                          lua_tostring(co, -1));
+            goto failed;
+        }
+
+        if (thread->channel != NULL) {
+            /* streaming task: the producer end comes first */
+            ngx_http_resty_threadpool_channel_push(co, thread->channel);
+        }
+
     } else {
-        /* already created: the running coro is still on the top of the stack */
-        ngx_http_lua_assert(ctx->thread->status == LUA_THREADPOOL_TASK_YIELDED);
-        ngx_http_lua_assert(lua_gettop(L) == 1);
-        co = lua_tothread(L, 1);
-        ngx_http_lua_assert(co != NULL && lua_gettop(co) == 0);
+        /* already created: the coroutine has been suspended */
+        ngx_http_lua_assert(thread->status == LUA_THREADPOOL_TASK_YIELDED);
+        co = thread->co;
+        ngx_http_lua_assert(co != NULL);
+
+        /* drop the previous results, the main thread is done with them */
+        lua_settop(co, 0);
     }
 
-    ctx->thread->status = LUA_THREADPOOL_TASK_RUNNING;
-    switch (lua_resume(co, 0)) {
+    /* arguments: the ones given to create() on the first run, followed by the
+     * ones given to resume() */
+    nargs = thread->nargs;
+    if (nargs > 0) {
+        start = thread->stats ? ngx_http_resty_threadpool_stats_now() : 0;
+        if (ngx_http_resty_threadpool_decode_values(L, co, &thread->args,
+                                                    nargs, log)
+            != NGX_OK)
+        {
+            goto failed;
+        }
+
+        if (thread->stats) {
+            ngx_http_resty_threadpool_stats_add(thread->stats, usec_in,
+                ngx_http_resty_threadpool_stats_now() - start);
+        }
+    }
+
+    if (thread->channel != NULL
+        && thread->status == LUA_THREADPOOL_TASK_CREATED)
+    {
+        nargs++;
+    }
+
+    thread->status = LUA_THREADPOOL_TASK_RUNNING;
+    rc = thread->map
+         ? ngx_http_resty_threadpool_task_map(co, thread, log)
+         : lua_resume(co, nargs);
+
+    switch (rc) {
     case 0: /* finished */
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "lua task completed");
-        ctx->thread->status = LUA_THREADPOOL_TASK_SUCCESS;
+        thread->status = LUA_THREADPOOL_TASK_SUCCESS;
         break;
     case LUA_YIELD:
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "lua task suspended");
-        ctx->thread->status = LUA_THREADPOOL_TASK_YIELDED;
+        thread->status = LUA_THREADPOOL_TASK_YIELDED;
         break;
     default: { /* error */
         const char *msg = lua_tostring(co, -1);
-        ngx_log_error(NGX_LOG_ERR, log, 0,
-                      "failed to run lua code in thread: %s", msg);
+        size_t      size = ngx_http_resty_threadpool_alloc_exceeded(L);
+
+        if (size > 0) {
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "lua task reached its memory limit, allocating "
+                          "%uz bytes: %s", size, msg);
+        } else {
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "failed to run lua code in thread: %s", msg);
+        }
+
         goto failed;
     }
     }
 
     /* serialize returned values */
-    /* TODO: bench that, matbe it worth making a special case when the result
-     * is a single string (avoid to make too many copies).
-     * TODO: the serialization could actually use the main thread instead of creating one
-     */
     nres = lua_gettop(co);
-    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0,
-                   "lua task returned %d results: \"%V?%V\"",
-                   nres, &(ctx->r->uri), &(ctx->r->args));
-    for (i = 1; i <= nres; i++) {
-        luaser_encode(co, i);
-    }
-    lua_xmove(co, L, nres);
-    lua_pop(co, nres); /* TODO: lua_settop(co, 0); */
-    ngx_http_lua_assert(lua_gettop(co) == 0);
-    ngx_http_lua_assert(lua_gettop(L) == 1 + nres); /* (thread, res1, ..., resN) */
-    ngx_http_lua_assert(lua_type(L, 1) == LUA_TTHREAD);
-    ctx->nres = nres;
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "lua task %p returned %i results", thread, nres);
+
+    /* results are copied out of the Lua state as the main thread cannot touch
+     * a resident VM, except for big strings: they are read in place by the
+     * main thread, so the results stay on the coroutine stack (along with the
+     * table anchoring these strings) until the next run or the release of the
+     * task. The serialization is done in L, under a protected call. */
+    thread->res.len = 0;
+    if (nres > 0) {
+        top = lua_gettop(L);
+        if (!lua_checkstack(L, nres + 3) || !lua_checkstack(co, 1)) {
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "too many results returned by lua task");
+            goto failed;
+        }
+
+        start = thread->stats ? ngx_http_resty_threadpool_stats_now() : 0;
+        lua_pushcfunction(L, ngx_http_resty_threadpool_encode_results);
+        lua_pushlightuserdata(L, thread);
+        lua_xmove(co, L, nres);
+        if (lua_pcall(L, nres + 1, LUA_MULTRET, 0) != 0) {
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "failed to serialize lua task results: %s",
+                          lua_tostring(L, -1));
+            lua_settop(L, top);
+            goto failed;
+        }
+
+        lua_xmove(L, co, lua_gettop(L) - top);
+
+        if (thread->stats) {
+            ngx_http_resty_threadpool_stats_add(thread->stats, usec_out,
+                ngx_http_resty_threadpool_stats_now() - start);
+            ngx_http_resty_threadpool_stats_add(thread->stats, bytes_out,
+                                                thread->res.len);
+        }
+    }
+
+    thread->nres = nres;
+    ngx_http_resty_threadpool_task_leave(L);
     return;
 failed:
-    ctx->nres = 0;
-    ctx->thread->status = LUA_THREADPOOL_TASK_FAILED;
+    lua_settop(co, 0);
+    thread->res.len = 0;
+    thread->nres = 0;
+    thread->status = LUA_THREADPOOL_TASK_FAILED;
+    ngx_http_resty_threadpool_task_leave(L);
 }
 
-static void
-ngx_http_resty_threadpool_thread_event_handler(ngx_event_t *ev)
-{
-    /* called in the main event loop after task completion. Responsible of
-     * copying task result(s) into the calling coroutine */
-    ngx_connection_t            *c;
-    ngx_http_request_t          *r;
-    ngx_thread_lua_task_ctx_t   *ctx;
-    ngx_http_lua_ctx_t          *luactx;
-    ngx_http_lua_co_ctx_t       *coctx;
-    lua_State                   *L;
-    ngx_int_t                    i;
-
-    ctx = ev->data;
-    L = ctx->thread->L;
-    coctx = ctx->coctx;
-    ngx_http_lua_assert(coctx->data == ev->data);
-
-    r = ctx->r;
-    c = r->connection;
-
-    luactx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
-    if (luactx == NULL) {
-        lua_close(ctx->thread->L);
-        ctx->thread->L = NULL;
-        ctx->thread->status = LUA_THREADPOOL_TASK_DESTROYED;
-        return; /* not sure what it means in this case */
-    }
-
-    if (c->fd != (ngx_socket_t) -1) {  /* not a fake connection */
-        ngx_http_log_ctx_t *log_ctx = c->log->data;
-        log_ctx->current_request = r;
-    }
-
-    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "lua task status: %d with %d results: \"%V?%V\"",
-                   ctx->thread->status, ctx->nres, &r->uri, &r->args);
-
-    /* push results into the main coroutine */
-    /* prepare_retvals(r, u, ctx->cur_co_ctx->co); */
-    for (i=1; i <= ctx->nres; i++) {
-        const char *res;
-        size_t reslen;
-        ngx_http_lua_assert(lua_type(L, 1+i) == LUA_TSTRING);
-        res = lua_tolstring(L, 1+i, &reslen);
-        luaser_decode(coctx->co, res, reslen);
-    }
-    lua_pop(L, ctx->nres);
-    ngx_http_lua_assert(lua_gettop(L) == 1 && lua_type(L, 1) == LUA_TTHREAD);
-
-    if (ctx->thread->status == LUA_THREADPOOL_TASK_SUCCESS ||
-        ctx->thread->status == LUA_THREADPOOL_TASK_FAILED)
+static lua_State *
+ngx_http_resty_threadpool_task_state(ngx_http_resty_threadpool_state_t *thread,
+    ngx_log_t *log)
+{
+    /* called from inside the worker thread: creates the own state of a task
+     * that was not given an idle one, or fails the run */
+    lua_State  *L;
+
+    L = ngx_http_resty_threadpool_vm_create(log);
+    if (L == NULL) {
+        thread->res.len = 0;
+        thread->nres = 0;
+        thread->status = LUA_THREADPOOL_TASK_FAILED;
+        return NULL;
+    }
+
+    if (thread->stats) {
+        ngx_http_resty_threadpool_stats_add(thread->stats, states_created, 1);
+    }
+
+    /* set before the cancelled flag is read: either the run sees it, or
+     * thread_interrupt sees the state and sets the hook */
+    thread->L = L;
+    ngx_memory_barrier();
+
+    return L;
+}
+
+void
+ngx_http_resty_threadpool_task_run(ngx_thread_lua_task_ctx_t *ctx,
+    lua_State *L, ngx_log_t *log)
+{
+    /* called from inside the worker thread: responsible to run the actual Lua
+     * code in the given state (the task own state, or the resident VM of the
+     * thread). A task without a state yet gets it here, and the own states
+     * load the named tasks registered since they were last used.
+     */
+    ngx_http_resty_threadpool_state_t *thread = ctx->thread;
+    ngx_http_resty_threadpool_stats_t *stats = thread->stats;
+    ngx_uint_t                         start;
+
+    start = 0;
+
+    if (stats != NULL) {
+        start = ngx_http_resty_threadpool_stats_now();
+        ngx_http_resty_threadpool_stats_observe(&stats->wait,
+                                                start - thread->posted_at);
+        ngx_http_resty_threadpool_stats_add(stats, queued, -1);
+        ngx_http_resty_threadpool_stats_add(stats, running, 1);
+        ngx_http_resty_threadpool_stats_add(stats, runs, 1);
+    }
+
+    if (thread->slot == NULL) {
+        if (L == NULL) {
+            L = ngx_http_resty_threadpool_task_state(thread, log);
+        }
+
+        if (L != NULL) {
+            ngx_http_resty_threadpool_code_sync(L, log);
+        }
+    }
+
+    if (L != NULL) {
+        ngx_http_resty_threadpool_task_exec(thread, L, log);
+    }
+
+    if (stats == NULL) {
+        return;
+    }
+
+    ngx_http_resty_threadpool_stats_add(stats, running, -1);
+    ngx_http_resty_threadpool_stats_observe(&stats->run,
+        ngx_http_resty_threadpool_stats_now() - start);
+}
+
+void
+ngx_http_resty_threadpool_thread_release(
+    ngx_http_resty_threadpool_state_t *thread, ngx_log_t *log)
+{
+    /* gives the Lua resources back once the task is over */
+    if (thread->timer.timer_set) {
+        ngx_del_timer(&thread->timer);
+    }
+
+    if (thread->slot != NULL) {
+        ngx_http_resty_threadpool_resident_detach(thread->slot, thread->co_ref,
+                                                  log);
+        thread->slot = NULL;
+        thread->co_ref = LUA_NOREF;
+    } else if (thread->L != NULL) {
+        lua_sethook(thread->L, NULL, 0, 0);
+        ngx_http_resty_threadpool_vm_release(thread->L, thread->tp, log);
+        thread->L = NULL;
+    }
+
+    if (thread->code != NULL) {
+        ngx_free(thread->code);
+        thread->code = NULL;
+    }
+
+    ngx_http_resty_threadpool_buf_put(&thread->args);
+    ngx_http_resty_threadpool_buf_put(&thread->res);
+    thread->nargs = 0;
+
+    if (thread->channel != NULL) {
+        ngx_http_resty_threadpool_channel_close_producer(thread->channel);
+        ngx_http_resty_threadpool_channel_unref(thread->channel);
+        thread->channel = NULL;
+    }
+
+    thread->co = NULL;
+    thread->status = LUA_THREADPOOL_TASK_DESTROYED;
+}
+
+void
+ngx_http_resty_threadpool_task_done(ngx_thread_lua_task_ctx_t *ctx)
+{
+    /* called in the main event loop after task completion: the results are
+     * handed to the group waiting for them */
+    ngx_http_resty_threadpool_state_t *thread = ctx->thread;
+    ngx_thread_pool_t                 *tp = thread->tp;
+
+    ngx_free(ctx);
+    ngx_http_resty_threadpool_queue_done(thread);
+
+    if (thread->timer.timer_set) {
+        ngx_del_timer(&thread->timer);
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "lua task %p status: %d with %i results",
+                   thread, thread->status, thread->nres);
+
+    if (thread->stats) {
+        ngx_http_resty_threadpool_stats_done(thread);
+    }
+
+    if (thread->code != NULL) {
+        /* the function has been loaded by now */
+        ngx_free(thread->code);
+        thread->code = NULL;
+    }
+
+    /* the arguments have been consumed by the run */
+    thread->args.len = 0;
+    thread->argslen = 0;
+    thread->nargs = 0;
+    thread->nanchors = 0;
+    thread->argsanchors = 0;
+
+    /* the consumer of a stream gets the end of it */
+    if (thread->channel != NULL
+        && (thread->status == LUA_THREADPOOL_TASK_SUCCESS
+            || thread->status == LUA_THREADPOOL_TASK_FAILED))
     {
-        lua_close(ctx->thread->L);
-        ctx->thread->L = NULL;
-        ctx->thread->status = LUA_THREADPOOL_TASK_DESTROYED;
-        coctx->cleanup = NULL;
+        ngx_http_resty_threadpool_channel_close_producer(thread->channel);
     }
 
-    luactx->cur_co_ctx = coctx;
-    if (luactx->entered_content_phase) {
-        (void) ngx_http_resty_threadpool_resume(r);
-    } else {
-        luactx->resume_handler = ngx_http_resty_threadpool_resume;
-        ngx_http_core_run_phases(r);
+    /* coalesced coroutines get their copy of the results first */
+    if (thread->memo != NULL) {
+        ngx_http_resty_threadpool_memo_done(thread);
     }
 
-    ngx_http_run_posted_requests(c);
+    /* the task can be gone once the waiting coroutine has run */
+    ngx_http_resty_threadpool_wait_task_done(thread);
+    ngx_http_resty_threadpool_wait_slot_free(tp);
 }
 
-/* copy of ngx_http_lua_sleep_resume */
-static ngx_int_t
-ngx_http_resty_threadpool_resume(ngx_http_request_t *r)
+ngx_int_t
+ngx_http_resty_threadpool_thread_post(
+    ngx_http_resty_threadpool_state_t *thread, ngx_log_t *log)
 {
-    lua_State                   *vm;
-    ngx_connection_t            *c;
-    ngx_int_t                    rc;
-    ngx_http_lua_ctx_t          *ctx;
+    /* queues the next run of a task. The context is allocated from the heap
+     * rather than from the request pool: the run goes on if the request is
+     * aborted meanwhile. */
+    ngx_thread_lua_task_ctx_t  *ctx;
+    ngx_int_t                   rc;
 
-    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    ctx = ngx_calloc(sizeof(ngx_thread_lua_task_ctx_t), log);
     if (ctx == NULL) {
         return NGX_ERROR;
     }
 
-    ctx->resume_handler = ngx_http_lua_wev_handler;
+    ctx->thread = thread;
 
-    c = r->connection;
-    vm = ngx_http_lua_get_lua_vm(r, ctx);
+    /* set before the run can start */
+    if (thread->stats) {
+        thread->posted_at = ngx_http_resty_threadpool_stats_now();
+        ngx_http_resty_threadpool_stats_add(thread->stats, queued, 1);
+    }
 
-    /* FIXME: result handling is a mess, clean it up and do everything here */
-    rc = ngx_http_lua_run_thread(vm, r, ctx, ((ngx_thread_lua_task_ctx_t *)(ctx->cur_co_ctx->data))->nres);
+    rc = ngx_http_resty_threadpool_queue_post(thread, ctx, log);
+    if (rc != NGX_OK) {
+        if (thread->stats) {
+            ngx_http_resty_threadpool_stats_add(thread->stats, queued, -1);
+        }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "lua run thread returned %d", rc);
+        ngx_free(ctx);
+        return NGX_ERROR;
+    }
+
+    if (thread->stats) {
+        ngx_http_resty_threadpool_stats_add(thread->stats, bytes_in,
+                                            thread->args.len);
+    }
+
+    if (thread->timeout > 0) {
+        thread->timer.handler = ngx_http_resty_threadpool_thread_timeout;
+        thread->timer.data = thread;
+        thread->timer.log = ngx_cycle->log;
+        thread->timer.cancelable = 1;
+        ngx_add_timer(&thread->timer, thread->timeout);
+    }
+
+    return NGX_OK;
+}
+
+void
+ngx_http_resty_threadpool_thread_interrupt(
+    ngx_http_resty_threadpool_state_t *thread, ngx_uint_t reason)
+{
+    /* stops the task: a queued run is dropped, a running one is interrupted
+     * by a hook at its next instruction (code running in JIT traces only
+     * sees it when leaving the trace) */
+    lua_State  *L;
+
+    if (thread->cancelled) {
+        return;
+    }
+
+    thread->cancelled = reason;
+    ngx_memory_barrier();
 
-    if (rc == NGX_AGAIN) {
-        return ngx_http_lua_run_posted_threads(c, vm, r, ctx);
+    if (thread->channel != NULL) {
+        /* may be waiting for room in the channel */
+        ngx_http_resty_threadpool_channel_interrupt(thread->channel);
     }
 
-    if (rc == NGX_DONE) {
-        ngx_http_lua_finalize_request(r, NGX_DONE);
-        return ngx_http_lua_run_posted_threads(c, vm, r, ctx);
+    if (thread->group == NULL) {
+        return; /* not queued nor running */
     }
 
-    if (ctx->entered_content_phase) {
-        ngx_http_lua_finalize_request(r, rc);
-        return NGX_DONE;
+    L = thread->slot != NULL
+        ? ngx_http_resty_threadpool_resident_state(thread->slot)
+        : thread->L;
+    if (L == NULL) {
+        /* the state of the run is not created yet, the run sees the flag
+         * once it is (see task_state) */
+        return;
     }
 
-    return rc;
+    lua_sethook(L, ngx_http_resty_threadpool_interrupt_hook,
+                LUA_MASKCALL | LUA_MASKRET | LUA_MASKCOUNT, 1);
 }
 
 static void
-ngx_http_resty_threadpool_task_cleanup(void *data)
+ngx_http_resty_threadpool_thread_timeout(ngx_event_t *ev)
 {
-    ngx_log_debug0(NGX_LOG_CRIT, ngx_cycle->log, 0,
-                   "ngx_http_resty_threadpool_task_cleanup: this is not really supposed to happen.");
-    /* TODO: free buffer memory for SUCCESS or FAILED states */
+    ngx_http_resty_threadpool_state_t *thread = ev->data;
+
+    ngx_log_error(NGX_LOG_ERR, ev->log, 0, "lua task %p timed out", thread);
+    ngx_http_resty_threadpool_thread_interrupt(thread,
+                                               LUA_THREADPOOL_TIMEDOUT);
 }
 
 /***********/
 /* Lua API */
 /***********/
 
-#define LUA_THREADPOOL_MT_NAME "resty.threadpool"
+/* appends the n values from first to the arguments of the next run of the
+ * task at idx */
+void
+ngx_http_resty_threadpool_thread_encode_args(lua_State *L, int idx, int first,
+    int n)
+{
+    ngx_http_resty_threadpool_state_t *thread;
+    ngx_uint_t                         start;
+
+    thread = lua_touserdata(L, idx);
+
+    /* the anchors of the previous arguments can go once they have been read
+     * by a run (or dropped) */
+    lua_getfield(L, LUA_REGISTRYINDEX, NGX_HTTP_RESTY_THREADPOOL_ARGS_KEY);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_createtable(L, 0, 1);
+        lua_pushliteral(L, "k");
+        lua_setfield(L, -2, "__mode");
+        lua_setmetatable(L, -2);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX,
+                     NGX_HTTP_RESTY_THREADPOOL_ARGS_KEY);
+    }
 
-static int
-ngx_http_resty_threadpool_thread_create(lua_State *L) {
+    lua_pushvalue(L, idx);
+    lua_rawget(L, -2);
+    if (lua_isnil(L, -1) || (thread->args.len == 0 && lua_objlen(L, -1) > 0))
+    {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, idx);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -4);
+    }
+
+    start = thread->stats ? ngx_http_resty_threadpool_stats_now() : 0;
+
+    luaser_encode_values_ref(L, first, n, &thread->args,
+                             NGX_HTTP_RESTY_THREADPOOL_REF_MIN, -1);
+
+    if (thread->stats) {
+        ngx_http_resty_threadpool_stats_add(thread->stats, usec_in,
+            ngx_http_resty_threadpool_stats_now() - start);
+    }
+
+    thread->nanchors = (int) lua_objlen(L, -1);
+    lua_pop(L, 2);
+    thread->nargs += n;
+}
+
+/* pushes the anchors of the arguments of the task at idx, or nil */
+static void
+ngx_http_resty_threadpool_thread_anchors(lua_State *L, int idx)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, NGX_HTTP_RESTY_THREADPOOL_ARGS_KEY);
+    if (lua_isnil(L, -1)) {
+        return;
+    }
+
+    lua_pushvalue(L, idx);
+    lua_rawget(L, -2);
+    lua_remove(L, -2);
+}
+
+/* drops the arguments given since create() to the task at idx (the ones of
+ * a resume that failed to serialize them, or to post the run), with their
+ * anchors: their buffers stay usable */
+void
+ngx_http_resty_threadpool_thread_rewind_args(lua_State *L, int idx)
+{
+    ngx_http_resty_threadpool_state_t *thread;
+    int                                i;
+
+    thread = lua_touserdata(L, idx);
+    thread->args.len = thread->argslen;
+    thread->nanchors = thread->argsanchors;
+
+    ngx_http_resty_threadpool_thread_anchors(L, idx);
+    if (lua_istable(L, -1)) {
+        for (i = (int) lua_objlen(L, -1); i > thread->nanchors; i--) {
+            lua_rawgeti(L, -1, i);
+            lua_pushnil(L);
+            lua_rawset(L, -3);
+            lua_pushnil(L);
+            lua_rawseti(L, -2, i);
+        }
+    }
+
+    lua_pop(L, 1);
+}
+
+/* detaches the buffers given as arguments to the task at idx, once its run
+ * has been posted: only the run can use them from now on */
+void
+ngx_http_resty_threadpool_thread_move_args(lua_State *L, int idx)
+{
+    ngx_http_resty_threadpool_state_t *thread;
+
+    thread = lua_touserdata(L, idx);
+
+    ngx_http_resty_threadpool_thread_anchors(L, idx);
+    if (lua_istable(L, -1)) {
+        luaser_move_bytes(L, -1, 1, thread->nanchors);
+    }
+
+    lua_pop(L, 1);
+}
+
+/* pushes a new task running the function (or registered name) at fidx on
+ * the given pool, without arguments */
+ngx_http_resty_threadpool_state_t *
+ngx_http_resty_threadpool_thread_new(lua_State *L, ngx_str_t *pool, int fidx)
+{
     ngx_http_resty_threadpool_state_t *ud;
+    ngx_http_resty_threadpool_conf_t  *tpcf;
+    ngx_http_resty_threadpool_pool_t  *tpool;
     const char                        *code;
-    ngx_str_t                          pool;
     size_t                             codelen;
-
-    pool.data = (u_char *)luaL_checklstring(L, 1, &pool.len);
-    luaL_checktype(L, 2, LUA_TFUNCTION);
+    ngx_str_t                          name;
 
     ud = lua_newuserdata(L, sizeof(ngx_http_resty_threadpool_state_t));
+    ngx_memzero(ud, sizeof(ngx_http_resty_threadpool_state_t));
     ud->status = LUA_THREADPOOL_TASK_CREATED;
-    ud->L = NULL;
-    /* L = (poolname, func, thread_ud) */
+    ud->co_ref = LUA_NOREF;
+    ud->ref = LUA_NOREF;
+    ud->priority = LUA_THREADPOOL_PRIO_NORMAL;
+    tpcf = ngx_http_cycle_get_module_main_conf((ngx_cycle_t *) ngx_cycle,
+                                      ngx_http_resty_threadpool_module);
+    ngx_http_resty_threadpool_buf_get(&ud->args);
+    ngx_http_resty_threadpool_buf_get(&ud->res);
+    ud->args.max = tpcf->max_serialized;
+    ud->res.max = tpcf->max_serialized;
 
     luaL_getmetatable(L, LUA_THREADPOOL_MT_NAME);
     lua_setmetatable(L, -2);
-    /* L = (poolname, func, thread_ud) */
+
+    /* serialize the code for now, the actual loading will be done in thread;
+     * registered tasks are already loaded there, only send the name */
+    if (lua_type(L, fidx) == LUA_TSTRING) {
+        ud->named = 1;
+        lua_pushvalue(L, fidx);
+    } else {
+        ngx_http_resty_threadpool_code_dump(L, fidx);
+    }
+    /* L = (..., thread_ud, serialized) */
+    code = lua_tolstring(L, -1, &codelen);
 
     /* find the thread pool */
-    ud->tp = ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, &pool);
+    tpool = ngx_http_resty_threadpool_pool_find((ngx_cycle_t *) ngx_cycle,
+                                                pool);
+    if (tpool != NULL) {
+        ud->tp = tpool->tp;
+    } else {
+        ud->tp = ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, pool);
+    }
+
     if (ud->tp == NULL) {
-        return luaL_error(L, "no pool '%s' found", pool.data);
+        luaL_error(L, "no pool '%s' found", pool->data);
+        return NULL;
     }
 
-    /* prepare the state: just push the code for now, the actual loading will
-     * be done in thread */
-    ud->L = luaL_newstate();
-    if (ud->L == NULL) {
-        return luaL_error(L, "failed to create task state");
+    ud->code = ngx_alloc(codelen, ngx_cycle->log);
+    if (ud->code == NULL) {
+        luaL_error(L, "failed to allocate task");
+        return NULL;
     }
 
-    luaser_encode(L, 2); /* L = (poolname, func, thread_ud, serialized) */
-    code = lua_tolstring(L, -1, &codelen);
-    lua_pushlstring(ud->L, code, codelen);
-    lua_pop(L, 1); /* L = (poolname, func, thread_ud) */
+    ngx_memcpy(ud->code, code, codelen);
+    ud->codelen = codelen;
+    lua_pop(L, 1); /* L = (..., thread_ud) */
+
+    /* stats are kept per registered task, plain functions share an entry */
+    name.len = ud->named ? ud->codelen : 0;
+    name.data = ud->code;
+    ud->stats = ngx_http_resty_threadpool_stats_get(pool, &name);
+
+    /* prepare the state: either a coroutine in a resident VM, or a state from
+     * the pool (if none is idle, the first run creates one in its thread) */
+    if (tpool != NULL && tpool->nslots > 0) {
+        ud->slot = ngx_http_resty_threadpool_resident_attach(tpool);
+    } else {
+        ud->L = ngx_http_resty_threadpool_vm_get(ngx_cycle->log);
+    }
+
+    if (ud->stats) {
+        ngx_http_resty_threadpool_stats_add(ud->stats, created, 1);
+        if (ud->slot != NULL || ud->L != NULL) {
+            ngx_http_resty_threadpool_stats_add(ud->stats, states_reused, 1);
+        }
+    }
 
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "Lua thread %p created to run on pool %V", ud, &pool);
-    return 1;
+                   "Lua thread %p created to run on pool %V", ud, pool);
+    return ud;
 }
 
 static int
-ngx_http_resty_threadpool_thread_resume(lua_State *L) {
+ngx_http_resty_threadpool_thread_create(lua_State *L) {
     ngx_http_resty_threadpool_state_t *ud;
-    ngx_http_request_t                *r;
-    ngx_thread_task_t                 *task;
-    ngx_thread_lua_task_ctx_t         *ctx;
-    ngx_http_lua_ctx_t                *luactx;
-    ngx_http_lua_co_ctx_t             *coctx;
+    ngx_str_t                          pool;
+    int                                nargs;
 
-    ud = luaL_checkudata(L, 1, LUA_THREADPOOL_MT_NAME);
-    if (ud->status != LUA_THREADPOOL_TASK_CREATED &&
-        ud->status != LUA_THREADPOOL_TASK_YIELDED) {
-        return luaL_error(L, "thread not in good state");
+    nargs = lua_gettop(L) - 2;
+    pool.data = (u_char *)luaL_checklstring(L, 1, &pool.len);
+    if (lua_type(L, 2) != LUA_TSTRING) {
+        luaL_checktype(L, 2, LUA_TFUNCTION);
     }
 
-    r = ngx_http_lua_get_req(L);
-    if (r == NULL) {
-        return luaL_error(L, "no request found");
-    }
+    ud = ngx_http_resty_threadpool_thread_new(L, &pool, 2);
+    /* L = (poolname, func, args..., thread_ud) */
 
-    luactx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
-    if (luactx == NULL) {
-        return luaL_error(L, "no request ctx found");
+    if (nargs > 0) {
+        ngx_http_resty_threadpool_thread_encode_args(L, nargs + 3, 3, nargs);
+        ud->argslen = ud->args.len;
+        ud->argsanchors = ud->nanchors;
     }
 
-    coctx = luactx->cur_co_ctx;
-    if (coctx == NULL) {
-        return luaL_error(L, "no co ctx found");
+    return 1;
+}
+
+static int
+ngx_http_resty_threadpool_thread_cancel(lua_State *L) {
+    ngx_http_resty_threadpool_state_t *ud;
+
+    ud = luaL_checkudata(L, 1, LUA_THREADPOOL_MT_NAME);
+    if (ud->status == LUA_THREADPOOL_TASK_DESTROYED) {
+        return 0;
     }
 
-    // create the task
-    task = ngx_thread_task_alloc(r->pool, sizeof(ngx_thread_lua_task_ctx_t));
-    if (task == NULL) {
-        return luaL_error(L, "failed to allocate task");
+    ngx_http_resty_threadpool_thread_interrupt(ud, LUA_THREADPOOL_CANCELLED);
+    if (ud->group == NULL) {
+        /* nothing runs: the task (and its unread results) is released now */
+        if (ud->stats
+            && (ud->status == LUA_THREADPOOL_TASK_CREATED
+                || ud->status == LUA_THREADPOOL_TASK_YIELDED))
+        {
+            ngx_http_resty_threadpool_stats_add(ud->stats, cancelled, 1);
+        }
+
+        ngx_http_resty_threadpool_thread_release(ud, ngx_cycle->log);
+        ud->buffered = 0;
+        ud->nres = 0;
     }
 
-    task->handler = ngx_http_resty_threadpool_task_handler;
-    ctx = task->ctx;
-    ctx->thread = ud;
-    ctx->coctx = coctx;
-    ctx->r = r;
+    return 0;
+}
+
+static int
+ngx_http_resty_threadpool_thread_settimeout(lua_State *L) {
+    ngx_http_resty_threadpool_state_t *ud;
+    lua_Integer                        ms;
 
-    /* return handler */
-    task->event.data = ctx;
-    task->event.handler = ngx_http_resty_threadpool_thread_event_handler;
+    ud = luaL_checkudata(L, 1, LUA_THREADPOOL_MT_NAME);
+    ms = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, ms >= 0, 2, "timeout must not be negative");
 
-    // push task in queue
-    ngx_http_lua_cleanup_pending_operation(coctx);
-    coctx->cleanup = ngx_http_resty_threadpool_task_cleanup;
-    coctx->data = ctx;
+    /* applies from the next run */
+    ud->timeout = (ngx_msec_t) ms;
+    return 0;
+}
 
+static int
+ngx_http_resty_threadpool_thread_setpriority(lua_State *L) {
+    ngx_http_resty_threadpool_state_t *ud;
+    ngx_str_t                          name;
+    ngx_int_t                          prio;
 
-    if (ngx_thread_task_post(ud->tp, task) != NGX_OK) {
-        return luaL_error(L, "failed to post task to queue");
-    }
+    ud = luaL_checkudata(L, 1, LUA_THREADPOOL_MT_NAME);
+    name.data = (u_char *) luaL_checklstring(L, 2, &name.len);
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "Lua thread %p scheduled for resume", ud);
+    prio = ngx_http_resty_threadpool_runq_priority(&name);
+    luaL_argcheck(L, prio != NGX_ERROR, 2, "unknown priority");
 
-    return lua_yield(L, 0);
+    /* applies from the next run */
+    ud->priority = prio;
+    return 0;
 }
 
 static int
 ngx_http_resty_threadpool_thread_close(lua_State *L) {
     ngx_http_resty_threadpool_state_t *ud;
     ud = luaL_checkudata(L, 1, LUA_THREADPOOL_MT_NAME);
-    /* TODO: check the the task is not actually running or queued */
-    if (ud->L != NULL) {
-       lua_close(ud->L);
-    }
-    ud->L = NULL;
-    ud->status = LUA_THREADPOOL_TASK_DESTROYED;
+    /* tasks are anchored while they run (see the wait module) */
+    ngx_http_resty_threadpool_thread_release(ud, ngx_cycle->log);
     return 0;
 }
 
@@ -429,12 +1158,34 @@ static const luaL_Reg LUA_THREADPOOL_MT[] = {
 
 static const luaL_Reg LUA_THREADPOOL_FUNCTABLE[] = {
     { "create", ngx_http_resty_threadpool_thread_create },
-    { "resume", ngx_http_resty_threadpool_thread_resume },
+    { "resume", ngx_http_resty_threadpool_wait_resume },
+    { "try_resume", ngx_http_resty_threadpool_wait_try_resume },
+    { "wait_slot", ngx_http_resty_threadpool_wait_slot },
+    { "wait_all", ngx_http_resty_threadpool_wait_all },
+    { "wait_any", ngx_http_resty_threadpool_wait_any },
+    { "map", ngx_http_resty_threadpool_wait_map },
+    { "stream", ngx_http_resty_threadpool_channel_open },
+    { "read_file", ngx_http_resty_threadpool_file_read },
+    { "write_file", ngx_http_resty_threadpool_file_write },
+    { "stat", ngx_http_resty_threadpool_file_stat },
+    { "buffer", luaser_bytes_new },
+    { "run_cached", ngx_http_resty_threadpool_memo_run },
+    { "cancel", ngx_http_resty_threadpool_thread_cancel },
+    { "settimeout", ngx_http_resty_threadpool_thread_settimeout },
+    { "setpriority", ngx_http_resty_threadpool_thread_setpriority },
+    { "register", ngx_http_resty_threadpool_code_register },
+    { "register_metatable",
+      ngx_http_resty_threadpool_code_register_metatable },
+    { "register_cdata", ngx_http_resty_threadpool_code_register_cdata },
+    { "cache_stats", ngx_http_resty_threadpool_code_stats },
+    { "stats", ngx_http_resty_threadpool_stats_lua },
     { NULL, NULL }
 };
 
 static int
 luaopen_resty_threadpool(lua_State *L) {
+    ngx_http_resty_threadpool_channel_init(L);
+
     luaL_newmetatable(L, LUA_THREADPOOL_MT_NAME);
     luaL_register(L, NULL, LUA_THREADPOOL_MT);
 
@@ -462,3 +1213,233 @@ ngx_http_resty_threadpool_inject_api(ngx_conf_t *cf)
 
     return NGX_OK; /* do not stop the process loading for that */
 }
+
+static void *
+ngx_http_resty_threadpool_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_resty_threadpool_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_resty_threadpool_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&conf->pools, cf->pool, 4,
+                       sizeof(ngx_http_resty_threadpool_pool_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    conf->state_pool_size = NGX_CONF_UNSET_UINT;
+    conf->state_pool_max = NGX_CONF_UNSET_UINT;
+    conf->max_serialized = NGX_CONF_UNSET_SIZE;
+    conf->read_file_max = NGX_CONF_UNSET_SIZE;
+    conf->arena_size = NGX_CONF_UNSET_SIZE;
+    conf->memory_limit = NGX_CONF_UNSET_SIZE;
+    conf->result_cache_size = NGX_CONF_UNSET_UINT;
+
+    return conf;
+}
+
+static char *
+ngx_http_resty_threadpool_init_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_http_resty_threadpool_conf_t *tpcf = conf;
+
+    ngx_conf_init_uint_value(tpcf->state_pool_size, 0);
+    ngx_conf_init_uint_value(tpcf->state_pool_max, 32);
+    ngx_conf_init_size_value(tpcf->max_serialized, 64 * 1024 * 1024);
+    ngx_conf_init_size_value(tpcf->read_file_max, tpcf->max_serialized);
+    ngx_conf_init_size_value(tpcf->arena_size, 0);
+    ngx_conf_init_size_value(tpcf->memory_limit, 0);
+    ngx_conf_init_uint_value(tpcf->result_cache_size, 1024);
+
+    if (tpcf->state_pool_size > tpcf->state_pool_max) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"threadpool_state_pool_size\" must not be "
+                           "greater than \"threadpool_state_pool_max\"");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+static ngx_http_resty_threadpool_pool_t *
+ngx_http_resty_threadpool_pool_add(ngx_conf_t *cf,
+    ngx_http_resty_threadpool_conf_t *tpcf, ngx_str_t *name)
+{
+    ngx_http_resty_threadpool_pool_t  *pool;
+    ngx_uint_t                         i;
+
+    pool = tpcf->pools.elts;
+    for (i = 0; i < tpcf->pools.nelts; i++) {
+        if (pool[i].name.len == name->len
+            && ngx_strncmp(pool[i].name.data, name->data, name->len) == 0)
+        {
+            return &pool[i];
+        }
+    }
+
+    pool = ngx_array_push(&tpcf->pools);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    ngx_memzero(pool, sizeof(ngx_http_resty_threadpool_pool_t));
+    pool->name = *name;
+
+    /* makes sure the pool is declared with the "thread_pool" directive */
+    pool->tp = ngx_thread_pool_add(cf, name);
+    if (pool->tp == NULL) {
+        return NULL;
+    }
+
+    return pool;
+}
+
+ngx_http_resty_threadpool_pool_t *
+ngx_http_resty_threadpool_pool_find(ngx_cycle_t *cycle, ngx_str_t *name)
+{
+    ngx_http_resty_threadpool_conf_t  *conf;
+    ngx_http_resty_threadpool_pool_t  *pool;
+    ngx_uint_t                         i;
+
+    conf = ngx_http_cycle_get_module_main_conf(cycle,
+                                         ngx_http_resty_threadpool_module);
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    pool = conf->pools.elts;
+    for (i = 0; i < conf->pools.nelts; i++) {
+        if (pool[i].name.len == name->len
+            && ngx_strncmp(pool[i].name.data, name->data, name->len) == 0)
+        {
+            return &pool[i];
+        }
+    }
+
+    return NULL;
+}
+
+static char *
+ngx_http_resty_threadpool_resident(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_resty_threadpool_conf_t *tpcf = conf;
+
+    ngx_str_t                         *value;
+    ngx_int_t                          n;
+    ngx_http_resty_threadpool_pool_t  *pool;
+
+    value = cf->args->elts;
+
+    n = ngx_atoi(value[2].data, value[2].len);
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of resident VMs \"%V\"",
+                           &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    pool = ngx_http_resty_threadpool_pool_add(cf, tpcf, &value[1]);
+    if (pool == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (pool->nslots != 0) {
+        return "is duplicate";
+    }
+
+    pool->nslots = n;
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_resty_threadpool_init_file(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_resty_threadpool_conf_t *tpcf = conf;
+
+    ngx_str_t  *value;
+
+    if (tpcf->init_file.data != NULL) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+    tpcf->init_file = value[1];
+
+    /* relative to the prefix, as lua-nginx-module does */
+    if (ngx_conf_full_name(cf->cycle, &tpcf->init_file, 0) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+static ngx_int_t
+ngx_http_resty_threadpool_init_process(ngx_cycle_t *cycle)
+{
+    ngx_http_resty_threadpool_conf_t *conf;
+    ngx_http_resty_threadpool_pool_t *pool;
+    ngx_http_lua_main_conf_t         *lmcf;
+    ngx_uint_t                        i;
+
+    conf = ngx_http_cycle_get_module_main_conf(cycle,
+                                         ngx_http_resty_threadpool_module);
+    lmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_lua_module);
+    if (conf == NULL || lmcf == NULL || lmcf->lua == NULL) {
+        return NGX_OK; /* no http block */
+    }
+
+    /* the request VM holds the tasks registered from init_by_lua */
+    if (ngx_http_resty_threadpool_code_save(lmcf->lua, cycle->log) != NGX_OK
+        || ngx_http_resty_threadpool_vm_init(cycle, conf) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    pool = conf->pools.elts;
+    for (i = 0; i < conf->pools.nelts; i++) {
+        if (pool[i].nslots > 0
+            && ngx_http_resty_threadpool_resident_init(cycle, &pool[i])
+               != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_resty_threadpool_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_http_resty_threadpool_conf_t *conf;
+    ngx_http_resty_threadpool_pool_t *pool;
+    ngx_uint_t                        i;
+
+    conf = ngx_http_cycle_get_module_main_conf(cycle,
+                                         ngx_http_resty_threadpool_module);
+    if (conf == NULL) {
+        return;
+    }
+
+    /* thread pools are destroyed at this point: nothing is running */
+    pool = conf->pools.elts;
+    for (i = 0; i < conf->pools.nelts; i++) {
+        if (pool[i].nslots > 0) {
+            ngx_http_resty_threadpool_resident_cleanup(cycle, &pool[i]);
+        }
+    }
+
+    ngx_http_resty_threadpool_vm_cleanup(cycle);
+    ngx_http_resty_threadpool_queue_cleanup(cycle);
+
+    while (ngx_http_resty_threadpool_nbufs > 0) {
+        luaser_buffer_free(&ngx_http_resty_threadpool_bufs[
+                               --ngx_http_resty_threadpool_nbufs]);
+    }
+}
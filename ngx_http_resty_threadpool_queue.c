@@ -0,0 +1,385 @@
+/*
+Copyright (c) 2016, Julien Desgats
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "ngx_http_resty_threadpool_queue.h"
+#include "ngx_http_resty_threadpool_resident.h"
+#include "ngx_http_resty_threadpool_stats.h"
+
+/* Run queues: nginx thread pools serve their tasks in order, so a cheap task
+ * posted behind long ones waits for them. The runs of Lua tasks are kept in
+ * queues of our own instead, one per priority class, and the nginx pool only
+ * gets interchangeable tokens: the thread that picks a token runs the best
+ * queued run at that time, not the one queued with the token.
+ *
+ * The classes are served by weighted round robin: a higher class is preferred
+ * as long as it has credits left in the current round, so the lower ones are
+ * slowed down by busy higher ones but never starved.
+ *
+ * Resident VMs have a run queue each (see the resident module), the other
+ * pools share one per pool. Either way, the runs posted to a pool and not
+ * complete yet are counted, to report how busy it is.
+ *
+ * Completed runs are not handed to their tasks one event at a time: they are
+ * collected while nginx drains the done queues of its thread pools, and
+ * completed together by a single posted event, once per event loop
+ * iteration.
+ */
+
+typedef struct ngx_http_resty_threadpool_dispatch_s
+    ngx_http_resty_threadpool_dispatch_t;
+
+struct ngx_http_resty_threadpool_dispatch_s {
+    ngx_thread_pool_t                     *tp;
+    ngx_thread_mutex_t                     mutex;
+    ngx_http_resty_threadpool_runq_t       runq;  /* protected by mutex */
+    ngx_uint_t                             posted; /* runs not complete
+                                                      (main thread) */
+    ngx_http_resty_threadpool_dispatch_t  *next;
+};
+
+typedef struct {
+    ngx_http_resty_threadpool_dispatch_t  *dispatch;
+    ngx_thread_task_t                     *task;
+    ngx_thread_lua_task_ctx_t             *ctx;   /* run picked */
+} ngx_http_resty_threadpool_token_t;
+
+/* credits of each class per round */
+static ngx_uint_t  ngx_http_resty_threadpool_weights[] = { 8, 4, 1 };
+
+static ngx_str_t  ngx_http_resty_threadpool_prio_names[] = {
+    ngx_string("high"),
+    ngx_string("normal"),
+    ngx_string("low")
+};
+
+/* dispatch queues of the pools used so far (main thread only) */
+static ngx_http_resty_threadpool_dispatch_t
+    *ngx_http_resty_threadpool_dispatches;
+
+/* runs completed since the last batch (main thread only) */
+static ngx_queue_t  ngx_http_resty_threadpool_completed;
+static ngx_event_t  ngx_http_resty_threadpool_complete_event;
+
+void
+ngx_http_resty_threadpool_runq_init(ngx_http_resty_threadpool_runq_t *q)
+{
+    ngx_uint_t  i;
+
+    for (i = 0; i < LUA_THREADPOOL_NPRIO; i++) {
+        ngx_queue_init(&q->classes[i]);
+        q->credits[i] = ngx_http_resty_threadpool_weights[i];
+    }
+}
+
+void
+ngx_http_resty_threadpool_runq_push(ngx_http_resty_threadpool_runq_t *q,
+    ngx_thread_lua_task_ctx_t *ctx)
+{
+    ngx_queue_insert_tail(&q->classes[ctx->thread->priority], &ctx->queue);
+}
+
+ngx_thread_lua_task_ctx_t *
+ngx_http_resty_threadpool_runq_pop(ngx_http_resty_threadpool_runq_t *q)
+{
+    ngx_queue_t  *h;
+    ngx_uint_t    i, round;
+
+    for (round = 0; round < 2; round++) {
+        for (i = 0; i < LUA_THREADPOOL_NPRIO; i++) {
+            if (q->credits[i] == 0 || ngx_queue_empty(&q->classes[i])) {
+                continue;
+            }
+
+            q->credits[i]--;
+            h = ngx_queue_head(&q->classes[i]);
+            ngx_queue_remove(h);
+            return ngx_queue_data(h, ngx_thread_lua_task_ctx_t, queue);
+        }
+
+        /* every waiting class used its share: next round */
+        for (i = 0; i < LUA_THREADPOOL_NPRIO; i++) {
+            q->credits[i] = ngx_http_resty_threadpool_weights[i];
+        }
+    }
+
+    return NULL;
+}
+
+ngx_uint_t
+ngx_http_resty_threadpool_runq_empty(ngx_http_resty_threadpool_runq_t *q)
+{
+    ngx_uint_t  i;
+
+    for (i = 0; i < LUA_THREADPOOL_NPRIO; i++) {
+        if (!ngx_queue_empty(&q->classes[i])) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* class of the given name, or NGX_ERROR */
+ngx_int_t
+ngx_http_resty_threadpool_runq_priority(ngx_str_t *name)
+{
+    ngx_uint_t  i;
+
+    for (i = 0; i < LUA_THREADPOOL_NPRIO; i++) {
+        if (ngx_http_resty_threadpool_prio_names[i].len == name->len
+            && ngx_strncmp(ngx_http_resty_threadpool_prio_names[i].data,
+                           name->data, name->len) == 0)
+        {
+            return i;
+        }
+    }
+
+    return NGX_ERROR;
+}
+
+static void
+ngx_http_resty_threadpool_token_handler(void *data, ngx_log_t *log)
+{
+    /* called from inside a worker thread: runs the best queued run */
+    ngx_http_resty_threadpool_token_t    *token = data;
+    ngx_http_resty_threadpool_dispatch_t *dispatch = token->dispatch;
+
+    (void) ngx_thread_mutex_lock(&dispatch->mutex, log);
+    token->ctx = ngx_http_resty_threadpool_runq_pop(&dispatch->runq);
+    (void) ngx_thread_mutex_unlock(&dispatch->mutex, log);
+
+    if (token->ctx != NULL) {
+        ngx_http_resty_threadpool_task_run(token->ctx, token->ctx->thread->L,
+                                           log);
+    }
+}
+
+static void
+ngx_http_resty_threadpool_token_event_handler(ngx_event_t *ev)
+{
+    /* called in the main event loop */
+    ngx_http_resty_threadpool_token_t *token = ev->data;
+
+    if (token->ctx != NULL) {
+        ngx_http_resty_threadpool_queue_complete(token->ctx);
+    }
+
+    /* the thread pool does not look at the task after calling the handler */
+    ngx_free(token->task);
+}
+
+static ngx_http_resty_threadpool_dispatch_t *
+ngx_http_resty_threadpool_dispatch_get(ngx_thread_pool_t *tp, ngx_log_t *log)
+{
+    ngx_http_resty_threadpool_dispatch_t *dispatch;
+
+    for (dispatch = ngx_http_resty_threadpool_dispatches;
+         dispatch != NULL;
+         dispatch = dispatch->next)
+    {
+        if (dispatch->tp == tp) {
+            return dispatch;
+        }
+    }
+
+    dispatch = ngx_calloc(sizeof(ngx_http_resty_threadpool_dispatch_t), log);
+    if (dispatch == NULL) {
+        return NULL;
+    }
+
+    if (ngx_thread_mutex_create(&dispatch->mutex, log) != NGX_OK) {
+        ngx_free(dispatch);
+        return NULL;
+    }
+
+    dispatch->tp = tp;
+    ngx_http_resty_threadpool_runq_init(&dispatch->runq);
+    dispatch->next = ngx_http_resty_threadpool_dispatches;
+    ngx_http_resty_threadpool_dispatches = dispatch;
+
+    return dispatch;
+}
+
+/* queues a run in the dispatch queue and posts its token */
+static ngx_int_t
+ngx_http_resty_threadpool_token_post(
+    ngx_http_resty_threadpool_dispatch_t *dispatch,
+    ngx_thread_lua_task_ctx_t *ctx, ngx_log_t *log)
+{
+    ngx_thread_task_t                  *task;
+    ngx_http_resty_threadpool_token_t  *token;
+    ngx_int_t                           rc;
+
+    task = ngx_calloc(sizeof(ngx_thread_task_t)
+                      + sizeof(ngx_http_resty_threadpool_token_t), log);
+    if (task == NULL) {
+        return NGX_ERROR;
+    }
+
+    token = (ngx_http_resty_threadpool_token_t *) (task + 1);
+    token->dispatch = dispatch;
+    token->task = task;
+
+    task->ctx = token;
+    task->handler = ngx_http_resty_threadpool_token_handler;
+    task->event.data = token;
+    task->event.handler = ngx_http_resty_threadpool_token_event_handler;
+
+    /* the token is posted under the lock, so no thread can take it before
+     * the run is queued, and the run is not queued if the nginx queue is
+     * full */
+    (void) ngx_thread_mutex_lock(&dispatch->mutex, log);
+
+    rc = ngx_thread_task_post(dispatch->tp, task);
+    if (rc == NGX_OK) {
+        ngx_http_resty_threadpool_runq_push(&dispatch->runq, ctx);
+    }
+
+    (void) ngx_thread_mutex_unlock(&dispatch->mutex, log);
+
+    if (rc != NGX_OK) {
+        ngx_free(task);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+/* queues the next run of a task, on its home VM or in the queue of its pool */
+ngx_int_t
+ngx_http_resty_threadpool_queue_post(ngx_http_resty_threadpool_state_t *thread,
+    ngx_thread_lua_task_ctx_t *ctx, ngx_log_t *log)
+{
+    ngx_http_resty_threadpool_dispatch_t *dispatch;
+    ngx_int_t                             rc;
+
+    dispatch = ngx_http_resty_threadpool_dispatch_get(thread->tp, log);
+    if (dispatch == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (thread->slot != NULL) {
+        rc = ngx_http_resty_threadpool_resident_post(thread->slot, ctx, log);
+    } else {
+        rc = ngx_http_resty_threadpool_token_post(dispatch, ctx, log);
+    }
+
+    if (rc == NGX_OK) {
+        dispatch->posted++;
+    }
+
+    return rc;
+}
+
+void
+ngx_http_resty_threadpool_queue_done(ngx_http_resty_threadpool_state_t *thread)
+{
+    ngx_http_resty_threadpool_dispatch_t *dispatch;
+
+    dispatch = ngx_http_resty_threadpool_dispatch_get(thread->tp,
+                                                      ngx_cycle->log);
+    if (dispatch != NULL && dispatch->posted > 0) {
+        dispatch->posted--;
+    }
+}
+
+static void
+ngx_http_resty_threadpool_complete_handler(ngx_event_t *ev)
+{
+    /* posted event: completes every run collected since the last batch, the
+     * waiting coroutines are resumed in the same sweep */
+    ngx_thread_lua_task_ctx_t  *ctx;
+    ngx_queue_t                *q;
+    ngx_uint_t                  n;
+
+    n = 0;
+    while (!ngx_queue_empty(&ngx_http_resty_threadpool_completed)) {
+        q = ngx_queue_head(&ngx_http_resty_threadpool_completed);
+        ngx_queue_remove(q);
+        ctx = ngx_queue_data(q, ngx_thread_lua_task_ctx_t, queue);
+        ngx_http_resty_threadpool_task_done(ctx);
+        n++;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "lua task batch of %ui completions", n);
+
+    ngx_http_resty_threadpool_stats_batch(n);
+}
+
+/* called in the main event loop when a run is over: it is completed with the
+ * next batch */
+void
+ngx_http_resty_threadpool_queue_complete(ngx_thread_lua_task_ctx_t *ctx)
+{
+    ngx_event_t  *ev = &ngx_http_resty_threadpool_complete_event;
+
+    if (ev->handler == NULL) {
+        ngx_queue_init(&ngx_http_resty_threadpool_completed);
+        ev->handler = ngx_http_resty_threadpool_complete_handler;
+        ev->log = ngx_cycle->log;
+    }
+
+    ngx_queue_insert_tail(&ngx_http_resty_threadpool_completed, &ctx->queue);
+
+    /* runs after the events of this iteration, including the rest of the
+     * done queues of the thread pools */
+    if (!ev->posted) {
+        ngx_post_event(ev, &ngx_posted_events);
+    }
+}
+
+/* runs of this worker posted to the pool and not complete yet */
+ngx_uint_t
+ngx_http_resty_threadpool_queue_depth(ngx_thread_pool_t *tp)
+{
+    ngx_http_resty_threadpool_dispatch_t *dispatch;
+
+    for (dispatch = ngx_http_resty_threadpool_dispatches;
+         dispatch != NULL;
+         dispatch = dispatch->next)
+    {
+        if (dispatch->tp == tp) {
+            return dispatch->posted;
+        }
+    }
+
+    return 0;
+}
+
+void
+ngx_http_resty_threadpool_queue_cleanup(ngx_cycle_t *cycle)
+{
+    ngx_http_resty_threadpool_dispatch_t *dispatch;
+
+    while (ngx_http_resty_threadpool_dispatches != NULL) {
+        dispatch = ngx_http_resty_threadpool_dispatches;
+        ngx_http_resty_threadpool_dispatches = dispatch->next;
+        (void) ngx_thread_mutex_destroy(&dispatch->mutex, cycle->log);
+        ngx_free(dispatch);
+    }
+}
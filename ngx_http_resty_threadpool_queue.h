@@ -0,0 +1,63 @@
+/*
+Copyright (c) 2016, Julien Desgats
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef _NGX_HTTP_RESTY_THREADPOOL_QUEUE_H_INCLUDED_
+#define _NGX_HTTP_RESTY_THREADPOOL_QUEUE_H_INCLUDED_
+
+#include "ngx_http_resty_threadpool_common.h"
+
+/* priority classes, from the most urgent */
+#define LUA_THREADPOOL_PRIO_HIGH    0
+#define LUA_THREADPOOL_PRIO_NORMAL  1
+#define LUA_THREADPOOL_PRIO_LOW     2
+#define LUA_THREADPOOL_NPRIO        3
+
+typedef struct {
+    ngx_queue_t  classes[LUA_THREADPOOL_NPRIO]; /* ngx_thread_lua_task_ctx_t */
+    ngx_uint_t   credits[LUA_THREADPOOL_NPRIO]; /* picks left in the round */
+} ngx_http_resty_threadpool_runq_t;
+
+void ngx_http_resty_threadpool_runq_init(
+    ngx_http_resty_threadpool_runq_t *q);
+void ngx_http_resty_threadpool_runq_push(ngx_http_resty_threadpool_runq_t *q,
+    ngx_thread_lua_task_ctx_t *ctx);
+ngx_thread_lua_task_ctx_t *ngx_http_resty_threadpool_runq_pop(
+    ngx_http_resty_threadpool_runq_t *q);
+ngx_uint_t ngx_http_resty_threadpool_runq_empty(
+    ngx_http_resty_threadpool_runq_t *q);
+ngx_int_t ngx_http_resty_threadpool_runq_priority(ngx_str_t *name);
+
+ngx_int_t ngx_http_resty_threadpool_queue_post(
+    ngx_http_resty_threadpool_state_t *thread, ngx_thread_lua_task_ctx_t *ctx,
+    ngx_log_t *log);
+void ngx_http_resty_threadpool_queue_complete(ngx_thread_lua_task_ctx_t *ctx);
+void ngx_http_resty_threadpool_queue_done(
+    ngx_http_resty_threadpool_state_t *thread);
+ngx_uint_t ngx_http_resty_threadpool_queue_depth(ngx_thread_pool_t *tp);
+void ngx_http_resty_threadpool_queue_cleanup(ngx_cycle_t *cycle);
+
+#endif /* _NGX_HTTP_RESTY_THREADPOOL_QUEUE_H_INCLUDED_ */
@@ -0,0 +1,579 @@
+/*
+Copyright (c) 2016, Julien Desgats
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "ngx_http_resty_threadpool_regex.h"
+
+/* ngx.re in task states: match, find and gsub on top of PCRE2.
+ *
+ * Task states move between threads (and resident VMs are shared by their
+ * coroutines), so the compiled regexes are not kept in the Lua states but in
+ * a cache per thread, along with the JIT stack and the match context of the
+ * thread: nothing is shared, so nothing is locked. Every regex is
+ * JIT-compiled and cached (the "j" and "o" options are implied).
+ *
+ * No Lua code runs while a regex from the cache is in use, so a regex cannot
+ * be evicted under the feet of its user.
+ */
+
+#if (NGX_PCRE2)
+
+#define LUA_THREADPOOL_REGEX_CACHE      64
+#define LUA_THREADPOOL_REGEX_JIT_STACK  (32 * 1024)
+#define LUA_THREADPOOL_REGEX_JIT_MAX    (512 * 1024)
+
+typedef struct {
+    u_char            *pattern;
+    size_t             len;
+    uint32_t           options;
+    pcre2_code        *code;
+    pcre2_match_data  *md;
+    uint32_t           ncaptures;
+    uint32_t           namecount;
+    uint32_t           nameentrysize;
+    u_char            *nametable;
+} ngx_http_resty_threadpool_regex_t;
+
+typedef struct {
+    pcre2_jit_stack                    *jit_stack;
+    pcre2_match_context                *mctx;
+    ngx_uint_t                          n;
+    ngx_http_resty_threadpool_regex_t   regexes[LUA_THREADPOOL_REGEX_CACHE];
+                                        /* most recently used first */
+} ngx_http_resty_threadpool_regex_cache_t;
+
+static pthread_key_t   ngx_http_resty_threadpool_regex_key;
+static pthread_once_t  ngx_http_resty_threadpool_regex_once =
+                           PTHREAD_ONCE_INIT;
+
+static void
+ngx_http_resty_threadpool_regex_free(ngx_http_resty_threadpool_regex_t *re)
+{
+    pcre2_match_data_free(re->md);
+    pcre2_code_free(re->code);
+    ngx_free(re->pattern);
+}
+
+static void
+ngx_http_resty_threadpool_regex_cache_free(void *data)
+{
+    /* thread exit */
+    ngx_http_resty_threadpool_regex_cache_t *cache = data;
+
+    while (cache->n > 0) {
+        ngx_http_resty_threadpool_regex_free(&cache->regexes[--cache->n]);
+    }
+
+    pcre2_match_context_free(cache->mctx);
+    pcre2_jit_stack_free(cache->jit_stack);
+    ngx_free(cache);
+}
+
+static void
+ngx_http_resty_threadpool_regex_key_create(void)
+{
+    (void) pthread_key_create(&ngx_http_resty_threadpool_regex_key,
+                              ngx_http_resty_threadpool_regex_cache_free);
+}
+
+static ngx_http_resty_threadpool_regex_cache_t *
+ngx_http_resty_threadpool_regex_cache(void)
+{
+    /* cache of the calling thread, created on first use */
+    ngx_http_resty_threadpool_regex_cache_t *cache;
+
+    (void) pthread_once(&ngx_http_resty_threadpool_regex_once,
+                        ngx_http_resty_threadpool_regex_key_create);
+
+    cache = pthread_getspecific(ngx_http_resty_threadpool_regex_key);
+    if (cache != NULL) {
+        return cache;
+    }
+
+    cache = ngx_calloc(sizeof(ngx_http_resty_threadpool_regex_cache_t),
+                       ngx_cycle->log);
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    cache->mctx = pcre2_match_context_create(NULL);
+    cache->jit_stack = pcre2_jit_stack_create(LUA_THREADPOOL_REGEX_JIT_STACK,
+                                              LUA_THREADPOOL_REGEX_JIT_MAX,
+                                              NULL);
+    if (cache->mctx == NULL || cache->jit_stack == NULL) {
+        ngx_http_resty_threadpool_regex_cache_free(cache);
+        return NULL;
+    }
+
+    pcre2_jit_stack_assign(cache->mctx, NULL, cache->jit_stack);
+
+    if (pthread_setspecific(ngx_http_resty_threadpool_regex_key, cache) != 0)
+    {
+        ngx_http_resty_threadpool_regex_cache_free(cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+static uint32_t
+ngx_http_resty_threadpool_regex_options(lua_State *L, int idx)
+{
+    const char  *p;
+    uint32_t     options;
+
+    p = luaL_optstring(L, idx, "");
+    options = 0;
+
+    for ( /* void */ ; *p; p++) {
+        switch (*p) {
+        case 'i':
+            options |= PCRE2_CASELESS;
+            break;
+        case 'm':
+            options |= PCRE2_MULTILINE;
+            break;
+        case 's':
+            options |= PCRE2_DOTALL;
+            break;
+        case 'x':
+            options |= PCRE2_EXTENDED;
+            break;
+        case 'u':
+            options |= PCRE2_UTF;
+            break;
+        case 'a':
+            options |= PCRE2_ANCHORED;
+            break;
+        case 'D':
+            options |= PCRE2_DUPNAMES;
+            break;
+        case 'j':
+        case 'o':
+            break;  /* always */
+        default:
+            luaL_argerror(L, idx, lua_pushfstring(L, "unknown flag \"%c\"",
+                                                  *p));
+            return 0;
+        }
+    }
+
+    return options;
+}
+
+static ngx_http_resty_threadpool_regex_t *
+ngx_http_resty_threadpool_regex_get(lua_State *L, int idx, uint32_t options)
+{
+    /* compiled regex of the pattern at idx, from the cache of the thread. On
+     * failure, pushes the error message and returns NULL. */
+    ngx_http_resty_threadpool_regex_cache_t *cache;
+    ngx_http_resty_threadpool_regex_t       *re, tmp;
+    const char                              *pattern;
+    size_t                                   len;
+    ngx_uint_t                               i;
+    PCRE2_SIZE                               erroff;
+    PCRE2_UCHAR                              errstr[128];
+    int                                      errcode;
+
+    pattern = luaL_checklstring(L, idx, &len);
+
+    cache = ngx_http_resty_threadpool_regex_cache();
+    if (cache == NULL) {
+        lua_pushliteral(L, "no memory");
+        return NULL;
+    }
+
+    for (i = 0; i < cache->n; i++) {
+        re = &cache->regexes[i];
+        if (re->len == len && re->options == options
+            && ngx_memcmp(re->pattern, pattern, len) == 0)
+        {
+            if (i > 0) {
+                tmp = *re;
+                ngx_memmove(&cache->regexes[1], &cache->regexes[0],
+                            i * sizeof(ngx_http_resty_threadpool_regex_t));
+                cache->regexes[0] = tmp;
+            }
+
+            return &cache->regexes[0];
+        }
+    }
+
+    ngx_memzero(&tmp, sizeof(ngx_http_resty_threadpool_regex_t));
+    tmp.len = len;
+    tmp.options = options;
+    tmp.pattern = ngx_alloc(len ? len : 1, ngx_cycle->log);
+    if (tmp.pattern == NULL) {
+        lua_pushliteral(L, "no memory");
+        return NULL;
+    }
+
+    ngx_memcpy(tmp.pattern, pattern, len);
+
+    tmp.code = pcre2_compile((PCRE2_SPTR) pattern, len, options, &errcode,
+                             &erroff, NULL);
+    if (tmp.code == NULL) {
+        ngx_free(tmp.pattern);
+        pcre2_get_error_message(errcode, errstr, sizeof(errstr));
+        lua_pushfstring(L, "failed to compile regex \"%s\": %s at offset %d",
+                        pattern, errstr, (int) erroff);
+        return NULL;
+    }
+
+    /* without JIT support, the interpreter is used */
+    (void) pcre2_jit_compile(tmp.code, PCRE2_JIT_COMPLETE);
+
+    tmp.md = pcre2_match_data_create_from_pattern(tmp.code, NULL);
+    if (tmp.md == NULL) {
+        pcre2_code_free(tmp.code);
+        ngx_free(tmp.pattern);
+        lua_pushliteral(L, "no memory");
+        return NULL;
+    }
+
+    pcre2_pattern_info(tmp.code, PCRE2_INFO_CAPTURECOUNT, &tmp.ncaptures);
+    pcre2_pattern_info(tmp.code, PCRE2_INFO_NAMECOUNT, &tmp.namecount);
+    if (tmp.namecount > 0) {
+        pcre2_pattern_info(tmp.code, PCRE2_INFO_NAMEENTRYSIZE,
+                           &tmp.nameentrysize);
+        pcre2_pattern_info(tmp.code, PCRE2_INFO_NAMETABLE, &tmp.nametable);
+    }
+
+    if (cache->n == LUA_THREADPOOL_REGEX_CACHE) {
+        ngx_http_resty_threadpool_regex_free(&cache->regexes[--cache->n]);
+    }
+
+    ngx_memmove(&cache->regexes[1], &cache->regexes[0],
+                cache->n * sizeof(ngx_http_resty_threadpool_regex_t));
+    cache->regexes[0] = tmp;
+    cache->n++;
+
+    return &cache->regexes[0];
+}
+
+static int
+ngx_http_resty_threadpool_regex_exec(ngx_http_resty_threadpool_regex_t *re,
+    const char *subject, size_t len, size_t pos, uint32_t options)
+{
+    ngx_http_resty_threadpool_regex_cache_t *cache;
+
+    /* the regex comes from the cache of this thread */
+    cache = pthread_getspecific(ngx_http_resty_threadpool_regex_key);
+    return pcre2_match(re->code, (PCRE2_SPTR) subject, len, pos, options,
+                       re->md, cache->mctx);
+}
+
+static void
+ngx_http_resty_threadpool_regex_captures(lua_State *L,
+    ngx_http_resty_threadpool_regex_t *re, const char *subject, int rc)
+{
+    /* pushes the table of the captures of the last match: whole match at 0,
+     * numbered groups, then named groups (false if not set) */
+    PCRE2_SIZE  *ov;
+    u_char      *entry;
+    uint32_t     i;
+    int          n;
+
+    ov = pcre2_get_ovector_pointer(re->md);
+    lua_createtable(L, re->ncaptures, re->namecount);
+
+    for (i = 0; i <= re->ncaptures; i++) {
+        if ((int) i < rc && ov[2 * i] != PCRE2_UNSET) {
+            lua_pushlstring(L, subject + ov[2 * i], ov[2 * i + 1] - ov[2 * i]);
+        } else {
+            lua_pushboolean(L, 0);
+        }
+
+        lua_rawseti(L, -2, i);
+    }
+
+    entry = re->nametable;
+    for (i = 0; i < re->namecount; i++) {
+        n = (entry[0] << 8) | entry[1];
+        lua_rawgeti(L, -1, n);
+        lua_setfield(L, -2, (char *) entry + 2);
+        entry += re->nameentrysize;
+    }
+}
+
+static size_t
+ngx_http_resty_threadpool_regex_pos(lua_State *L, int idx, size_t len)
+{
+    /* start offset from ctx.pos (1-based) */
+    lua_Integer  pos;
+
+    if (lua_isnoneornil(L, idx)) {
+        return 0;
+    }
+
+    luaL_checktype(L, idx, LUA_TTABLE);
+    lua_getfield(L, idx, "pos");
+    pos = lua_isnil(L, -1) ? 1 : luaL_checkinteger(L, -1);
+    lua_pop(L, 1);
+
+    if (pos < 1) {
+        return 0;
+    }
+
+    return ngx_min((size_t) pos - 1, len);
+}
+
+/* ngx.re.match(subject, regex, options?, ctx?) */
+static int
+ngx_http_resty_threadpool_regex_match(lua_State *L)
+{
+    ngx_http_resty_threadpool_regex_t *re;
+    const char                        *subject;
+    size_t                             len, pos;
+    uint32_t                           options;
+    int                                rc;
+
+    subject = luaL_checklstring(L, 1, &len);
+    options = ngx_http_resty_threadpool_regex_options(L, 3);
+    pos = ngx_http_resty_threadpool_regex_pos(L, 4, len);
+
+    re = ngx_http_resty_threadpool_regex_get(L, 2, options);
+    if (re == NULL) {
+        lua_pushnil(L);
+        lua_insert(L, -2);
+        return 2;
+    }
+
+    rc = ngx_http_resty_threadpool_regex_exec(re, subject, len, pos, 0);
+    if (rc == PCRE2_ERROR_NOMATCH) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    if (rc < 0) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "pcre2_match() failed: %d", rc);
+        return 2;
+    }
+
+    if (!lua_isnoneornil(L, 4)) {
+        lua_pushinteger(L, pcre2_get_ovector_pointer(re->md)[1] + 1);
+        lua_setfield(L, 4, "pos");
+    }
+
+    ngx_http_resty_threadpool_regex_captures(L, re, subject, rc);
+    return 1;
+}
+
+/* ngx.re.find(subject, regex, options?, ctx?) */
+static int
+ngx_http_resty_threadpool_regex_find(lua_State *L)
+{
+    ngx_http_resty_threadpool_regex_t *re;
+    const char                        *subject;
+    size_t                             len, pos;
+    PCRE2_SIZE                        *ov;
+    uint32_t                           options;
+    int                                rc;
+
+    subject = luaL_checklstring(L, 1, &len);
+    options = ngx_http_resty_threadpool_regex_options(L, 3);
+    pos = ngx_http_resty_threadpool_regex_pos(L, 4, len);
+
+    re = ngx_http_resty_threadpool_regex_get(L, 2, options);
+    if (re == NULL) {
+        lua_pushnil(L);
+        lua_insert(L, -2);
+        return 2;
+    }
+
+    rc = ngx_http_resty_threadpool_regex_exec(re, subject, len, pos, 0);
+    if (rc == PCRE2_ERROR_NOMATCH) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    if (rc < 0) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "pcre2_match() failed: %d", rc);
+        return 2;
+    }
+
+    ov = pcre2_get_ovector_pointer(re->md);
+    if (!lua_isnoneornil(L, 4)) {
+        lua_pushinteger(L, ov[1] + 1);
+        lua_setfield(L, 4, "pos");
+    }
+
+    lua_pushinteger(L, ov[0] + 1);
+    lua_pushinteger(L, ov[1]);
+    return 2;
+}
+
+static void
+ngx_http_resty_threadpool_regex_expand(luaL_Buffer *b,
+    ngx_http_resty_threadpool_regex_t *re, const char *subject, int rc,
+    const char *tpl, size_t len)
+{
+    /* appends the replacement template with $N, ${N} and $$ expanded */
+    PCRE2_SIZE  *ov;
+    size_t       i;
+    ngx_uint_t   n, braces;
+
+    ov = pcre2_get_ovector_pointer(re->md);
+
+    for (i = 0; i < len; i++) {
+        if (tpl[i] != '$' || i + 1 == len) {
+            luaL_addchar(b, tpl[i]);
+            continue;
+        }
+
+        i++;
+        if (tpl[i] == '$') {
+            luaL_addchar(b, '$');
+            continue;
+        }
+
+        braces = (tpl[i] == '{');
+        if (braces) {
+            i++;
+        }
+
+        if (i == len || tpl[i] < '0' || tpl[i] > '9') {
+            luaL_error(b->L, "bad template \"%s\"", tpl);
+            return;
+        }
+
+        for (n = 0; i < len && tpl[i] >= '0' && tpl[i] <= '9'; i++) {
+            n = n * 10 + tpl[i] - '0';
+        }
+
+        if (braces) {
+            if (i == len || tpl[i] != '}') {
+                luaL_error(b->L, "bad template \"%s\"", tpl);
+                return;
+            }
+
+        } else {
+            i--;
+        }
+
+        if (n < (ngx_uint_t) rc && ov[2 * n] != PCRE2_UNSET) {
+            luaL_addlstring(b, subject + ov[2 * n], ov[2 * n + 1] - ov[2 * n]);
+        }
+    }
+}
+
+/* ngx.re.gsub(subject, regex, replace, options?) */
+static int
+ngx_http_resty_threadpool_regex_gsub(lua_State *L)
+{
+    ngx_http_resty_threadpool_regex_t *re;
+    const char                        *subject, *tpl;
+    size_t                             len, tlen, pos;
+    PCRE2_SIZE                        *ov;
+    uint32_t                           options;
+    luaL_Buffer                        b;
+    lua_Integer                        count;
+    int                                rc;
+
+    subject = luaL_checklstring(L, 1, &len);
+    tpl = luaL_checklstring(L, 3, &tlen);
+    options = ngx_http_resty_threadpool_regex_options(L, 4);
+
+    re = ngx_http_resty_threadpool_regex_get(L, 2, options);
+    if (re == NULL) {
+        lua_pushnil(L);
+        lua_insert(L, -2);
+        return 2;
+    }
+
+    lua_settop(L, 4);
+    luaL_buffinit(L, &b);
+    count = 0;
+    pos = 0;
+
+    while (pos <= len) {
+        rc = ngx_http_resty_threadpool_regex_exec(re, subject, len, pos, 0);
+        if (rc == PCRE2_ERROR_NOMATCH) {
+            break;
+        }
+
+        if (rc < 0) {
+            luaL_pushresult(&b);
+            lua_pushnil(L);
+            lua_pushfstring(L, "pcre2_match() failed: %d", rc);
+            return 2;
+        }
+
+        ov = pcre2_get_ovector_pointer(re->md);
+        luaL_addlstring(&b, subject + pos, ov[0] - pos);
+        ngx_http_resty_threadpool_regex_expand(&b, re, subject, rc, tpl,
+                                               tlen);
+        count++;
+
+        if (ov[1] > ov[0]) {
+            pos = ov[1];
+            continue;
+        }
+
+        /* empty match: move on by a character */
+        if (ov[1] == len) {
+            pos = len + 1;
+            break;
+        }
+
+        pos = ov[1];
+        do {
+            luaL_addchar(&b, subject[pos]);
+            pos++;
+        } while ((options & PCRE2_UTF) && pos < len
+                 && (subject[pos] & 0xc0) == 0x80);
+    }
+
+    if (pos < len) {
+        luaL_addlstring(&b, subject + pos, len - pos);
+    }
+
+    luaL_pushresult(&b);
+    lua_pushinteger(L, count);
+    return 2;
+}
+
+static const luaL_Reg  ngx_http_resty_threadpool_regex_funcs[] = {
+    { "match", ngx_http_resty_threadpool_regex_match },
+    { "find", ngx_http_resty_threadpool_regex_find },
+    { "gsub", ngx_http_resty_threadpool_regex_gsub },
+    { NULL, NULL }
+};
+
+#endif /* NGX_PCRE2 */
+
+/* sets ngx.re in the ngx table at the top of the stack */
+void
+ngx_http_resty_threadpool_regex_init(lua_State *L)
+{
+#if (NGX_PCRE2)
+    lua_newtable(L);
+    luaL_register(L, NULL, ngx_http_resty_threadpool_regex_funcs);
+    lua_setfield(L, -2, "re");
+#endif
+}
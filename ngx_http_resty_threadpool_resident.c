@@ -0,0 +1,360 @@
+/*
+Copyright (c) 2016, Julien Desgats
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "ngx_http_resty_threadpool_resident.h"
+#include "ngx_http_resty_threadpool_vm.h"
+#include "ngx_http_resty_threadpool_code.h"
+#include "ngx_http_resty_threadpool_queue.h"
+
+/* Resident VMs: each thread of the pool gets a long-lived Lua VM and tasks are
+ * coroutines inside it. A task always runs on its home VM, so it can yield and
+ * be resumed without setting up a new state, and the JIT keeps its traces.
+ *
+ * nginx thread pools have a single queue served by every thread, so each VM
+ * has its own run queue layered on top of it: when a task is queued on an idle
+ * VM, a drain task is posted to the nginx pool and whatever thread picks it
+ * runs the queued tasks on the VM. There is at most one drain task per VM, so
+ * a VM is never used by two threads at once, and a busy VM never blocks a
+ * thread waiting for it.
+ */
+
+struct ngx_http_resty_threadpool_slot_s {
+    ngx_thread_mutex_t                mutex;
+    lua_State                        *L;       /* only used by the drain task
+                                                  (and to interrupt it) */
+    ngx_thread_pool_t                *tp;
+
+    /* protected by mutex */
+    ngx_http_resty_threadpool_runq_t  pending; /* runs, by priority */
+    int                              *refs;    /* coroutines to unanchor */
+    ngx_uint_t                        nrefs;
+    ngx_uint_t                        nalloc;
+    unsigned                          scheduled:1; /* a drain task is queued
+                                                      or running */
+
+    ngx_uint_t                        ntasks;  /* tasks bound to this VM
+                                                  (main thread) */
+};
+
+typedef struct {
+    ngx_http_resty_threadpool_slot_t *slot;
+    ngx_thread_task_t                *task;
+    ngx_queue_t                       done; /* tasks run by this drain */
+} ngx_http_resty_threadpool_drain_t;
+
+static ngx_int_t ngx_http_resty_threadpool_drain_post(
+    ngx_http_resty_threadpool_slot_t *slot, ngx_log_t *log);
+
+static void
+ngx_http_resty_threadpool_drain_handler(void *data, ngx_log_t *log)
+{
+    /* called from inside a worker thread */
+    ngx_http_resty_threadpool_drain_t *drain = data;
+    ngx_http_resty_threadpool_slot_t  *slot = drain->slot;
+    ngx_thread_lua_task_ctx_t         *ctx;
+    ngx_uint_t                         i, more;
+
+    for ( ;; ) {
+        (void) ngx_thread_mutex_lock(&slot->mutex, log);
+
+        for (i = 0; i < slot->nrefs; i++) {
+            luaL_unref(slot->L, LUA_REGISTRYINDEX, slot->refs[i]);
+        }
+        slot->nrefs = 0;
+
+        ctx = ngx_http_resty_threadpool_runq_pop(&slot->pending);
+        if (ctx == NULL) {
+            slot->scheduled = 0;
+            (void) ngx_thread_mutex_unlock(&slot->mutex, log);
+            return;
+        }
+
+        (void) ngx_thread_mutex_unlock(&slot->mutex, log);
+
+        ngx_http_resty_threadpool_task_run(ctx, slot->L, log);
+        ngx_queue_insert_tail(&drain->done, &ctx->queue);
+
+        (void) ngx_thread_mutex_lock(&slot->mutex, log);
+        more = !ngx_http_resty_threadpool_runq_empty(&slot->pending);
+        (void) ngx_thread_mutex_unlock(&slot->mutex, log);
+
+        if (!more) {
+            continue; /* release the pending references and leave */
+        }
+
+        /* more work queued meanwhile: hand it to a new drain task so the
+         * completion of this one is delivered right away */
+        if (ngx_http_resty_threadpool_drain_post(slot, log) == NGX_OK) {
+            return;
+        }
+
+        /* the nginx queue is full: keep going from this thread */
+    }
+}
+
+static void
+ngx_http_resty_threadpool_drain_event_handler(ngx_event_t *ev)
+{
+    /* called in the main event loop: the tasks run by the drain are
+     * completed with the next batch */
+    ngx_http_resty_threadpool_drain_t *drain = ev->data;
+    ngx_thread_lua_task_ctx_t         *ctx;
+    ngx_queue_t                       *q;
+
+    while (!ngx_queue_empty(&drain->done)) {
+        q = ngx_queue_head(&drain->done);
+        ngx_queue_remove(q);
+        ctx = ngx_queue_data(q, ngx_thread_lua_task_ctx_t, queue);
+        ngx_http_resty_threadpool_queue_complete(ctx);
+    }
+
+    /* the thread pool does not look at the task after calling the handler */
+    ngx_free(drain->task);
+}
+
+static ngx_int_t
+ngx_http_resty_threadpool_drain_post(ngx_http_resty_threadpool_slot_t *slot,
+    ngx_log_t *log)
+{
+    /* can be called from the main thread or from a worker thread: drain tasks
+     * are allocated from the heap rather than from a pool */
+    ngx_thread_task_t                 *task;
+    ngx_http_resty_threadpool_drain_t *drain;
+
+    task = ngx_calloc(sizeof(ngx_thread_task_t)
+                      + sizeof(ngx_http_resty_threadpool_drain_t), log);
+    if (task == NULL) {
+        return NGX_ERROR;
+    }
+
+    drain = (ngx_http_resty_threadpool_drain_t *) (task + 1);
+    drain->slot = slot;
+    drain->task = task;
+    ngx_queue_init(&drain->done);
+
+    task->ctx = drain;
+    task->handler = ngx_http_resty_threadpool_drain_handler;
+    task->event.data = drain;
+    task->event.handler = ngx_http_resty_threadpool_drain_event_handler;
+
+    if (ngx_thread_task_post(slot->tp, task) != NGX_OK) {
+        ngx_free(task);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+ngx_int_t
+ngx_http_resty_threadpool_resident_init(ngx_cycle_t *cycle,
+    ngx_http_resty_threadpool_pool_t *pool)
+{
+    ngx_http_resty_threadpool_slot_t *slot;
+    ngx_uint_t                        i;
+
+    pool->slots = ngx_pcalloc(cycle->pool,
+                      pool->nslots * sizeof(ngx_http_resty_threadpool_slot_t));
+    if (pool->slots == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < pool->nslots; i++) {
+        slot = &pool->slots[i];
+        slot->tp = pool->tp;
+        ngx_http_resty_threadpool_runq_init(&slot->pending);
+
+        if (ngx_thread_mutex_create(&slot->mutex, cycle->log) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        slot->L = ngx_http_resty_threadpool_vm_create(cycle->log);
+        if (slot->L == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_http_resty_threadpool_code_sync(slot->L, cycle->log);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, cycle->log, 0,
+                   "lua thread pool %V: %ui resident VMs",
+                   &pool->name, pool->nslots);
+    return NGX_OK;
+}
+
+void
+ngx_http_resty_threadpool_resident_cleanup(ngx_cycle_t *cycle,
+    ngx_http_resty_threadpool_pool_t *pool)
+{
+    ngx_http_resty_threadpool_slot_t *slot;
+    ngx_uint_t                        i;
+
+    if (pool->slots == NULL) {
+        return;
+    }
+
+    for (i = 0; i < pool->nslots; i++) {
+        slot = &pool->slots[i];
+        if (slot->L == NULL) {
+            continue;
+        }
+
+        ngx_http_resty_threadpool_vm_close(slot->L, cycle->log);
+        slot->L = NULL;
+        (void) ngx_thread_mutex_destroy(&slot->mutex, cycle->log);
+
+        if (slot->refs != NULL) {
+            ngx_free(slot->refs);
+        }
+    }
+}
+
+/* loads the new named tasks in every resident VM, only called before the
+ * worker starts to run tasks */
+void
+ngx_http_resty_threadpool_resident_sync(ngx_cycle_t *cycle)
+{
+    ngx_http_resty_threadpool_conf_t *conf;
+    ngx_http_resty_threadpool_pool_t *pool;
+    ngx_uint_t                        i, j;
+
+    conf = ngx_http_cycle_get_module_main_conf(cycle,
+                                         ngx_http_resty_threadpool_module);
+    if (conf == NULL) {
+        return;
+    }
+
+    pool = conf->pools.elts;
+    for (i = 0; i < conf->pools.nelts; i++) {
+        if (pool[i].slots == NULL) {
+            continue; /* not created yet (or master process) */
+        }
+
+        for (j = 0; j < pool[i].nslots; j++) {
+            ngx_http_resty_threadpool_code_sync(pool[i].slots[j].L,
+                                                cycle->log);
+        }
+    }
+}
+
+/* the VM of a slot, the main thread only uses it to set hooks */
+lua_State *
+ngx_http_resty_threadpool_resident_state(
+    ngx_http_resty_threadpool_slot_t *slot)
+{
+    return slot->L;
+}
+
+/* picks the home VM of a new task: the one with the fewest live tasks */
+ngx_http_resty_threadpool_slot_t *
+ngx_http_resty_threadpool_resident_attach(
+    ngx_http_resty_threadpool_pool_t *pool)
+{
+    ngx_http_resty_threadpool_slot_t *slot;
+    ngx_uint_t                        i;
+
+    slot = &pool->slots[0];
+    for (i = 1; i < pool->nslots; i++) {
+        if (pool->slots[i].ntasks < slot->ntasks) {
+            slot = &pool->slots[i];
+        }
+    }
+
+    slot->ntasks++;
+    return slot;
+}
+
+/* unbinds a task from its VM, the coroutine is released by the next drain */
+void
+ngx_http_resty_threadpool_resident_detach(
+    ngx_http_resty_threadpool_slot_t *slot, int co_ref, ngx_log_t *log)
+{
+    int         *refs;
+    ngx_uint_t   schedule;
+
+    slot->ntasks--;
+
+    if (co_ref == LUA_NOREF) {
+        return; /* never ran */
+    }
+
+    (void) ngx_thread_mutex_lock(&slot->mutex, log);
+
+    if (slot->nrefs == slot->nalloc) {
+        refs = ngx_alloc((slot->nalloc * 2 + 16) * sizeof(int), log);
+        if (refs == NULL) {
+            /* leak the coroutine rather than the whole VM */
+            (void) ngx_thread_mutex_unlock(&slot->mutex, log);
+            return;
+        }
+
+        if (slot->refs != NULL) {
+            ngx_memcpy(refs, slot->refs, slot->nrefs * sizeof(int));
+            ngx_free(slot->refs);
+        }
+
+        slot->refs = refs;
+        slot->nalloc = slot->nalloc * 2 + 16;
+    }
+
+    slot->refs[slot->nrefs++] = co_ref;
+
+    schedule = !slot->scheduled;
+    slot->scheduled = 1;
+    (void) ngx_thread_mutex_unlock(&slot->mutex, log);
+
+    if (schedule && ngx_http_resty_threadpool_drain_post(slot, log) != NGX_OK) {
+        /* the references will be released by the next task */
+        (void) ngx_thread_mutex_lock(&slot->mutex, log);
+        slot->scheduled = 0;
+        (void) ngx_thread_mutex_unlock(&slot->mutex, log);
+    }
+}
+
+/* queues a task for execution on its home VM */
+ngx_int_t
+ngx_http_resty_threadpool_resident_post(ngx_http_resty_threadpool_slot_t *slot,
+    ngx_thread_lua_task_ctx_t *ctx, ngx_log_t *log)
+{
+    ngx_uint_t  schedule;
+
+    (void) ngx_thread_mutex_lock(&slot->mutex, log);
+    ngx_http_resty_threadpool_runq_push(&slot->pending, ctx);
+    schedule = !slot->scheduled;
+    slot->scheduled = 1;
+    (void) ngx_thread_mutex_unlock(&slot->mutex, log);
+
+    if (schedule && ngx_http_resty_threadpool_drain_post(slot, log) != NGX_OK) {
+        /* nothing else can be queued: no drain was scheduled */
+        (void) ngx_thread_mutex_lock(&slot->mutex, log);
+        ngx_queue_remove(&ctx->queue);
+        slot->scheduled = 0;
+        (void) ngx_thread_mutex_unlock(&slot->mutex, log);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
@@ -0,0 +1,345 @@
+/*
+Copyright (c) 2016, Julien Desgats
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "ngx_http_resty_threadpool_resources.h"
+#include "ngx_http_resty_threadpool_api.h"
+
+/* Resources kept by a task state across its tasks, for the connections of
+ * blocking client libraries (databases, message queues...) that are too
+ * expensive to open in every task:
+ *
+ *   local resources = require "resty.threadpool.resources"
+ *   local db = resources.get("db")
+ *   if not db then
+ *       db = connect(...)
+ *       resources.set("db", db, { close = function(db) db:close() end,
+ *                                 check = function(db) return db:ping() end,
+ *                                 max_idle = 60 })
+ *   end
+ *
+ * The registry lives in the Lua registry of the state, so the reset done when
+ * a pooled state is given back does not touch it. A state only runs one task
+ * at a time, so the resources are never shared by two running tasks.
+ *
+ * Each entry is a table holding the value and its hooks (see the RES_*
+ * indexes). Idle resources are closed lazily: when they are looked up, and
+ * when a task starts on the state, so the close hooks run in the threads of
+ * the pool as the rest of the task code does. Whatever remains is closed
+ * with the state: by a thread of the pool when the state is dropped (see the
+ * vm module), in the event loop on worker exit.
+ */
+
+#define LUA_THREADPOOL_RESOURCES_KEY  "resty.threadpool.resources"
+
+#define LUA_THREADPOOL_RES_VALUE     1
+#define LUA_THREADPOOL_RES_CLOSE     2
+#define LUA_THREADPOOL_RES_CHECK     3
+#define LUA_THREADPOOL_RES_MAX_IDLE  4  /* ms, 0 for none */
+#define LUA_THREADPOOL_RES_USED      5  /* ngx_current_msec of the last get */
+
+/* pushes the registry of the resources of the state */
+static void
+ngx_http_resty_threadpool_resources_get_registry(lua_State *L)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_THREADPOOL_RESOURCES_KEY);
+    if (lua_istable(L, -1)) {
+        return;
+    }
+
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, LUA_THREADPOOL_RESOURCES_KEY);
+}
+
+/* calls the close hook of the entry on top of the stack, and pops it; errors
+ * are only logged: the resource is gone anyway */
+static void
+ngx_http_resty_threadpool_resources_close_entry(lua_State *L,
+    const char *name, ngx_log_t *log)
+{
+    lua_rawgeti(L, -1, LUA_THREADPOOL_RES_CLOSE);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 2);
+        return;
+    }
+
+    lua_rawgeti(L, -2, LUA_THREADPOOL_RES_VALUE);
+    if (lua_pcall(L, 1, 0, 0) != 0) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "failed to close lua task resource \"%s\": %s",
+                      name, lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+
+    lua_pop(L, 1);
+}
+
+static ngx_uint_t
+ngx_http_resty_threadpool_resources_idle(lua_State *L, int entry)
+{
+    ngx_msec_t  max_idle, used;
+
+    lua_rawgeti(L, entry, LUA_THREADPOOL_RES_MAX_IDLE);
+    max_idle = (ngx_msec_t) lua_tonumber(L, -1);
+    lua_rawgeti(L, entry, LUA_THREADPOOL_RES_USED);
+    used = (ngx_msec_t) lua_tonumber(L, -1);
+    lua_pop(L, 2);
+
+    return max_idle && (ngx_msec_int_t) (ngx_current_msec - used)
+                       > (ngx_msec_int_t) max_idle;
+}
+
+/* resources.get(name): the resource, or nil if there is none, or it has been
+ * idle for too long, or its check hook failed (it is closed then) */
+static int
+ngx_http_resty_threadpool_resources_lua_get(lua_State *L)
+{
+    const char  *name;
+    ngx_uint_t   ok;
+
+    name = luaL_checkstring(L, 1);
+
+    /* numbers name the same resource as their string form */
+    lua_pushstring(L, name);
+    lua_replace(L, 1);
+    lua_settop(L, 1);
+
+    ngx_http_resty_threadpool_resources_get_registry(L);   /* 2 */
+    lua_pushvalue(L, 1);
+    lua_rawget(L, 2);                                      /* 3: entry */
+    if (lua_isnil(L, 3)) {
+        return 1;
+    }
+
+    ok = !ngx_http_resty_threadpool_resources_idle(L, 3);
+
+    if (ok) {
+        lua_rawgeti(L, 3, LUA_THREADPOOL_RES_CHECK);
+        if (!lua_isnil(L, -1)) {
+            lua_rawgeti(L, 3, LUA_THREADPOOL_RES_VALUE);
+            if (lua_pcall(L, 1, 1, 0) != 0) {
+                ngx_log_error(NGX_LOG_WARN,
+                              ngx_http_resty_threadpool_api_get_log(L), 0,
+                              "lua task resource \"%s\" check failed: %s",
+                              name, lua_tostring(L, -1));
+                ok = 0;
+
+            } else {
+                ok = lua_toboolean(L, -1);
+            }
+        }
+
+        lua_pop(L, 1);
+    }
+
+    if (!ok) {
+        lua_pushvalue(L, 1);
+        lua_pushnil(L);
+        lua_rawset(L, 2);
+        ngx_http_resty_threadpool_resources_close_entry(L, name,
+                                   ngx_http_resty_threadpool_api_get_log(L));
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lua_pushnumber(L, (lua_Number) ngx_current_msec);
+    lua_rawseti(L, 3, LUA_THREADPOOL_RES_USED);
+    lua_rawgeti(L, 3, LUA_THREADPOOL_RES_VALUE);
+    return 1;
+}
+
+/* resources.set(name, value, opts?): stores a resource, closing the one
+ * previously stored under the same name (a nil value only closes it). opts
+ * is a table with the optional close(value) and check(value) hooks and the
+ * max_idle time in seconds */
+static int
+ngx_http_resty_threadpool_resources_lua_set(lua_State *L)
+{
+    const char  *name;
+    lua_Number   max_idle;
+
+    name = luaL_checkstring(L, 1);
+    if (!lua_isnoneornil(L, 3)) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+    }
+
+    lua_settop(L, 3);
+    lua_pushstring(L, name);
+    lua_replace(L, 1);
+
+    ngx_http_resty_threadpool_resources_get_registry(L);   /* 4 */
+    lua_pushvalue(L, 1);
+    lua_rawget(L, 4);                                      /* 5: old entry */
+
+    if (!lua_isnil(L, 5)) {
+        lua_rawgeti(L, 5, LUA_THREADPOOL_RES_VALUE);
+        if (!lua_rawequal(L, -1, 2)) {
+            lua_pop(L, 1);
+            lua_pushvalue(L, 5);
+            ngx_http_resty_threadpool_resources_close_entry(L, name,
+                                   ngx_http_resty_threadpool_api_get_log(L));
+        } else {
+            lua_pop(L, 1);
+        }
+    }
+
+    lua_pushvalue(L, 1);
+
+    if (lua_isnil(L, 2)) {
+        lua_pushnil(L);
+        lua_rawset(L, 4);
+        return 0;
+    }
+
+    lua_createtable(L, 5, 0);
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, LUA_THREADPOOL_RES_VALUE);
+
+    max_idle = 0;
+    if (lua_istable(L, 3)) {
+        lua_getfield(L, 3, "close");
+        lua_rawseti(L, -2, LUA_THREADPOOL_RES_CLOSE);
+        lua_getfield(L, 3, "check");
+        lua_rawseti(L, -2, LUA_THREADPOOL_RES_CHECK);
+
+        lua_getfield(L, 3, "max_idle");
+        max_idle = lua_tonumber(L, -1);
+        lua_pop(L, 1);
+
+        if (max_idle < 0) {
+            return luaL_argerror(L, 3, "negative max_idle");
+        }
+    }
+
+    lua_pushnumber(L, max_idle * 1000);
+    lua_rawseti(L, -2, LUA_THREADPOOL_RES_MAX_IDLE);
+    lua_pushnumber(L, (lua_Number) ngx_current_msec);
+    lua_rawseti(L, -2, LUA_THREADPOOL_RES_USED);
+
+    lua_rawset(L, 4);
+    return 0;
+}
+
+/* resources.delete(name): closes the resource stored under name, if any */
+static int
+ngx_http_resty_threadpool_resources_lua_delete(lua_State *L)
+{
+    luaL_checkstring(L, 1);
+    lua_settop(L, 1);
+    lua_pushnil(L);
+    return ngx_http_resty_threadpool_resources_lua_set(L);
+}
+
+static const luaL_Reg ngx_http_resty_threadpool_resources_funcs[] = {
+    { "get", ngx_http_resty_threadpool_resources_lua_get },
+    { "set", ngx_http_resty_threadpool_resources_lua_set },
+    { "delete", ngx_http_resty_threadpool_resources_lua_delete },
+    { NULL, NULL }
+};
+
+static int
+ngx_http_resty_threadpool_resources_open(lua_State *L)
+{
+    lua_newtable(L);
+    luaL_register(L, NULL, ngx_http_resty_threadpool_resources_funcs);
+    return 1;
+}
+
+/* makes the module available to require() in the state */
+void
+ngx_http_resty_threadpool_resources_init(lua_State *L)
+{
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "preload");
+    lua_pushcfunction(L, ngx_http_resty_threadpool_resources_open);
+    lua_setfield(L, -2, LUA_THREADPOOL_RESOURCES_KEY);
+    lua_pop(L, 2);
+}
+
+/* closes the resources that have been idle for too long, or all of them */
+static void
+ngx_http_resty_threadpool_resources_sweep(lua_State *L, ngx_uint_t all,
+    ngx_log_t *log)
+{
+    int          top;
+    const char  *name;
+
+    top = lua_gettop(L);
+
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_THREADPOOL_RESOURCES_KEY);
+    if (!lua_istable(L, -1)) {
+        lua_settop(L, top);
+        return;
+    }
+
+    /* the closed entries are removed after the traversal */
+    lua_newtable(L);
+
+    lua_pushnil(L);
+    while (lua_next(L, top + 1) != 0) {
+        if (all || ngx_http_resty_threadpool_resources_idle(L, -1)) {
+            /* converting the key itself would break lua_next() */
+            lua_pushvalue(L, -2);
+            name = lua_tostring(L, -1);
+            lua_pushvalue(L, -2);
+            ngx_http_resty_threadpool_resources_close_entry(L, name, log);
+            lua_pop(L, 2);
+
+            lua_pushvalue(L, -1);
+            lua_pushboolean(L, 1);
+            lua_rawset(L, top + 2);
+
+        } else {
+            lua_pop(L, 1);
+        }
+    }
+
+    lua_pushnil(L);
+    while (lua_next(L, top + 2) != 0) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_pushnil(L);
+        lua_rawset(L, top + 1);
+    }
+
+    lua_settop(L, top);
+}
+
+/* closes the idle resources, called before a task runs on the state */
+void
+ngx_http_resty_threadpool_resources_expire(lua_State *L, ngx_log_t *log)
+{
+    ngx_http_resty_threadpool_resources_sweep(L, 0, log);
+}
+
+/* closes all the resources, called before the state is closed */
+void
+ngx_http_resty_threadpool_resources_close(lua_State *L, ngx_log_t *log)
+{
+    ngx_http_resty_threadpool_resources_sweep(L, 1, log);
+}
@@ -0,0 +1,694 @@
+/*
+Copyright (c) 2016, Julien Desgats
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "ngx_http_resty_threadpool_stats.h"
+
+/* Statistics: counters and histograms kept in a shared memory zone (see the
+ * threadpool_stats_zone directive), so they cover every worker and survive
+ * reloads. They are kept per pool and task function (the registered name, or
+ * none for plain functions) and updated with atomic operations, from the
+ * threads as well as from the event loops.
+ *
+ * Entries are never removed and are added at the head of a list, so they are
+ * looked up without locking: the zone mutex only serializes the additions.
+ */
+
+typedef struct {
+    ngx_http_resty_threadpool_stats_t      *head;
+    ngx_http_resty_threadpool_histogram_t   batches; /* completions handled
+                                                        per batch */
+} ngx_http_resty_threadpool_stats_sh_t;
+
+typedef struct {
+    char        *name;    /* in the Prometheus output */
+    char        *type;
+    char        *help;
+    ngx_str_t    label;   /* extra Prometheus label */
+    char        *field;   /* in threadpool.stats() */
+    size_t       offset;
+    unsigned     usec:1;  /* time, shown in seconds */
+} ngx_http_resty_threadpool_metric_t;
+
+#define ngx_http_resty_threadpool_metric(name, type, help, label, field,      \
+                                         usec)                                \
+    { name, type, help, label, #field,                                        \
+      offsetof(ngx_http_resty_threadpool_stats_t, field), usec }
+
+static ngx_http_resty_threadpool_metric_t  ngx_http_resty_threadpool_metrics[]
+    = {
+    ngx_http_resty_threadpool_metric("tasks_created_total", "counter",
+        "Tasks created.", ngx_null_string, created, 0),
+    ngx_http_resty_threadpool_metric("runs_total", "counter",
+        "Runs started in a thread.", ngx_null_string, runs, 0),
+    ngx_http_resty_threadpool_metric("tasks_completed_total", "counter",
+        "Tasks that returned.", ngx_null_string, completed, 0),
+    ngx_http_resty_threadpool_metric("tasks_failed_total", "counter",
+        "Tasks that raised an error.", ngx_null_string, failed, 0),
+    ngx_http_resty_threadpool_metric("tasks_cancelled_total", "counter",
+        "Tasks cancelled.", ngx_null_string, cancelled, 0),
+    ngx_http_resty_threadpool_metric("tasks_timedout_total", "counter",
+        "Tasks stopped by their timeout.", ngx_null_string, timedout, 0),
+    ngx_http_resty_threadpool_metric("queued", "gauge",
+        "Runs waiting for a thread.", ngx_null_string, queued, 0),
+    ngx_http_resty_threadpool_metric("running", "gauge",
+        "Runs in progress.", ngx_null_string, running, 0),
+    ngx_http_resty_threadpool_metric("states_created_total", "counter",
+        "Lua states created for tasks.", ngx_null_string, states_created, 0),
+    ngx_http_resty_threadpool_metric("states_reused_total", "counter",
+        "Tasks given an existing Lua state.", ngx_null_string,
+        states_reused, 0),
+    ngx_http_resty_threadpool_metric("serialized_bytes_total", "counter",
+        "Bytes of serialized values.", ngx_string("direction=\"in\""),
+        bytes_in, 0),
+    ngx_http_resty_threadpool_metric("serialized_bytes_total", "counter",
+        "Bytes of serialized values.", ngx_string("direction=\"out\""),
+        bytes_out, 0),
+    ngx_http_resty_threadpool_metric("serialization_seconds_total",
+        "counter", "Time spent serializing and deserializing values.",
+        ngx_string("direction=\"in\""), usec_in, 1),
+    ngx_http_resty_threadpool_metric("serialization_seconds_total",
+        "counter", "Time spent serializing and deserializing values.",
+        ngx_string("direction=\"out\""), usec_out, 1),
+};
+
+#define LUA_THREADPOOL_STATS_NMETRICS                                         \
+    (sizeof(ngx_http_resty_threadpool_metrics)                                \
+     / sizeof(ngx_http_resty_threadpool_metric_t))
+
+static ngx_http_resty_threadpool_metric_t  ngx_http_resty_threadpool_hists[]
+    = {
+    ngx_http_resty_threadpool_metric("queue_wait_seconds", "histogram",
+        "Time from the post of a run to its start.", ngx_null_string,
+        wait, 1),
+    ngx_http_resty_threadpool_metric("run_seconds", "histogram",
+        "Time spent running in a thread.", ngx_null_string, run, 1),
+};
+
+#define LUA_THREADPOOL_STATS_NHISTS                                           \
+    (sizeof(ngx_http_resty_threadpool_hists)                                  \
+     / sizeof(ngx_http_resty_threadpool_metric_t))
+
+/* upper bounds of the histogram buckets, in microseconds */
+static ngx_uint_t  ngx_http_resty_threadpool_bounds[
+    LUA_THREADPOOL_STATS_NBUCKETS - 1] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000,
+    500000, 1000000, 2500000, 5000000, 10000000
+};
+
+/* upper bounds of the buckets of the completion batch sizes */
+static ngx_uint_t  ngx_http_resty_threadpool_batch_bounds[
+    LUA_THREADPOOL_STATS_NBUCKETS - 1] = {
+    1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384,
+    32768
+};
+
+static ngx_int_t
+ngx_http_resty_threadpool_stats_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data)
+{
+    ngx_http_resty_threadpool_stats_sh_t *sh;
+    ngx_slab_pool_t                      *shpool;
+
+    if (data) {
+        /* reload: the counters go on */
+        shm_zone->data = data;
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        return NGX_OK;
+    }
+
+    sh = ngx_slab_calloc(shpool, sizeof(ngx_http_resty_threadpool_stats_sh_t));
+    if (sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    shpool->data = sh;
+    shm_zone->data = sh;
+    return NGX_OK;
+}
+
+static ngx_http_resty_threadpool_stats_t *
+ngx_http_resty_threadpool_stats_find(ngx_http_resty_threadpool_stats_t *s,
+    ngx_str_t *pool, ngx_str_t *task)
+{
+    for ( /* void */ ; s != NULL; s = s->next) {
+        if (s->pool.len == pool->len && s->task.len == task->len
+            && ngx_memcmp(s->pool.data, pool->data, pool->len) == 0
+            && ngx_memcmp(s->task.data, task->data, task->len) == 0)
+        {
+            return s;
+        }
+    }
+
+    return NULL;
+}
+
+/* counters of the given task function on the given pool, NULL if stats are
+ * disabled (or the zone is full) */
+ngx_http_resty_threadpool_stats_t *
+ngx_http_resty_threadpool_stats_get(ngx_str_t *pool, ngx_str_t *task)
+{
+    ngx_http_resty_threadpool_conf_t     *tpcf;
+    ngx_http_resty_threadpool_stats_sh_t *sh;
+    ngx_http_resty_threadpool_stats_t    *s;
+    ngx_slab_pool_t                      *shpool;
+
+    tpcf = ngx_http_cycle_get_module_main_conf((ngx_cycle_t *) ngx_cycle,
+                                      ngx_http_resty_threadpool_module);
+    if (tpcf == NULL || tpcf->stats_zone == NULL) {
+        return NULL;
+    }
+
+    sh = tpcf->stats_zone->data;
+    s = ngx_http_resty_threadpool_stats_find(sh->head, pool, task);
+    if (s != NULL) {
+        return s;
+    }
+
+    shpool = (ngx_slab_pool_t *) tpcf->stats_zone->shm.addr;
+    ngx_shmtx_lock(&shpool->mutex);
+
+    /* another worker may have added it meanwhile */
+    s = ngx_http_resty_threadpool_stats_find(sh->head, pool, task);
+    if (s == NULL) {
+        s = ngx_slab_calloc_locked(shpool,
+                                   sizeof(ngx_http_resty_threadpool_stats_t)
+                                   + pool->len + task->len);
+        if (s != NULL) {
+            s->pool.len = pool->len;
+            s->pool.data = (u_char *) (s + 1);
+            ngx_memcpy(s->pool.data, pool->data, pool->len);
+            s->task.len = task->len;
+            s->task.data = s->pool.data + pool->len;
+            ngx_memcpy(s->task.data, task->data, task->len);
+
+            /* the entry is complete before readers can see it */
+            s->next = sh->head;
+            ngx_memory_barrier();
+            sh->head = s;
+        }
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+    return s;
+}
+
+/* monotonic time in microseconds, callable from the threads */
+ngx_uint_t
+ngx_http_resty_threadpool_stats_now(void)
+{
+#if (NGX_HAVE_CLOCK_MONOTONIC)
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ngx_uint_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+    struct timeval  tv;
+
+    ngx_gettimeofday(&tv);
+    return (ngx_uint_t) tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+static void
+ngx_http_resty_threadpool_stats_observe_value(
+    ngx_http_resty_threadpool_histogram_t *h, ngx_uint_t *bounds,
+    ngx_uint_t v)
+{
+    ngx_uint_t  i;
+
+    for (i = 0; i < LUA_THREADPOOL_STATS_NBUCKETS - 1; i++) {
+        if (v <= bounds[i]) {
+            break;
+        }
+    }
+
+    (void) ngx_atomic_fetch_add(&h->buckets[i], 1);
+    (void) ngx_atomic_fetch_add(&h->sum, v);
+}
+
+void
+ngx_http_resty_threadpool_stats_observe(
+    ngx_http_resty_threadpool_histogram_t *h, ngx_uint_t usec)
+{
+    ngx_http_resty_threadpool_stats_observe_value(h,
+        ngx_http_resty_threadpool_bounds, usec);
+}
+
+/* counts a batch of completions (see the queue module) */
+void
+ngx_http_resty_threadpool_stats_batch(ngx_uint_t n)
+{
+    ngx_http_resty_threadpool_conf_t     *tpcf;
+    ngx_http_resty_threadpool_stats_sh_t *sh;
+
+    tpcf = ngx_http_cycle_get_module_main_conf((ngx_cycle_t *) ngx_cycle,
+                                      ngx_http_resty_threadpool_module);
+    if (tpcf == NULL || tpcf->stats_zone == NULL || n == 0) {
+        return;
+    }
+
+    sh = tpcf->stats_zone->data;
+    ngx_http_resty_threadpool_stats_observe_value(&sh->batches,
+        ngx_http_resty_threadpool_batch_bounds, n);
+}
+
+/* counts the outcome of a run, in the main thread */
+void
+ngx_http_resty_threadpool_stats_done(ngx_http_resty_threadpool_state_t *thread)
+{
+    ngx_http_resty_threadpool_stats_t  *stats = thread->stats;
+
+    switch (thread->status) {
+    case LUA_THREADPOOL_TASK_SUCCESS:
+        ngx_http_resty_threadpool_stats_add(stats, completed, 1);
+        break;
+    case LUA_THREADPOOL_TASK_FAILED:
+        if (thread->cancelled == LUA_THREADPOOL_TIMEDOUT) {
+            ngx_http_resty_threadpool_stats_add(stats, timedout, 1);
+        } else if (thread->cancelled) {
+            ngx_http_resty_threadpool_stats_add(stats, cancelled, 1);
+        } else {
+            ngx_http_resty_threadpool_stats_add(stats, failed, 1);
+        }
+        break;
+    default: /* yielded */
+        break;
+    }
+}
+
+/***********************/
+/* Prometheus exporter */
+/***********************/
+
+static u_char *
+ngx_http_resty_threadpool_stats_escape(u_char *p, ngx_str_t *s)
+{
+    /* label value: at most twice as long as the original */
+    u_char      c;
+    ngx_uint_t  i;
+
+    for (i = 0; i < s->len; i++) {
+        c = s->data[i];
+        if (c == '\\' || c == '"') {
+            *p++ = '\\';
+        } else if (c == '\n') {
+            *p++ = '\\';
+            c = 'n';
+        }
+
+        *p++ = c;
+    }
+
+    return p;
+}
+
+static u_char *
+ngx_http_resty_threadpool_stats_sample(u_char *p, char *name, char *suffix,
+    ngx_http_resty_threadpool_stats_t *s, ngx_str_t *label,
+    ngx_atomic_uint_t v, ngx_uint_t usec)
+{
+    p = ngx_sprintf(p, "resty_threadpool_%s%s{pool=\"", name, suffix);
+    p = ngx_http_resty_threadpool_stats_escape(p, &s->pool);
+    p = ngx_cpymem(p, "\",task=\"", sizeof("\",task=\"") - 1);
+    p = ngx_http_resty_threadpool_stats_escape(p, &s->task);
+    *p++ = '"';
+
+    if (label != NULL && label->len > 0) {
+        *p++ = ',';
+        p = ngx_cpymem(p, label->data, label->len);
+    }
+
+    if (usec) {
+        return ngx_sprintf(p, "} %uA.%06uA\n", v / 1000000, v % 1000000);
+    }
+
+    return ngx_sprintf(p, "} %uA\n", v);
+}
+
+static ngx_int_t
+ngx_http_resty_threadpool_stats_handler(ngx_http_request_t *r)
+{
+    ngx_http_resty_threadpool_conf_t      *tpcf;
+    ngx_http_resty_threadpool_stats_sh_t  *sh;
+    ngx_http_resty_threadpool_stats_t     *head, *s;
+    ngx_http_resty_threadpool_metric_t    *m;
+    ngx_http_resty_threadpool_histogram_t *h;
+    ngx_atomic_uint_t                      v;
+    ngx_uint_t                             i, j;
+    ngx_int_t                              rc;
+    ngx_buf_t                             *b;
+    ngx_chain_t                            out;
+    ngx_str_t                              le;
+    u_char                                 lebuf[32];
+    size_t                                 size;
+    u_char                                *p;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    tpcf = ngx_http_cycle_get_module_main_conf((ngx_cycle_t *) ngx_cycle,
+                                      ngx_http_resty_threadpool_module);
+
+    /* entries added from now on are not seen */
+    head = NULL;
+    if (tpcf->stats_zone != NULL) {
+        sh = tpcf->stats_zone->data;
+        head = sh->head;
+    }
+
+    size = (LUA_THREADPOOL_STATS_NMETRICS + LUA_THREADPOOL_STATS_NHISTS) * 256
+           + (LUA_THREADPOOL_STATS_NBUCKETS + 4) * (128 + NGX_ATOMIC_T_LEN);
+    for (s = head; s != NULL; s = s->next) {
+        size += (LUA_THREADPOOL_STATS_NMETRICS
+                 + LUA_THREADPOOL_STATS_NHISTS
+                   * (LUA_THREADPOOL_STATS_NBUCKETS + 2))
+                * (128 + 2 * NGX_ATOMIC_T_LEN
+                   + 2 * (s->pool.len + s->task.len));
+    }
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    p = b->last;
+
+    for (i = 0; i < LUA_THREADPOOL_STATS_NMETRICS; i++) {
+        /* the samples of a metric follow a single header */
+        m = &ngx_http_resty_threadpool_metrics[i];
+        if (i == 0 || ngx_strcmp(m->name, m[-1].name) != 0) {
+            p = ngx_sprintf(p, "# HELP resty_threadpool_%s %s\n"
+                               "# TYPE resty_threadpool_%s %s\n",
+                            m->name, m->help, m->name, m->type);
+        }
+
+        for (s = head; s != NULL; s = s->next) {
+            v = *(ngx_atomic_t *) ((u_char *) s + m->offset);
+            p = ngx_http_resty_threadpool_stats_sample(p, m->name, "", s,
+                                                       &m->label, v, m->usec);
+        }
+    }
+
+    for (i = 0; i < LUA_THREADPOOL_STATS_NHISTS; i++) {
+        m = &ngx_http_resty_threadpool_hists[i];
+        p = ngx_sprintf(p, "# HELP resty_threadpool_%s %s\n"
+                           "# TYPE resty_threadpool_%s %s\n",
+                        m->name, m->help, m->name, m->type);
+
+        for (s = head; s != NULL; s = s->next) {
+            h = (ngx_http_resty_threadpool_histogram_t *)
+                    ((u_char *) s + m->offset);
+
+            v = 0;
+            for (j = 0; j < LUA_THREADPOOL_STATS_NBUCKETS; j++) {
+                v += h->buckets[j];
+
+                le.data = lebuf;
+                if (j < LUA_THREADPOOL_STATS_NBUCKETS - 1) {
+                    le.len = ngx_sprintf(lebuf, "le=\"%ui.%06ui\"",
+                                 ngx_http_resty_threadpool_bounds[j] / 1000000,
+                                 ngx_http_resty_threadpool_bounds[j] % 1000000)
+                             - lebuf;
+                } else {
+                    le.len = ngx_sprintf(lebuf, "le=\"+Inf\"") - lebuf;
+                }
+
+                p = ngx_http_resty_threadpool_stats_sample(p, m->name,
+                                                           "_bucket", s, &le,
+                                                           v, 0);
+            }
+
+            p = ngx_http_resty_threadpool_stats_sample(p, m->name, "_sum", s,
+                                                       NULL, h->sum, 1);
+            p = ngx_http_resty_threadpool_stats_sample(p, m->name, "_count",
+                                                       s, NULL, v, 0);
+        }
+    }
+
+    if (tpcf->stats_zone != NULL) {
+        h = &sh->batches;
+        p = ngx_sprintf(p, "# HELP resty_threadpool_completion_batch_size "
+                           "Runs completed per event loop iteration.\n"
+                           "# TYPE resty_threadpool_completion_batch_size "
+                           "histogram\n");
+
+        v = 0;
+        for (j = 0; j < LUA_THREADPOOL_STATS_NBUCKETS; j++) {
+            v += h->buckets[j];
+
+            if (j < LUA_THREADPOOL_STATS_NBUCKETS - 1) {
+                p = ngx_sprintf(p, "resty_threadpool_completion_batch_size"
+                                   "_bucket{le=\"%ui\"} %uA\n",
+                                ngx_http_resty_threadpool_batch_bounds[j], v);
+            } else {
+                p = ngx_sprintf(p, "resty_threadpool_completion_batch_size"
+                                   "_bucket{le=\"+Inf\"} %uA\n", v);
+            }
+        }
+
+        p = ngx_sprintf(p, "resty_threadpool_completion_batch_size_sum %uA\n"
+                           "resty_threadpool_completion_batch_size_count "
+                           "%uA\n", h->sum, v);
+    }
+
+    b->last = p;
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+    ngx_str_set(&r->headers_out.content_type, "text/plain; version=0.0.4");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+/**************/
+/* Directives */
+/**************/
+
+char *
+ngx_http_resty_threadpool_stats_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_resty_threadpool_conf_t *tpcf = conf;
+
+    ngx_str_t                        *value;
+    ssize_t                           size;
+    static ngx_str_t                  name =
+                                         ngx_string("resty_threadpool_stats");
+
+    if (tpcf->stats_zone != NULL) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    size = ngx_parse_size(&value[1]);
+    if (size == NGX_ERROR || size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid stats zone size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    tpcf->stats_zone = ngx_shared_memory_add(cf, &name, size,
+                                             &ngx_http_resty_threadpool_module);
+    if (tpcf->stats_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    tpcf->stats_zone->init = ngx_http_resty_threadpool_stats_init_zone;
+    return NGX_CONF_OK;
+}
+
+char *
+ngx_http_resty_threadpool_stats_location(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_resty_threadpool_stats_handler;
+
+    return NGX_CONF_OK;
+}
+
+/***********/
+/* Lua API */
+/***********/
+
+static void
+ngx_http_resty_threadpool_stats_push(lua_State *L, ngx_atomic_uint_t *values,
+    ngx_http_resty_threadpool_histogram_t *hists)
+{
+    /* pushes a table of the given counters */
+    ngx_http_resty_threadpool_metric_t    *m;
+    ngx_http_resty_threadpool_histogram_t *h;
+    ngx_atomic_uint_t                      v;
+    ngx_uint_t                             i, j;
+
+    lua_createtable(L, 0, LUA_THREADPOOL_STATS_NMETRICS
+                          + LUA_THREADPOOL_STATS_NHISTS);
+
+    for (i = 0; i < LUA_THREADPOOL_STATS_NMETRICS; i++) {
+        m = &ngx_http_resty_threadpool_metrics[i];
+        lua_pushnumber(L, m->usec ? (lua_Number) values[i] / 1000000
+                                  : (lua_Number) values[i]);
+        lua_setfield(L, -2, m->field);
+    }
+
+    for (i = 0; i < LUA_THREADPOOL_STATS_NHISTS; i++) {
+        m = &ngx_http_resty_threadpool_hists[i];
+        h = &hists[i];
+
+        lua_createtable(L, 0, 3);
+        lua_createtable(L, LUA_THREADPOOL_STATS_NBUCKETS, 0);
+        v = 0;
+        for (j = 0; j < LUA_THREADPOOL_STATS_NBUCKETS; j++) {
+            v += h->buckets[j];
+            lua_pushnumber(L, (lua_Number) v);
+            lua_rawseti(L, -2, j + 1);
+        }
+
+        lua_setfield(L, -2, "buckets");
+        lua_pushnumber(L, (lua_Number) v);
+        lua_setfield(L, -2, "count");
+        lua_pushnumber(L, (lua_Number) h->sum / 1000000);
+        lua_setfield(L, -2, "sum");
+        lua_setfield(L, -2, m->field);
+    }
+}
+
+int
+ngx_http_resty_threadpool_stats_lua(lua_State *L)
+{
+    ngx_http_resty_threadpool_conf_t      *tpcf;
+    ngx_http_resty_threadpool_stats_sh_t  *sh;
+    ngx_http_resty_threadpool_stats_t     *s;
+    ngx_http_resty_threadpool_histogram_t *h;
+    ngx_http_resty_threadpool_histogram_t  hists[LUA_THREADPOOL_STATS_NHISTS];
+    ngx_http_resty_threadpool_histogram_t  totals_hists[
+                                               LUA_THREADPOOL_STATS_NHISTS];
+    ngx_atomic_uint_t                      values[
+                                               LUA_THREADPOOL_STATS_NMETRICS];
+    ngx_atomic_uint_t                      totals[
+                                               LUA_THREADPOOL_STATS_NMETRICS];
+    ngx_atomic_uint_t                      v;
+    ngx_uint_t                             i, j;
+    ngx_str_t                              pool;
+
+    pool.data = (u_char *) luaL_checklstring(L, 1, &pool.len);
+
+    tpcf = ngx_http_cycle_get_module_main_conf((ngx_cycle_t *) ngx_cycle,
+                                      ngx_http_resty_threadpool_module);
+    if (tpcf == NULL || tpcf->stats_zone == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "no stats zone");
+        return 2;
+    }
+
+    ngx_memzero(totals, sizeof(totals));
+    ngx_memzero(totals_hists, sizeof(totals_hists));
+
+    /* tasks = { [name] = stats } */
+    lua_newtable(L);
+
+    sh = tpcf->stats_zone->data;
+    for (s = sh->head; s != NULL; s = s->next) {
+        if (s->pool.len != pool.len
+            || ngx_memcmp(s->pool.data, pool.data, pool.len) != 0)
+        {
+            continue;
+        }
+
+        /* snapshot: the counters keep moving */
+        for (i = 0; i < LUA_THREADPOOL_STATS_NMETRICS; i++) {
+            values[i] = *(ngx_atomic_t *) ((u_char *) s
+                            + ngx_http_resty_threadpool_metrics[i].offset);
+            totals[i] += values[i];
+        }
+
+        for (i = 0; i < LUA_THREADPOOL_STATS_NHISTS; i++) {
+            h = (ngx_http_resty_threadpool_histogram_t *)
+                    ((u_char *) s + ngx_http_resty_threadpool_hists[i].offset);
+            for (j = 0; j < LUA_THREADPOOL_STATS_NBUCKETS; j++) {
+                hists[i].buckets[j] = h->buckets[j];
+                totals_hists[i].buckets[j] += h->buckets[j];
+            }
+
+            hists[i].sum = h->sum;
+            totals_hists[i].sum += h->sum;
+        }
+
+        lua_pushlstring(L, (char *) s->task.data, s->task.len);
+        ngx_http_resty_threadpool_stats_push(L, values, hists);
+        lua_rawset(L, -3);
+    }
+
+    ngx_http_resty_threadpool_stats_push(L, totals, totals_hists);
+    lua_insert(L, -2);
+    lua_setfield(L, -2, "tasks");
+
+    /* shared by every pool */
+    h = &sh->batches;
+    lua_createtable(L, 0, 3);
+    lua_createtable(L, LUA_THREADPOOL_STATS_NBUCKETS, 0);
+    v = 0;
+    for (j = 0; j < LUA_THREADPOOL_STATS_NBUCKETS; j++) {
+        v += h->buckets[j];
+        lua_pushnumber(L, (lua_Number) v);
+        lua_rawseti(L, -2, j + 1);
+    }
+
+    lua_setfield(L, -2, "buckets");
+    lua_pushnumber(L, (lua_Number) v);
+    lua_setfield(L, -2, "count");
+    lua_pushnumber(L, (lua_Number) h->sum);
+    lua_setfield(L, -2, "sum");
+    lua_setfield(L, -2, "completion_batches");
+
+    return 1;
+}
@@ -0,0 +1,87 @@
+/*
+Copyright (c) 2016, Julien Desgats
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef _NGX_HTTP_RESTY_THREADPOOL_STATS_H_INCLUDED_
+#define _NGX_HTTP_RESTY_THREADPOOL_STATS_H_INCLUDED_
+
+#include "ngx_http_resty_threadpool_common.h"
+
+/* histogram buckets, the last one has no upper bound */
+#define LUA_THREADPOOL_STATS_NBUCKETS  17
+
+typedef struct {
+    ngx_atomic_t  buckets[LUA_THREADPOOL_STATS_NBUCKETS]; /* not cumulative */
+    ngx_atomic_t  sum;                                    /* microseconds for
+                                                             times */
+} ngx_http_resty_threadpool_histogram_t;
+
+/* counters of the tasks of a pool running a given function, shared by every
+ * worker and updated from the threads as well */
+struct ngx_http_resty_threadpool_stats_s {
+    ngx_http_resty_threadpool_stats_t     *next;
+    ngx_str_t                              pool;
+    ngx_str_t                              task;   /* registered name, empty
+                                                      for functions */
+
+    ngx_atomic_t                           created;
+    ngx_atomic_t                           runs;
+    ngx_atomic_t                           completed;
+    ngx_atomic_t                           failed;
+    ngx_atomic_t                           cancelled;
+    ngx_atomic_t                           timedout;
+    ngx_atomic_t                           queued;   /* gauge */
+    ngx_atomic_t                           running;  /* gauge */
+    ngx_atomic_t                           states_created;
+    ngx_atomic_t                           states_reused;
+    ngx_atomic_t                           bytes_in;  /* arguments */
+    ngx_atomic_t                           bytes_out; /* results */
+    ngx_atomic_t                           usec_in;   /* serialization time */
+    ngx_atomic_t                           usec_out;
+
+    ngx_http_resty_threadpool_histogram_t  wait;   /* posted to started */
+    ngx_http_resty_threadpool_histogram_t  run;    /* in the thread */
+};
+
+#define ngx_http_resty_threadpool_stats_add(stats, field, n)                  \
+    (void) ngx_atomic_fetch_add(&(stats)->field, n)
+
+ngx_http_resty_threadpool_stats_t *ngx_http_resty_threadpool_stats_get(
+    ngx_str_t *pool, ngx_str_t *task);
+ngx_uint_t ngx_http_resty_threadpool_stats_now(void);
+void ngx_http_resty_threadpool_stats_observe(
+    ngx_http_resty_threadpool_histogram_t *h, ngx_uint_t usec);
+void ngx_http_resty_threadpool_stats_batch(ngx_uint_t n);
+void ngx_http_resty_threadpool_stats_done(
+    ngx_http_resty_threadpool_state_t *thread);
+
+char *ngx_http_resty_threadpool_stats_zone(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+char *ngx_http_resty_threadpool_stats_location(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+int ngx_http_resty_threadpool_stats_lua(lua_State *L);
+
+#endif /* _NGX_HTTP_RESTY_THREADPOOL_STATS_H_INCLUDED_ */
@@ -0,0 +1,340 @@
+/*
+Copyright (c) 2016, Julien Desgats
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "ngx_http_resty_threadpool_vm.h"
+#include "ngx_http_resty_threadpool_code.h"
+#include "ngx_http_resty_threadpool_api.h"
+#include "ngx_http_resty_threadpool_alloc.h"
+#include "ngx_http_resty_threadpool_resources.h"
+
+/* Pool of ready to use Lua states: creating a state and opening the standard
+ * libraries is often more expensive than the task itself, so states are kept
+ * around and recycled between tasks.
+ *
+ * The pool is per worker process and is only accessed from the main event
+ * loop (states are checked out when a task is created and given back when the
+ * task completes), so no locking is needed here. A task created while no state
+ * is idle gets its own state from the thread running it (see task_run): the
+ * event loop does not wait for the libraries to open, nor for
+ * threadpool_init_by_lua_file.
+ *
+ * States dropped instead of given back (pool full, memory limit) are closed
+ * by a thread of the pool of their task: the close hooks of the resources
+ * and the finalizers run by lua_close() can block.
+ */
+
+#define LUA_THREADPOOL_GLOBALS_KEY "resty.threadpool.globals"
+
+typedef struct {
+    lua_State   **idle;    /* LIFO stack of idle states: the last released is
+                              more likely to be hot in the CPU caches */
+    ngx_uint_t    nidle;
+    ngx_uint_t    max;     /* high-water mark: extra states are closed */
+} ngx_http_resty_threadpool_vm_pool_t;
+
+typedef struct {
+    ngx_thread_task_t  task;
+    lua_State         *L;
+} ngx_http_resty_threadpool_vm_drop_t;
+
+static ngx_http_resty_threadpool_vm_pool_t  ngx_http_resty_threadpool_vm_pool;
+
+static int
+ngx_http_resty_threadpool_vm_panic(lua_State *L)
+{
+    /* last resort, nginx aborts right after: the task code runs in protected
+     * calls, so this is a bug */
+    ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                  "lua task state panic: %s",
+                  lua_isstring(L, -1) ? lua_tostring(L, -1) : "unknown error");
+    return 0;
+}
+
+/* runs threadpool_init_by_lua_file in a new state, before its globals are
+ * saved: what it defines is kept for all the tasks run by the state */
+static ngx_int_t
+ngx_http_resty_threadpool_vm_run_init(lua_State *L, ngx_str_t *file,
+    ngx_log_t *log)
+{
+    ngx_int_t  rc;
+
+    ngx_http_resty_threadpool_api_set_log(L, log);
+
+    rc = NGX_OK;
+    if (luaL_loadfile(L, (char *) file->data) != 0
+        || lua_pcall(L, 0, 0, 0) != 0)
+    {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "failed to run threadpool_init_by_lua_file: %s",
+                      lua_tostring(L, -1));
+        rc = NGX_ERROR;
+    }
+
+    ngx_http_resty_threadpool_api_set_log(L, NULL);
+    lua_settop(L, 0);
+    return rc;
+}
+
+/* creates a new state ready to run tasks, but for the named ones (see
+ * code_sync); called by the main thread at startup, and by the threads of
+ * the pools afterwards */
+lua_State *
+ngx_http_resty_threadpool_vm_create(ngx_log_t *log)
+{
+    ngx_http_resty_threadpool_conf_t  *tpcf;
+    lua_State                         *L;
+
+    tpcf = ngx_http_cycle_get_module_main_conf((ngx_cycle_t *) ngx_cycle,
+                                      ngx_http_resty_threadpool_module);
+
+    L = ngx_http_resty_threadpool_alloc_newstate(tpcf->arena_size,
+                                                 tpcf->memory_limit, log);
+    if (L == NULL) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "failed to create task state");
+        return NULL;
+    }
+
+    lua_atpanic(L, ngx_http_resty_threadpool_vm_panic);
+    luaL_openlibs(L);
+    ngx_http_resty_threadpool_api_init(L);
+
+    if (tpcf->init_file.len
+        && ngx_http_resty_threadpool_vm_run_init(L, &tpcf->init_file, log)
+           != NGX_OK)
+    {
+        ngx_http_resty_threadpool_vm_close(L, log);
+        return NULL;
+    }
+
+    /* keep a shallow copy of the pristine globals, used to restore them when
+     * the state is given back */
+    lua_newtable(L);
+    lua_pushnil(L);
+    while (lua_next(L, LUA_GLOBALSINDEX) != 0) {
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, -3);
+    }
+    lua_setfield(L, LUA_REGISTRYINDEX, LUA_THREADPOOL_GLOBALS_KEY);
+
+    ngx_http_resty_threadpool_code_init(L);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "lua task state %p created", L);
+    return L;
+}
+
+/* closes a state along with the resources kept by its tasks */
+void
+ngx_http_resty_threadpool_vm_close(lua_State *L, ngx_log_t *log)
+{
+    ngx_http_resty_threadpool_api_set_log(L, log);
+    ngx_http_resty_threadpool_resources_close(L, log);
+    ngx_http_resty_threadpool_alloc_close(L);
+}
+
+static void
+ngx_http_resty_threadpool_vm_drop_handler(void *data, ngx_log_t *log)
+{
+    /* called from inside a worker thread */
+    ngx_http_resty_threadpool_vm_drop_t *d = data;
+
+    ngx_http_resty_threadpool_vm_close(d->L, log);
+}
+
+static void
+ngx_http_resty_threadpool_vm_drop_done(ngx_event_t *ev)
+{
+    ngx_free(ev->data);
+}
+
+/* closes a state in a thread of the pool tp, or right away if the close
+ * cannot be posted */
+static void
+ngx_http_resty_threadpool_vm_drop(lua_State *L, ngx_thread_pool_t *tp,
+    ngx_log_t *log)
+{
+    ngx_http_resty_threadpool_vm_drop_t *d;
+
+    d = tp != NULL ? ngx_calloc(sizeof(ngx_http_resty_threadpool_vm_drop_t),
+                                log)
+                   : NULL;
+    if (d != NULL) {
+        d->L = L;
+        d->task.ctx = d;
+        d->task.handler = ngx_http_resty_threadpool_vm_drop_handler;
+        d->task.event.data = d;
+        d->task.event.handler = ngx_http_resty_threadpool_vm_drop_done;
+
+        if (ngx_thread_task_post(tp, &d->task) == NGX_OK) {
+            return;
+        }
+
+        ngx_free(d);
+    }
+
+    ngx_log_error(NGX_LOG_WARN, log, 0,
+                  "lua task state %p closed in the event loop", L);
+    ngx_http_resty_threadpool_vm_close(L, log);
+}
+
+static void
+ngx_http_resty_threadpool_vm_reset(lua_State *L)
+{
+    lua_settop(L, 0);
+
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_THREADPOOL_GLOBALS_KEY);
+    ngx_http_lua_assert(lua_type(L, 1) == LUA_TTABLE);
+
+    /* remove globals defined by the previous task (assigning existing fields
+     * while traversing is allowed) */
+    lua_pushnil(L);
+    while (lua_next(L, LUA_GLOBALSINDEX) != 0) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_rawget(L, 1);
+        if (lua_isnil(L, -1)) {
+            lua_pushvalue(L, -2);
+            lua_pushnil(L);
+            lua_rawset(L, LUA_GLOBALSINDEX);
+        }
+        lua_pop(L, 1);
+    }
+
+    /* and put back the original ones */
+    lua_pushnil(L);
+    while (lua_next(L, 1) != 0) {
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, LUA_GLOBALSINDEX);
+    }
+
+    lua_pushnil(L);
+    lua_setmetatable(L, LUA_GLOBALSINDEX);
+    lua_settop(L, 0);
+}
+
+ngx_int_t
+ngx_http_resty_threadpool_vm_init(ngx_cycle_t *cycle,
+    ngx_http_resty_threadpool_conf_t *conf)
+{
+    ngx_http_resty_threadpool_vm_pool_t *pool;
+    lua_State                           *L;
+
+    pool = &ngx_http_resty_threadpool_vm_pool;
+    pool->max = ngx_max(conf->state_pool_max, conf->state_pool_size);
+    pool->nidle = 0;
+
+    if (pool->max == 0) {
+        return NGX_OK;
+    }
+
+    pool->idle = ngx_alloc(pool->max * sizeof(lua_State *), cycle->log);
+    if (pool->idle == NULL) {
+        return NGX_ERROR;
+    }
+
+    while (pool->nidle < conf->state_pool_size) {
+        L = ngx_http_resty_threadpool_vm_create(cycle->log);
+        if (L == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_http_resty_threadpool_code_sync(L, cycle->log);
+        pool->idle[pool->nidle++] = L;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, cycle->log, 0,
+                   "lua task state pool ready: %ui states, max %ui",
+                   pool->nidle, pool->max);
+    return NGX_OK;
+}
+
+void
+ngx_http_resty_threadpool_vm_cleanup(ngx_cycle_t *cycle)
+{
+    ngx_http_resty_threadpool_vm_pool_t *pool;
+
+    pool = &ngx_http_resty_threadpool_vm_pool;
+    while (pool->nidle > 0) {
+        ngx_http_resty_threadpool_vm_close(pool->idle[--pool->nidle],
+                                           cycle->log);
+    }
+
+    if (pool->idle != NULL) {
+        ngx_free(pool->idle);
+        pool->idle = NULL;
+    }
+}
+
+/* checks out an idle state from the pool, or returns NULL if there is none:
+ * the thread running the task creates it then */
+lua_State *
+ngx_http_resty_threadpool_vm_get(ngx_log_t *log)
+{
+    ngx_http_resty_threadpool_vm_pool_t *pool;
+    lua_State                           *L;
+
+    pool = &ngx_http_resty_threadpool_vm_pool;
+    if (pool->nidle == 0) {
+        return NULL;
+    }
+
+    L = pool->idle[--pool->nidle];
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "lua task state %p reused", L);
+    return L;
+}
+
+/* gives a state back to the pool once the task is over, the state must not
+ * be running in any thread. A state that is not kept is closed by a thread of
+ * tp */
+void
+ngx_http_resty_threadpool_vm_release(lua_State *L, ngx_thread_pool_t *tp,
+    ngx_log_t *log)
+{
+    ngx_http_resty_threadpool_vm_pool_t *pool;
+
+    pool = &ngx_http_resty_threadpool_vm_pool;
+
+    if (pool->nidle >= pool->max) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "lua task state %p closed (pool full)", L);
+        ngx_http_resty_threadpool_vm_drop(L, tp, log);
+        return;
+    }
+
+    if (ngx_http_resty_threadpool_alloc_exceeded(L)) {
+        /* the task may have left the state half done */
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "lua task state %p closed (memory limit)", L);
+        ngx_http_resty_threadpool_vm_drop(L, tp, log);
+        return;
+    }
+
+    ngx_http_resty_threadpool_vm_reset(L);
+    pool->idle[pool->nidle++] = L;
+}
@@ -0,0 +1,969 @@
+/*
+Copyright (c) 2016, Julien Desgats
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "ngx_http_resty_threadpool_wait.h"
+#include "ngx_http_resty_threadpool_queue.h"
+#include "ngx_http_resty_threadpool_stats.h"
+#include "ngx_http_resty_threadpool_memo.h"
+#include "serialize.h"
+
+/* Waiting for tasks: the request coroutine waits for a group of task runs and
+ * is resumed once, when the whole group is complete (or, for wait_any, when
+ * the first run completes). The results of a run are buffered in the task
+ * until they are collected, so the runs still going on when wait_any returns
+ * can be collected later by another resume or wait.
+ *
+ * A task is anchored in the registry of the request VM from the time it is
+ * waited for until its results are collected (or nobody waits for them
+ * anymore), so it cannot be garbage collected while a thread runs it. Groups
+ * are allocated from the heap and live until all their runs are complete,
+ * even if the request is gone meanwhile.
+ *
+ * When a pool is full, a coroutine can also wait for one of the runs of the
+ * worker on that pool to complete (wait_slot), in a list of waiters woken up
+ * one per completion.
+ *
+ * A run can also be started without waiting for it (wait_start, for the
+ * streaming tasks): its group is done from the start.
+ */
+
+typedef enum {
+    LUA_THREADPOOL_WAIT_ONE,  /* resume(): values of the run */
+    LUA_THREADPOOL_WAIT_TRY,  /* try_resume(): true and the values */
+    LUA_THREADPOOL_WAIT_ALL,  /* wait_all(): one table per task */
+    LUA_THREADPOOL_WAIT_ANY,  /* wait_any(): index and values of the first */
+    LUA_THREADPOOL_WAIT_MAP,  /* map(): one table with every item result */
+} ngx_http_resty_threadpool_wait_mode_t;
+
+struct ngx_http_resty_threadpool_group_s {
+    ngx_http_resty_threadpool_wait_mode_t  mode;
+    ngx_http_request_t                    *r;
+    ngx_http_lua_co_ctx_t                 *coctx;
+    lua_State                             *vm;      /* request VM */
+    ngx_uint_t                             pending; /* runs in flight */
+    ngx_int_t                              nres;    /* values given to the
+                                                       coroutine */
+    unsigned                               done:1;  /* nobody waits */
+    unsigned                               waking:1; /* resuming the
+                                                        coroutine */
+    ngx_uint_t                             nthreads;
+    ngx_http_resty_threadpool_state_t     *threads[1];
+};
+
+typedef struct {
+    ngx_queue_t             queue;
+    ngx_thread_pool_t      *tp;
+    ngx_http_request_t     *r;
+    ngx_http_lua_co_ctx_t  *coctx;
+    ngx_event_t             timer;  /* deadline */
+    ngx_int_t               nres;
+} ngx_http_resty_threadpool_waiter_t;
+
+/* coroutines waiting for room in a pool (main thread only) */
+static ngx_queue_t  ngx_http_resty_threadpool_waiters;
+
+static ngx_int_t
+ngx_http_resty_threadpool_wait_resume_handler(ngx_http_request_t *r);
+static ngx_int_t
+ngx_http_resty_threadpool_wait_slot_resume_handler(ngx_http_request_t *r);
+
+static void
+ngx_http_resty_threadpool_wait_release(ngx_http_resty_threadpool_group_t *g)
+{
+    if (g->done && !g->waking && g->pending == 0) {
+        ngx_free(g);
+    }
+}
+
+static void
+ngx_http_resty_threadpool_wait_unref(lua_State *L,
+    ngx_http_resty_threadpool_state_t *thread)
+{
+    if (thread->ref != LUA_NOREF) {
+        luaL_unref(L, LUA_REGISTRYINDEX, thread->ref);
+        thread->ref = LUA_NOREF;
+    }
+}
+
+static void
+ngx_http_resty_threadpool_wait_unanchor(ngx_http_resty_threadpool_group_t *g,
+    lua_State *L)
+{
+    /* gives the tasks of a group that stops waiting back to the garbage
+     * collector, except the ones still running. Only valid while every task
+     * of the group is anchored: nothing is allocated here, so none of them
+     * can be collected before the loop is over. */
+    ngx_uint_t  i;
+
+    for (i = 0; i < g->nthreads; i++) {
+        if (g->threads[i]->group != g) {
+            ngx_http_resty_threadpool_wait_unref(L, g->threads[i]);
+        }
+    }
+}
+
+static ngx_int_t
+ngx_http_resty_threadpool_wait_consume(lua_State *L, lua_State *co,
+    ngx_http_resty_threadpool_state_t *thread, ngx_log_t *log)
+{
+    /* pushes the buffered results of a task into co, returns their count. A
+     * run stopped by cancel() or a timeout gives nil and the reason. */
+    ngx_int_t   n;
+    ngx_uint_t  start;
+
+    n = 0;
+    if (thread->cancelled
+        && thread->status == LUA_THREADPOOL_TASK_FAILED)
+    {
+        lua_pushnil(co);
+        lua_pushstring(co, thread->cancelled == LUA_THREADPOOL_TIMEDOUT
+                           ? "timeout" : "cancelled");
+        n = 2;
+
+    } else if (thread->nres > 0) {
+        start = thread->stats ? ngx_http_resty_threadpool_stats_now() : 0;
+        if (ngx_http_resty_threadpool_decode_values(L, co, &thread->res,
+                                                    thread->nres, log)
+            == NGX_OK)
+        {
+            n = thread->nres;
+        }
+
+        if (thread->stats) {
+            ngx_http_resty_threadpool_stats_add(thread->stats, usec_out,
+                ngx_http_resty_threadpool_stats_now() - start);
+        }
+    }
+
+    thread->res.len = 0;
+    thread->nres = 0;
+    thread->buffered = 0;
+
+    /* a cancelled task is over, even if its last run went through */
+    if (thread->status == LUA_THREADPOOL_TASK_SUCCESS
+        || thread->status == LUA_THREADPOOL_TASK_FAILED
+        || thread->cancelled)
+    {
+        ngx_http_resty_threadpool_thread_release(thread, log);
+    }
+
+    return n;
+}
+
+static ngx_int_t
+ngx_http_resty_threadpool_wait_collect(ngx_http_resty_threadpool_group_t *g,
+    ngx_http_resty_threadpool_state_t *winner, lua_State *L, lua_State *co,
+    ngx_log_t *log)
+{
+    /* pushes the results of the group into co (the deserialization is
+     * protected in L), returns the number of values pushed */
+    ngx_http_resty_threadpool_state_t *thread;
+    ngx_uint_t                         i, nitems;
+    ngx_int_t                          n, j, nres;
+
+    g->done = 1;
+    nres = 0;
+
+    if (!lua_checkstack(co, g->nthreads + 2)) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "too many tasks to wait for");
+        goto done;
+    }
+
+    switch (g->mode) {
+
+    case LUA_THREADPOOL_WAIT_TRY:
+        lua_pushboolean(co, 1);
+        nres = 1 + ngx_http_resty_threadpool_wait_consume(L, co,
+                                                          g->threads[0], log);
+        break;
+
+    case LUA_THREADPOOL_WAIT_ONE:
+        nres = ngx_http_resty_threadpool_wait_consume(L, co, g->threads[0],
+                                                      log);
+        break;
+
+    case LUA_THREADPOOL_WAIT_ANY:
+        for (i = 0; g->threads[i] != winner; i++) { /* void */ }
+
+        lua_pushinteger(co, i + 1);
+        nres = 1 + ngx_http_resty_threadpool_wait_consume(L, co, winner, log);
+        break;
+
+    case LUA_THREADPOOL_WAIT_ALL:
+        for (i = 0; i < g->nthreads; i++) {
+            thread = g->threads[i];
+            lua_createtable(co, thread->nres, 0);
+            n = ngx_http_resty_threadpool_wait_consume(L, co, thread, log);
+            for (j = n; j > 0; j--) {
+                lua_rawseti(co, -j - 1, j);
+            }
+        }
+
+        nres = g->nthreads;
+        break;
+
+    case LUA_THREADPOOL_WAIT_MAP:
+        /* each chunk returns a table with the results of its items */
+        nitems = 0;
+        for (i = 0; i < g->nthreads; i++) {
+            nitems += g->threads[i]->nitems;
+        }
+
+        lua_createtable(co, nitems, 0);
+        for (i = 0; i < g->nthreads; i++) {
+            thread = g->threads[i];
+            n = ngx_http_resty_threadpool_wait_consume(L, co, thread, log);
+            if (n > 0 && lua_istable(co, -n)) {
+                for (j = 1; j <= (ngx_int_t) thread->nitems; j++) {
+                    lua_rawgeti(co, -n, j);
+                    lua_rawseti(co, -n - 2, thread->first + j - 1);
+                }
+            }
+
+            lua_pop(co, n);
+        }
+
+        nres = 1;
+        break;
+    }
+
+done:
+    ngx_http_resty_threadpool_wait_unanchor(g, L);
+    return nres;
+}
+
+static void
+ngx_http_resty_threadpool_wait_cleanup(void *data)
+{
+    /* the waiting coroutine is gone (request aborted, thread killed, ...):
+     * the runs in flight are cancelled and complete without waking anybody,
+     * except the memoized runs other coroutines wait for */
+    ngx_http_lua_co_ctx_t             *coctx = data;
+    ngx_http_resty_threadpool_group_t *g = coctx->data;
+    ngx_http_resty_threadpool_state_t *thread;
+    ngx_uint_t                         i;
+
+    for (i = 0; i < g->nthreads; i++) {
+        thread = g->threads[i];
+        if (thread->group == g
+            && (thread->memo == NULL
+                || !ngx_http_resty_threadpool_memo_orphan(thread)))
+        {
+            ngx_http_resty_threadpool_thread_interrupt(
+                thread, LUA_THREADPOOL_CANCELLED);
+        }
+    }
+
+    g->done = 1;
+    g->r = NULL;
+    g->coctx = NULL;
+    ngx_http_resty_threadpool_wait_unanchor(g, g->vm);
+    ngx_http_resty_threadpool_wait_release(g);
+}
+
+void
+ngx_http_resty_threadpool_wait_continue(ngx_http_request_t *r,
+    ngx_http_lua_ctx_t *luactx, ngx_http_lua_co_ctx_t *coctx,
+    ngx_http_handler_pt handler)
+{
+    /* resumes a suspended coroutine of the request from the event loop */
+    ngx_connection_t  *c = r->connection;
+
+    if (c->fd != (ngx_socket_t) -1) {  /* not a fake connection */
+        ngx_http_log_ctx_t *log_ctx = c->log->data;
+        log_ctx->current_request = r;
+    }
+
+    luactx->cur_co_ctx = coctx;
+    if (luactx->entered_content_phase) {
+        (void) handler(r);
+    } else {
+        luactx->resume_handler = handler;
+        ngx_http_core_run_phases(r);
+    }
+}
+
+static void
+ngx_http_resty_threadpool_wait_wake(ngx_http_resty_threadpool_group_t *g,
+    ngx_http_resty_threadpool_state_t *winner)
+{
+    /* resumes the waiting coroutine with the results of the group */
+    ngx_connection_t       *c;
+    ngx_http_request_t     *r;
+    ngx_http_lua_ctx_t     *luactx;
+    ngx_http_lua_co_ctx_t  *coctx;
+
+    r = g->r;
+    c = r->connection;
+    coctx = g->coctx;
+    ngx_http_lua_assert(coctx->data == g);
+
+    luactx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (luactx == NULL) {
+        /* not sure what it means in this case */
+        coctx->cleanup = NULL;
+        ngx_http_resty_threadpool_wait_cleanup(coctx);
+        return;
+    }
+
+    /* the group must survive until the coroutine has picked its results, even
+     * if it waits for the leftovers of the group meanwhile */
+    g->waking = 1;
+    g->nres = ngx_http_resty_threadpool_wait_collect(g, winner, g->vm,
+                                                     coctx->co, c->log);
+    coctx->cleanup = NULL;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "lua task group %p resumes with %i results", g, g->nres);
+
+    ngx_http_resty_threadpool_wait_continue(r, luactx, coctx,
+                               ngx_http_resty_threadpool_wait_resume_handler);
+
+    g->waking = 0;
+    ngx_http_run_posted_requests(c);
+}
+
+void
+ngx_http_resty_threadpool_wait_task_done(
+    ngx_http_resty_threadpool_state_t *thread)
+{
+    /* called in the main event loop when a run is complete, its results are
+     * buffered in the task */
+    ngx_http_resty_threadpool_group_t *g = thread->group;
+
+    thread->group = NULL;
+    thread->buffered = 1;
+    g->pending--;
+
+    if (g->done) {
+        /* nobody waits for this run anymore: the results stay in the task
+         * until the next resume or wait. The other tasks of the group may be
+         * gone already. */
+        ngx_http_resty_threadpool_wait_unref(g->vm, thread);
+
+    } else if (g->mode == LUA_THREADPOOL_WAIT_ANY || g->pending == 0) {
+        ngx_http_resty_threadpool_wait_wake(g, thread);
+    }
+
+    ngx_http_resty_threadpool_wait_release(g);
+}
+
+/* copy of ngx_http_lua_sleep_resume */
+ngx_int_t
+ngx_http_resty_threadpool_wait_run(ngx_http_request_t *r,
+    ngx_http_lua_ctx_t *ctx, ngx_int_t nres)
+{
+    lua_State                          *vm;
+    ngx_connection_t                   *c;
+    ngx_int_t                           rc;
+
+    ctx->resume_handler = ngx_http_lua_wev_handler;
+
+    c = r->connection;
+    vm = ngx_http_lua_get_lua_vm(r, ctx);
+
+    rc = ngx_http_lua_run_thread(vm, r, ctx, nres);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua run thread returned %d", rc);
+
+    if (rc == NGX_AGAIN) {
+        return ngx_http_lua_run_posted_threads(c, vm, r, ctx);
+    }
+
+    if (rc == NGX_DONE) {
+        ngx_http_lua_finalize_request(r, NGX_DONE);
+        return ngx_http_lua_run_posted_threads(c, vm, r, ctx);
+    }
+
+    if (ctx->entered_content_phase) {
+        ngx_http_lua_finalize_request(r, rc);
+        return NGX_DONE;
+    }
+
+    return rc;
+}
+
+static ngx_int_t
+ngx_http_resty_threadpool_wait_resume_handler(ngx_http_request_t *r)
+{
+    ngx_http_lua_ctx_t                 *ctx;
+    ngx_http_resty_threadpool_group_t  *g;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    g = ctx->cur_co_ctx->data;
+    return ngx_http_resty_threadpool_wait_run(r, ctx, g->nres);
+}
+
+static ngx_int_t
+ngx_http_resty_threadpool_wait_slot_resume_handler(ngx_http_request_t *r)
+{
+    ngx_http_lua_ctx_t                  *ctx;
+    ngx_http_resty_threadpool_waiter_t  *w;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    w = ctx->cur_co_ctx->data;
+    return ngx_http_resty_threadpool_wait_run(r, ctx, w->nres);
+}
+
+ngx_http_lua_co_ctx_t *
+ngx_http_resty_threadpool_wait_current(lua_State *L, ngx_http_request_t **rp,
+    ngx_http_lua_ctx_t **ctxp)
+{
+    /* context of the running coroutine, raises an error if there is none */
+    ngx_http_request_t     *r;
+    ngx_http_lua_ctx_t     *luactx;
+    ngx_http_lua_co_ctx_t  *coctx;
+
+    r = ngx_http_lua_get_req(L);
+    if (r == NULL) {
+        luaL_error(L, "no request found");
+        return NULL;
+    }
+
+    luactx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (luactx == NULL) {
+        luaL_error(L, "no request ctx found");
+        return NULL;
+    }
+
+    coctx = luactx->cur_co_ctx;
+    if (coctx == NULL) {
+        luaL_error(L, "no co ctx found");
+        return NULL;
+    }
+
+    *rp = r;
+    *ctxp = luactx;
+    return coctx;
+}
+
+static int
+ngx_http_resty_threadpool_wait(lua_State *L,
+    ngx_http_resty_threadpool_wait_mode_t mode, int first, ngx_uint_t n,
+    int nargs)
+{
+    /* waits for the tasks at [first, first + n) on the stack. The nargs
+     * arguments of resume() appended to the task are dropped if it cannot be
+     * posted. */
+    ngx_http_resty_threadpool_group_t *g, *old;
+    ngx_http_resty_threadpool_state_t *thread, *winner;
+    ngx_http_request_t                *r;
+    ngx_http_lua_ctx_t                *luactx;
+    ngx_http_lua_co_ctx_t             *coctx;
+    ngx_uint_t                         i, j;
+    ngx_int_t                          nres;
+
+    coctx = ngx_http_resty_threadpool_wait_current(L, &r, &luactx);
+
+    /* check every task before starting any */
+    for (i = 0; i < n; i++) {
+        thread = luaL_checkudata(L, first + i, LUA_THREADPOOL_MT_NAME);
+
+        if (thread->group != NULL) {
+            if (!thread->group->done) {
+                return luaL_error(L, "task is running");
+            }
+
+        } else if (!thread->buffered
+                   && thread->status != LUA_THREADPOOL_TASK_CREATED
+                   && thread->status != LUA_THREADPOOL_TASK_YIELDED)
+        {
+            return luaL_error(L, "thread not in good state");
+        }
+
+        for (j = 0; j < i; j++) {
+            if (lua_touserdata(L, first + j) == thread) {
+                return luaL_error(L, "task given twice");
+            }
+        }
+    }
+
+    g = ngx_calloc(sizeof(ngx_http_resty_threadpool_group_t)
+                   + (n - 1) * sizeof(ngx_http_resty_threadpool_state_t *),
+                   r->connection->log);
+    if (g == NULL) {
+        return luaL_error(L, "failed to allocate task group");
+    }
+
+    g->mode = mode;
+    g->r = r;
+    g->coctx = coctx;
+    g->vm = ngx_http_lua_get_lua_vm(r, luactx);
+    g->nthreads = n;
+
+    for (i = 0; i < n; i++) {
+        thread = lua_touserdata(L, first + i);
+        g->threads[i] = thread;
+        if (thread->ref == LUA_NOREF) {
+            lua_pushvalue(L, first + i);
+            thread->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        }
+    }
+
+    winner = NULL;
+    for (i = 0; i < n; i++) {
+        thread = g->threads[i];
+
+        if (thread->buffered) {
+            if (winner == NULL) {
+                winner = thread;
+            }
+
+            continue;
+        }
+
+        if (thread->group != NULL) {
+            /* still running for a wait_any that returned already */
+            old = thread->group;
+            old->pending--;
+            thread->group = g;
+            g->pending++;
+            ngx_http_resty_threadpool_wait_release(old);
+            continue;
+        }
+
+        if (ngx_http_resty_threadpool_thread_post(thread, r->connection->log)
+            != NGX_OK)
+        {
+            ngx_http_resty_threadpool_thread_rewind_args(L, first + i);
+            thread->nargs -= nargs;
+
+            /* the runs already posted complete without waking anybody */
+            g->done = 1;
+            ngx_http_resty_threadpool_wait_unanchor(g, L);
+            ngx_http_resty_threadpool_wait_release(g);
+
+            if (mode == LUA_THREADPOOL_WAIT_TRY) {
+                lua_pushnil(L);
+                lua_pushliteral(L, "busy");
+                lua_pushinteger(L,
+                    ngx_http_resty_threadpool_queue_depth(thread->tp));
+                return 3;
+            }
+
+            return luaL_error(L, "failed to post task to queue");
+        }
+
+        ngx_http_resty_threadpool_thread_move_args(L, first + i);
+        thread->group = g;
+        g->pending++;
+    }
+
+    if (g->pending == 0
+        || (mode == LUA_THREADPOOL_WAIT_ANY && winner != NULL))
+    {
+        /* the results are there already */
+        nres = ngx_http_resty_threadpool_wait_collect(g, winner, L, L,
+                                                      r->connection->log);
+        ngx_http_resty_threadpool_wait_release(g);
+        return nres;
+    }
+
+    ngx_http_lua_cleanup_pending_operation(coctx);
+    coctx->cleanup = ngx_http_resty_threadpool_wait_cleanup;
+    coctx->data = g;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua task group %p waits for %ui runs", g, g->pending);
+
+    return lua_yield(L, 0);
+}
+
+static void
+ngx_http_resty_threadpool_wait_slot_wake(ngx_http_resty_threadpool_waiter_t *w,
+    ngx_uint_t timedout)
+{
+    ngx_connection_t       *c;
+    ngx_http_request_t     *r;
+    ngx_http_lua_ctx_t     *luactx;
+    ngx_http_lua_co_ctx_t  *coctx;
+
+    r = w->r;
+    c = r->connection;
+    coctx = w->coctx;
+
+    ngx_queue_remove(&w->queue);
+    if (w->timer.timer_set) {
+        ngx_del_timer(&w->timer);
+    }
+
+    coctx->cleanup = NULL;
+
+    luactx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (luactx == NULL) {
+        return;
+    }
+
+    if (!lua_checkstack(coctx->co, 2)) {
+        w->nres = 0;
+
+    } else if (timedout) {
+        lua_pushnil(coctx->co);
+        lua_pushliteral(coctx->co, "timeout");
+        w->nres = 2;
+
+    } else {
+        lua_pushboolean(coctx->co, 1);
+        w->nres = 1;
+    }
+
+    ngx_http_resty_threadpool_wait_continue(r, luactx, coctx,
+                          ngx_http_resty_threadpool_wait_slot_resume_handler);
+    ngx_http_run_posted_requests(c);
+}
+
+static void
+ngx_http_resty_threadpool_wait_slot_timeout(ngx_event_t *ev)
+{
+    ngx_http_resty_threadpool_wait_slot_wake(ev->data, 1);
+}
+
+static void
+ngx_http_resty_threadpool_wait_slot_cleanup(void *data)
+{
+    ngx_http_lua_co_ctx_t              *coctx = data;
+    ngx_http_resty_threadpool_waiter_t *w = coctx->data;
+
+    ngx_queue_remove(&w->queue);
+    if (w->timer.timer_set) {
+        ngx_del_timer(&w->timer);
+    }
+}
+
+/* a run on the given pool is complete: wakes up the first coroutine waiting
+ * for room in it */
+void
+ngx_http_resty_threadpool_wait_slot_free(ngx_thread_pool_t *tp)
+{
+    ngx_http_resty_threadpool_waiter_t *w;
+    ngx_queue_t                        *q;
+
+    if (ngx_http_resty_threadpool_waiters.next == NULL) {
+        return; /* nobody ever waited */
+    }
+
+    for (q = ngx_queue_head(&ngx_http_resty_threadpool_waiters);
+         q != ngx_queue_sentinel(&ngx_http_resty_threadpool_waiters);
+         q = ngx_queue_next(q))
+    {
+        w = ngx_queue_data(q, ngx_http_resty_threadpool_waiter_t, queue);
+        if (w->tp == tp) {
+            ngx_http_resty_threadpool_wait_slot_wake(w, 0);
+            return;
+        }
+    }
+}
+
+/***********/
+/* Lua API */
+/***********/
+
+static int
+ngx_http_resty_threadpool_wait_resume_task(lua_State *L,
+    ngx_http_resty_threadpool_wait_mode_t mode)
+{
+    ngx_http_resty_threadpool_state_t *ud;
+    int                                nargs;
+
+    nargs = lua_gettop(L) - 1;
+    ud = luaL_checkudata(L, 1, LUA_THREADPOOL_MT_NAME);
+
+    if (ud->buffered || ud->group != NULL) {
+        /* left over by wait_any: the results of this run come first */
+        if (nargs > 0) {
+            return luaL_error(L, "task has results to collect");
+        }
+
+    } else if (ud->status == LUA_THREADPOOL_TASK_CREATED
+               || ud->status == LUA_THREADPOOL_TASK_YIELDED)
+    {
+        /* appended to the arguments of create() if the task has not run yet
+         * (the leftovers of a failed serialization are dropped) */
+        ngx_http_resty_threadpool_thread_rewind_args(L, 1);
+        if (nargs > 0) {
+            ngx_http_resty_threadpool_thread_encode_args(L, 1, 2, nargs);
+        }
+    }
+
+    return ngx_http_resty_threadpool_wait(L, mode, 1, 1, nargs);
+}
+
+int
+ngx_http_resty_threadpool_wait_resume(lua_State *L)
+{
+    return ngx_http_resty_threadpool_wait_resume_task(L,
+                                                      LUA_THREADPOOL_WAIT_ONE);
+}
+
+int
+ngx_http_resty_threadpool_wait_try_resume(lua_State *L)
+{
+    return ngx_http_resty_threadpool_wait_resume_task(L,
+                                                      LUA_THREADPOOL_WAIT_TRY);
+}
+
+int
+ngx_http_resty_threadpool_wait_slot(lua_State *L)
+{
+    ngx_http_resty_threadpool_waiter_t *w;
+    ngx_http_resty_threadpool_pool_t   *tpool;
+    ngx_thread_pool_t                  *tp;
+    ngx_http_request_t                 *r;
+    ngx_http_lua_ctx_t                 *luactx;
+    ngx_http_lua_co_ctx_t              *coctx;
+    ngx_str_t                           pool;
+    lua_Integer                         timeout;
+
+    pool.data = (u_char *)luaL_checklstring(L, 1, &pool.len);
+    timeout = luaL_optinteger(L, 2, 0);
+    luaL_argcheck(L, timeout >= 0, 2, "timeout must not be negative");
+
+    tpool = ngx_http_resty_threadpool_pool_find((ngx_cycle_t *) ngx_cycle,
+                                                &pool);
+    tp = tpool != NULL ? tpool->tp
+                       : ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, &pool);
+    if (tp == NULL) {
+        return luaL_error(L, "no pool '%s' found", pool.data);
+    }
+
+    if (ngx_http_resty_threadpool_queue_depth(tp) == 0) {
+        /* no run of this worker to wait for */
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+
+    coctx = ngx_http_resty_threadpool_wait_current(L, &r, &luactx);
+
+    w = ngx_pcalloc(r->pool, sizeof(ngx_http_resty_threadpool_waiter_t));
+    if (w == NULL) {
+        return luaL_error(L, "failed to allocate waiter");
+    }
+
+    w->tp = tp;
+    w->r = r;
+    w->coctx = coctx;
+
+    if (ngx_http_resty_threadpool_waiters.next == NULL) {
+        ngx_queue_init(&ngx_http_resty_threadpool_waiters);
+    }
+
+    ngx_queue_insert_tail(&ngx_http_resty_threadpool_waiters, &w->queue);
+
+    if (timeout > 0) {
+        w->timer.handler = ngx_http_resty_threadpool_wait_slot_timeout;
+        w->timer.data = w;
+        w->timer.log = r->connection->log;
+        ngx_add_timer(&w->timer, (ngx_msec_t) timeout);
+    }
+
+    ngx_http_lua_cleanup_pending_operation(coctx);
+    coctx->cleanup = ngx_http_resty_threadpool_wait_slot_cleanup;
+    coctx->data = w;
+
+    return lua_yield(L, 0);
+}
+
+/* posts the next run of the task at idx without waiting for it: the results
+ * are buffered in the task until the next resume or wait */
+ngx_int_t
+ngx_http_resty_threadpool_wait_start(lua_State *L, int idx)
+{
+    ngx_http_resty_threadpool_group_t *g;
+    ngx_http_resty_threadpool_state_t *thread;
+    ngx_http_request_t                *r;
+    ngx_http_lua_ctx_t                *luactx;
+
+    thread = luaL_checkudata(L, idx, LUA_THREADPOOL_MT_NAME);
+    (void) ngx_http_resty_threadpool_wait_current(L, &r, &luactx);
+
+    if (thread->group != NULL || thread->buffered
+        || (thread->status != LUA_THREADPOOL_TASK_CREATED
+            && thread->status != LUA_THREADPOOL_TASK_YIELDED))
+    {
+        luaL_error(L, "thread not in good state");
+        return NGX_ERROR;
+    }
+
+    g = ngx_calloc(sizeof(ngx_http_resty_threadpool_group_t),
+                   r->connection->log);
+    if (g == NULL) {
+        luaL_error(L, "failed to allocate task group");
+        return NGX_ERROR;
+    }
+
+    /* a group nobody waits for, as the ones left over by wait_any */
+    g->mode = LUA_THREADPOOL_WAIT_ONE;
+    g->vm = ngx_http_lua_get_lua_vm(r, luactx);
+    g->nthreads = 1;
+    g->threads[0] = thread;
+    g->done = 1;
+
+    if (ngx_http_resty_threadpool_thread_post(thread, r->connection->log)
+        != NGX_OK)
+    {
+        ngx_free(g);
+        return NGX_ERROR;
+    }
+
+    ngx_http_resty_threadpool_thread_move_args(L, idx);
+
+    if (thread->ref == LUA_NOREF) {
+        lua_pushvalue(L, idx);
+        thread->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+    thread->group = g;
+    g->pending = 1;
+    return NGX_OK;
+}
+
+int
+ngx_http_resty_threadpool_wait_all(lua_State *L)
+{
+    int  n;
+
+    n = lua_gettop(L);
+    if (n == 0) {
+        return 0;
+    }
+
+    return ngx_http_resty_threadpool_wait(L, LUA_THREADPOOL_WAIT_ALL, 1, n,
+                                          0);
+}
+
+int
+ngx_http_resty_threadpool_wait_any(lua_State *L)
+{
+    int  n;
+
+    n = lua_gettop(L);
+    if (n == 0) {
+        return luaL_error(L, "no task to wait for");
+    }
+
+    return ngx_http_resty_threadpool_wait(L, LUA_THREADPOOL_WAIT_ANY, 1, n,
+                                          0);
+}
+
+int
+ngx_http_resty_threadpool_wait_map(lua_State *L)
+{
+    ngx_http_resty_threadpool_state_t *ud;
+    ngx_http_resty_threadpool_pool_t  *tpool;
+    ngx_str_t                          pool, name;
+    ngx_uint_t                         nitems, nchunks, first, i, j, k;
+    ngx_int_t                          prio;
+    lua_Integer                        concurrency;
+
+    pool.data = (u_char *)luaL_checklstring(L, 1, &pool.len);
+    if (lua_type(L, 2) != LUA_TSTRING) {
+        luaL_checktype(L, 2, LUA_TFUNCTION);
+    }
+
+    luaL_checktype(L, 3, LUA_TTABLE);
+    nitems = lua_objlen(L, 3);
+
+    concurrency = 0;
+    prio = LUA_THREADPOOL_PRIO_NORMAL;
+    if (!lua_isnoneornil(L, 4)) {
+        luaL_checktype(L, 4, LUA_TTABLE);
+        lua_getfield(L, 4, "concurrency");
+        if (!lua_isnil(L, -1)) {
+            concurrency = lua_tointeger(L, -1);
+            luaL_argcheck(L, concurrency > 0, 4,
+                          "concurrency must be a positive integer");
+        }
+
+        lua_pop(L, 1);
+
+        lua_getfield(L, 4, "priority");
+        if (!lua_isnil(L, -1)) {
+            name.data = (u_char *) lua_tolstring(L, -1, &name.len);
+            prio = name.data != NULL
+                   ? ngx_http_resty_threadpool_runq_priority(&name)
+                   : NGX_ERROR;
+            luaL_argcheck(L, prio != NGX_ERROR, 4, "unknown priority");
+        }
+
+        lua_pop(L, 1);
+    }
+
+    lua_settop(L, 3);
+    if (nitems == 0) {
+        lua_newtable(L);
+        return 1;
+    }
+
+    /* one chunk per thread (resident VM, or CPU for other pools) */
+    if (concurrency == 0) {
+        tpool = ngx_http_resty_threadpool_pool_find((ngx_cycle_t *) ngx_cycle,
+                                                    &pool);
+        concurrency = (tpool != NULL && tpool->nslots > 0)
+                      ? (lua_Integer) tpool->nslots : (lua_Integer) ngx_ncpu;
+    }
+
+    nchunks = ngx_min(nitems, (ngx_uint_t) concurrency);
+    luaL_checkstack(L, nchunks + 2, "too many map tasks");
+
+    /* L = (pool, func, items, chunk_ud...) */
+    first = 1;
+    for (i = 0; i < nchunks; i++) {
+        k = nitems / nchunks + (i < nitems % nchunks);
+
+        ud = ngx_http_resty_threadpool_thread_new(L, &pool, 2);
+        ud->map = 1;
+        ud->priority = prio;
+        ud->first = first;
+        ud->nitems = k;
+
+        lua_createtable(L, k, 0);
+        for (j = 0; j < k; j++) {
+            lua_rawgeti(L, 3, first + j);
+            lua_rawseti(L, -2, j + 1);
+        }
+
+        ngx_http_resty_threadpool_thread_encode_args(L, lua_gettop(L) - 1,
+                                                     lua_gettop(L), 1);
+        lua_pop(L, 1);
+        ud->argslen = ud->args.len;
+        ud->argsanchors = ud->nanchors;
+
+        first += k;
+    }
+
+    return ngx_http_resty_threadpool_wait(L, LUA_THREADPOOL_WAIT_MAP, 4,
+                                          nchunks, 0);
+}
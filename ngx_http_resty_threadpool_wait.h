@@ -0,0 +1,54 @@
+/*
+Copyright (c) 2016, Julien Desgats
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef _NGX_HTTP_RESTY_THREADPOOL_WAIT_H_INCLUDED_
+#define _NGX_HTTP_RESTY_THREADPOOL_WAIT_H_INCLUDED_
+
+#include "ngx_http_resty_threadpool_common.h"
+
+void ngx_http_resty_threadpool_wait_task_done(
+    ngx_http_resty_threadpool_state_t *thread);
+void ngx_http_resty_threadpool_wait_slot_free(ngx_thread_pool_t *tp);
+ngx_int_t ngx_http_resty_threadpool_wait_start(lua_State *L, int idx);
+
+/* resuming request coroutines, for the other modules suspending them */
+ngx_http_lua_co_ctx_t *ngx_http_resty_threadpool_wait_current(lua_State *L,
+    ngx_http_request_t **rp, ngx_http_lua_ctx_t **ctxp);
+void ngx_http_resty_threadpool_wait_continue(ngx_http_request_t *r,
+    ngx_http_lua_ctx_t *luactx, ngx_http_lua_co_ctx_t *coctx,
+    ngx_http_handler_pt handler);
+ngx_int_t ngx_http_resty_threadpool_wait_run(ngx_http_request_t *r,
+    ngx_http_lua_ctx_t *ctx, ngx_int_t nres);
+
+int ngx_http_resty_threadpool_wait_resume(lua_State *L);
+int ngx_http_resty_threadpool_wait_try_resume(lua_State *L);
+int ngx_http_resty_threadpool_wait_slot(lua_State *L);
+int ngx_http_resty_threadpool_wait_all(lua_State *L);
+int ngx_http_resty_threadpool_wait_any(lua_State *L);
+int ngx_http_resty_threadpool_wait_map(lua_State *L);
+
+#endif /* _NGX_HTTP_RESTY_THREADPOOL_WAIT_H_INCLUDED_ */
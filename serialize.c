@@ -26,23 +26,99 @@ OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <lua.h>
 #include <lauxlib.h>
 #include <assert.h>
 
+#include "serialize.h"
+
 /* this library serializes all sorts of Lua variables on a byte stream. */
 
 /*
  * TODO:
  * serialize more things
- * remove thread hack (rather inefficient)
- * benchmark, optimize
+ * optimize (see bench/)
  * streaming serialization
- * be less platform dependant (endianness issues, remove Lua constants usage, ...)
  * test, test, and test
  */
 
+/*
+ * Wire format (version 3): a frame is a version byte, the number of values
+ * (varint), the number of tables (varint), then the values. Each value starts
+ * with a tag byte:
+ *
+ *   0x00            nil
+ *   0x01, 0x02      false, true
+ *   0x03 <varint>   integer (zigzag encoded)
+ *   0x04 <8 bytes>  other number (native lua_Number)
+ *   0x05 <varint>   string: length then bytes
+ *   0x06 <varint> <varint>
+ *                   table: array size then hash size, followed by the array
+ *                   values then the hash keys and values
+ *   0x07 <varint>   function: length of the dump then the dump
+ *   0x08 <pointer> <varint>
+ *                   string by reference: address and length of the bytes
+ *                   of a string owned by the encoding state
+ *   0x09 <varint>   table with a registered metatable: length and bytes of
+ *                   the metatable name, then the same as 0x06
+ *   0x0a <varint>   table already seen in the frame: tables are numbered
+ *                   from 1 in the order they appear
+ *   0x0b <varint>   byte buffer: length then bytes, decoded into a new buffer
+ *   0x0c <pointer>  byte buffer by reference: address of the memory of a
+ *                   buffer moved out of the encoding state, which keeps it
+ *                   alive until the frame is decoded
+ *   0x0d <varint> <varint>
+ *                   FFI cdata of a plain data type: length and name of the
+ *                   type, size then bytes of the value
+ *   0x40 - 0x7f     integers from 0 to 63
+ *   0x80 - 0x9f     strings up to 31 bytes (length in the low bits)
+ *
+ * Varints are little endian base 128 (7 bits per byte, high bit set when
+ * more bytes follow).
+ */
+
+#define LUASER_VERSION    3
+
+#define LUASER_NIL        0x00
+#define LUASER_FALSE      0x01
+#define LUASER_TRUE       0x02
+#define LUASER_INT        0x03
+#define LUASER_NUM        0x04
+#define LUASER_STR        0x05
+#define LUASER_TABLE      0x06
+#define LUASER_FUNC       0x07
+#define LUASER_STRREF     0x08
+#define LUASER_TABLEMT    0x09
+#define LUASER_TABLEREF   0x0a
+#define LUASER_BYTES      0x0b
+#define LUASER_BYTESREF   0x0c
+#define LUASER_CDATA      0x0d
+#define LUASER_FIXINT     0x40
+#define LUASER_FIXINT_MAX 0x3f
+#define LUASER_FIXSTR     0x80
+#define LUASER_FIXSTR_MAX 0x1f
+
+/* biggest integer represented exactly by a double */
+#define LUASER_INT_MAX    9007199254740992.0
+
+/* nested tables limit (C recursion) */
+#define LUASER_MAX_DEPTH  200
+
+/* registry table of the metatables: name -> metatable and metatable -> name */
+#define LUASER_METATABLES "luaser.metatables"
+
+/* registry table of the struct and union types sent as cdata: name -> true */
+#define LUASER_CDATATYPES "luaser.cdatatypes"
+
+/* metatable of the byte buffers */
+#define LUASER_BYTES_MT   "luaser.bytes"
+
+/* type of the FFI cdata in LuaJIT (not in lua.h) */
+#define LUASER_TCDATA     10
+
 #if (LUA_VERSION_NUM < 502)
 static int lua_absindex (lua_State *L, int idx) {
   return (idx > 0 || idx <= LUA_REGISTRYINDEX) ?
@@ -55,66 +131,540 @@ static int lua_absindex (lua_State *L, int idx) {
 # define LUA_OK 0
 #endif
 
-static void encodevalue(lua_State *L, int idx, luaL_Buffer *buf);
+typedef struct {
+  lua_State *L;
+  luaser_buffer *out;
+  size_t refmin;   /* strings this long are passed by reference (0: never) */
+  int anchors;     /* table anchoring the referenced strings */
+  int nanchors;
+  int seen;        /* table -> number of the tables already encoded */
+  uint32_t ntables;
+  int metatables;  /* registered metatables (0: not loaded yet) */
+  int depth;
+} encoder;
+
+typedef struct {
+  lua_State *L;
+  const char *end;
+  int refs;        /* number -> decoded table */
+  uint32_t ntables;
+  uint32_t nrefs;
+  int metatables;
+  int depth;
+} decoder;
+
+static void encodevalue(lua_State *L, int idx, encoder *enc);
+
+/* makes room for n more bytes, returns 0 on success, -1 if the memory
+ * allocation failed, -2 if the size limit is reached */
+static int grow(luaser_buffer *out, size_t n) {
+  size_t size;
+  char *data;
+
+  if (out->max && n > out->max - out->len) {
+    return -2;
+  }
+
+  if (out->size - out->len >= n) {
+    return 0;
+  }
+
+  size = out->size ? out->size : 256;
+  while (size - out->len < n) {
+    if (size > (size_t)-1 / 2) return -1;
+    size *= 2;
+  }
+
+  data = realloc(out->data, size);
+  if (data == NULL) return -1;
+  out->data = data;
+  out->size = size;
+  return 0;
+}
+
+static void reserve(encoder *enc, size_t n) {
+  switch (grow(enc->out, n)) {
+    case 0:
+      return;
+    case -2:
+      luaL_error(enc->L, "serialized data too big");
+      return;
+    default:
+      luaL_error(enc->L, "not enough memory");
+  }
+}
+
+static void addlstring(encoder *enc, const char *s, size_t n) {
+  reserve(enc, n);
+  memcpy(enc->out->data + enc->out->len, s, n);
+  enc->out->len += n;
+}
+
+static void addchar(encoder *enc, char c) {
+  if (enc->out->len == enc->out->size || enc->out->max) {
+    reserve(enc, 1);
+  }
+  enc->out->data[enc->out->len++] = c;
+}
 
-static int writer (lua_State *L, const void* b, size_t size, void* B) {
+static void addvarint(encoder *enc, uint64_t v) {
+  while (v >= 0x80) {
+    addchar(enc, (char)((v & 0x7f) | 0x80));
+    v >>= 7;
+  }
+  addchar(enc, (char)v);
+}
+
+/* writes v on exactly 5 bytes at given position (for sizes known afterwards) */
+static void setvarint32(luaser_buffer *out, size_t pos, uint32_t v) {
+  int i;
+  for (i = 0; i < 4; i++) {
+    out->data[pos + i] = (char)((v & 0x7f) | 0x80);
+    v >>= 7;
+  }
+  out->data[pos + 4] = (char)v;
+}
+
+static int writer (lua_State *L, const void* b, size_t size, void* ud) {
+  luaser_buffer *out = ((encoder *) ud)->out;
   (void)L;
-  luaL_addlstring((luaL_Buffer*) B, (const char *)b, size);
+  if (grow(out, size) != 0) return 1;
+  memcpy(out->data + out->len, b, size);
+  out->len += size;
   return 0;
 }
 
-/* serializes value on top into given buffer, the buffer must not be on the
-** same state as L (because this function uses stack).
-*/
-static void encodevalue(lua_State *L, int idx, luaL_Buffer *buf) {
+static void encodenumber(lua_Number n, encoder *enc) {
+  int64_t i;
+  uint64_t zz;
+
+  if (n >= -LUASER_INT_MAX && n <= LUASER_INT_MAX) {
+    i = (int64_t)n;
+    /* exact integers only (-0 must stay a double) */
+    if ((lua_Number)i == n && (i != 0 || !signbit(n))) {
+      if (i >= 0 && i <= LUASER_FIXINT_MAX) {
+        addchar(enc, (char)(LUASER_FIXINT | i));
+        return;
+      }
+      zz = ((uint64_t)i << 1) ^ (uint64_t)(i >> 63);
+      addchar(enc, LUASER_INT);
+      addvarint(enc, zz);
+      return;
+    }
+  }
+
+  addchar(enc, LUASER_NUM);
+  addlstring(enc, (const char *)&n, sizeof(lua_Number));
+}
+
+/* memory of a byte buffer: states referencing it (buffers, frames being
+ * decoded) may live in different threads, so it is reference counted with
+ * atomic operations */
+typedef struct {
+  long refs;
+  size_t len;
+  char data[1];
+} bytesblock;
+
+static bytesblock *newblock(lua_State *L, size_t len) {
+  bytesblock *b;
+  if (len > (size_t)-1 - sizeof(bytesblock)) {
+    luaL_error(L, "buffer too big");
+  }
+  b = malloc(sizeof(bytesblock) + len);
+  if (b == NULL) {
+    luaL_error(L, "not enough memory");
+  }
+  b->refs = 1;
+  b->len = len;
+  return b;
+}
+
+static void unrefblock(bytesblock *b) {
+  if (__sync_sub_and_fetch(&b->refs, 1) == 0) {
+    free(b);
+  }
+}
+
+/* handle of the buffer at idx, or NULL if it is not a buffer. The handle is
+ * NULL once the memory has been moved to another state */
+static bytesblock **tohandle(lua_State *L, int idx) {
+  bytesblock **ud = lua_touserdata(L, idx);
+  if (ud == NULL || !lua_getmetatable(L, idx)) {
+    return NULL;
+  }
+  lua_getfield(L, LUA_REGISTRYINDEX, LUASER_BYTES_MT);
+  if (!lua_rawequal(L, -1, -2)) {
+    ud = NULL;
+  }
+  lua_pop(L, 2);
+  return ud;
+}
+
+static bytesblock *checkbytes(lua_State *L, int idx) {
+  bytesblock **ud = tohandle(L, idx);
+  if (ud == NULL) {
+    luaL_typerror(L, idx, "buffer");
+  }
+  if (*ud == NULL) {
+    luaL_error(L, "buffer moved to another state");
+  }
+  return *ud;
+}
+
+static int bytes_gc(lua_State *L) {
+  bytesblock **ud = lua_touserdata(L, 1);
+  if (*ud != NULL) {
+    unrefblock(*ud);
+    *ud = NULL;
+  }
+  return 0;
+}
+
+static int bytes_len(lua_State *L) {
+  lua_pushinteger(L, (lua_Integer)checkbytes(L, 1)->len);
+  return 1;
+}
+
+static int bytes_tostring(lua_State *L) {
+  bytesblock *b = checkbytes(L, 1);
+  lua_pushlstring(L, b->data, b->len);
+  return 1;
+}
+
+/* converts the positions i and j (string.sub style) into [*from, *to) */
+static void bytesrange(lua_State *L, bytesblock *b, int i, int j,
+                       size_t *from, size_t *to) {
+  lua_Number s = luaL_optnumber(L, i, 1), e = luaL_optnumber(L, j, -1);
+  if (s < 0) s += (lua_Number)b->len + 1;
+  if (e < 0) e += (lua_Number)b->len + 1;
+  if (s < 1) s = 1;
+  if (e > (lua_Number)b->len) e = (lua_Number)b->len;
+  *from = (size_t)s - 1;
+  *to = e >= s ? (size_t)e : *from;
+}
+
+/* buf:sub(i?, j?): copy of the bytes from i to j, as a string */
+static int bytes_sub(lua_State *L) {
+  bytesblock *b = checkbytes(L, 1);
+  size_t from, to;
+  bytesrange(L, b, 2, 3, &from, &to);
+  lua_pushlstring(L, b->data + from, to - from);
+  return 1;
+}
+
+/* buf:write(pos, str): copies str in the buffer from position pos */
+static int bytes_write(lua_State *L) {
+  bytesblock *b = checkbytes(L, 1);
+  lua_Number pos = luaL_checknumber(L, 2);
+  size_t len;
+  const char *str = luaL_checklstring(L, 3, &len);
+  if (pos < 1 || pos - 1 + (lua_Number)len > (lua_Number)b->len) {
+    luaL_argerror(L, 2, "out of the buffer");
+  }
+  memcpy(b->data + (size_t)pos - 1, str, len);
+  return 0;
+}
+
+/* buf:ptr(): address of the bytes, for ffi.cast */
+static int bytes_ptr(lua_State *L) {
+  lua_pushlightuserdata(L, checkbytes(L, 1)->data);
+  return 1;
+}
+
+static const luaL_Reg bytes_methods[] = {
+  { "len", bytes_len },
+  { "sub", bytes_sub },
+  { "write", bytes_write },
+  { "ptr", bytes_ptr },
+  { "tostring", bytes_tostring },
+  { NULL, NULL }
+};
+
+/* pushes a new buffer using the memory of b (the reference is taken) */
+static void pushbytes(lua_State *L, bytesblock *b) {
+  bytesblock **ud = lua_newuserdata(L, sizeof(bytesblock *));
+  *ud = b;
+  if (luaL_newmetatable(L, LUASER_BYTES_MT)) {
+    lua_pushcfunction(L, bytes_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, bytes_len);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, bytes_tostring);
+    lua_setfield(L, -2, "__tostring");
+    lua_newtable(L);
+    luaL_register(L, NULL, bytes_methods);
+    lua_setfield(L, -2, "__index");
+  }
+  lua_setmetatable(L, -2);
+}
+
+/* pushes the ffi module, loading it if needed */
+static void pushffi(lua_State *L) {
+  lua_getfield(L, LUA_GLOBALSINDEX, "require");
+  lua_pushliteral(L, "ffi");
+  lua_call(L, 1, 1);
+}
+
+/* scalar types, as named by LuaJIT */
+static const char *const cdatascalars[] = {
+  "bool", "char", "signed char", "unsigned char", "short", "unsigned short",
+  "int", "unsigned int", "int64_t", "uint64_t", "float", "double",
+  "long double", "complex", "complex float", NULL
+};
+
+/* checks that s (len bytes) names a struct, union or enum tag: anonymous
+ * types are named by a number, which does not identify them in another state
+ */
+static int istag(const char *s, size_t len) {
+  size_t i;
+  if (len == 0 || (s[0] >= '0' && s[0] <= '9')) return 0;
+  for (i = 0; i < len; i++) {
+    if (!(s[i] == '_' || (s[i] >= '0' && s[i] <= '9')
+          || (s[i] >= 'a' && s[i] <= 'z') || (s[i] >= 'A' && s[i] <= 'Z'))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* checks that name (len bytes) is "struct <tag>" or "union <tag>" */
+static int isrecord(const char *name, size_t len) {
+  return (len > 7 && memcmp(name, "struct ", 7) == 0
+          && istag(name + 7, len - 7))
+         || (len > 6 && memcmp(name, "union ", 6) == 0
+             && istag(name + 6, len - 6));
+}
+
+/* checks that the type named by LuaJIT as name (len bytes) holds plain data:
+ * scalars, enums, registered structs and unions, and arrays of fixed size of
+ * them */
+static int cdataallowed(lua_State *L, const char *name, size_t len) {
+  const char *end = name + len, *p;
+  size_t n;
+  int i, ok;
+
+  /* array dimensions: " [4]", " [2][3]" */
+  while (end > name && end[-1] == ']') {
+    p = end - 1;
+    while (p > name && p[-1] >= '0' && p[-1] <= '9') p--;
+    if (p == end - 1 || p == name || p[-1] != '[') return 0;
+    end = p - 1;
+  }
+  if (end > name && end[-1] == ' ') end--;
+
+  for (;;) {
+    if ((size_t)(end - name) > 6 && memcmp(name, "const ", 6) == 0) {
+      name += 6;
+    } else if ((size_t)(end - name) > 9
+               && memcmp(name, "volatile ", 9) == 0) {
+      name += 9;
+    } else {
+      break;
+    }
+  }
+  n = (size_t)(end - name);
+
+  for (i = 0; cdatascalars[i] != NULL; i++) {
+    if (strlen(cdatascalars[i]) == n && memcmp(cdatascalars[i], name, n) == 0) {
+      return 1;
+    }
+  }
+  if (n > 5 && memcmp(name, "enum ", 5) == 0) {
+    return istag(name + 5, n - 5);
+  }
+  if (!isrecord(name, n)) {
+    return 0;
+  }
+
+  lua_getfield(L, LUA_REGISTRYINDEX, LUASER_CDATATYPES);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    return 0;
+  }
+  lua_pushlstring(L, name, n);
+  lua_rawget(L, -2);
+  ok = lua_toboolean(L, -1);
+  lua_pop(L, 2);
+  return ok;
+}
+
+/* FFI cdata: only values of plain data types are sent, as their bytes */
+static void encodecdata(lua_State *L, int idx, encoder *enc) {
+  const char *ctype;
+  size_t len, size;
+
+  luaL_checkstack(L, 5, "table too deep");
+  pushffi(L);
+  lua_getfield(L, LUA_GLOBALSINDEX, "tostring");
+  lua_getfield(L, -2, "typeof");
+  lua_pushvalue(L, idx);
+  lua_call(L, 1, 1);
+  lua_call(L, 1, 1);
+  ctype = lua_tolstring(L, -1, &len);
+  /* "ctype<name>" */
+  if (ctype == NULL || len < 7 || strncmp(ctype, "ctype<", 6) != 0) {
+    luaL_error(L, "cannot serialize cdata");
+  }
+  ctype += 6;
+  len -= 7;
+  if (!cdataallowed(L, ctype, len)) {
+    luaL_error(L, "cannot serialize cdata of type %s", lua_tostring(L, -1));
+  }
+
+  lua_getfield(L, -2, "sizeof");
+  lua_pushvalue(L, idx);
+  lua_call(L, 1, 1);
+  if (!lua_isnumber(L, -1)) {
+    luaL_error(L, "cannot serialize cdata of unknown size");
+  }
+  size = (size_t)lua_tonumber(L, -1);
+
+  addchar(enc, LUASER_CDATA);
+  addvarint(enc, len);
+  addlstring(enc, ctype, len);
+  addvarint(enc, size);
+  addlstring(enc, lua_topointer(L, idx), size);
+  lua_pop(L, 3);
+}
+
+/* size of the array part: consecutive non nil values from 1 */
+static size_t arraysize(lua_State *L, int idx) {
+  size_t n, len = lua_objlen(L, idx);
+  for (n = 0; n < len; n++) {
+    lua_rawgeti(L, idx, (int)n + 1);
+    if (lua_isnil(L, -1)) {
+      lua_pop(L, 1);
+      break;
+    }
+    lua_pop(L, 1);
+  }
+  return n;
+}
+
+/* tells if the key on top is stored in the array part */
+static int inarray(lua_State *L, size_t narr) {
+  lua_Number k;
+  if (lua_type(L, -1) != LUA_TNUMBER) {
+    return 0;
+  }
+  k = lua_tonumber(L, -1);
+  return k >= 1 && k <= (lua_Number)narr && k == (lua_Number)(size_t)k;
+}
+
+/* serializes value at index idx into the encoder output */
+static void encodevalue(lua_State *L, int idx, encoder *enc) {
   idx = lua_absindex(L, idx);
   switch(lua_type(L, idx)) {
     case LUA_TNIL:
-      luaL_addchar(buf, LUA_TNIL);
+      addchar(enc, LUASER_NIL);
       break;
     case LUA_TBOOLEAN:
-      luaL_addchar(buf, LUA_TBOOLEAN);
-      luaL_addchar(buf, (char)lua_toboolean(L, idx));
+      addchar(enc, lua_toboolean(L, idx) ? LUASER_TRUE : LUASER_FALSE);
       break;
-    case LUA_TNUMBER: {
-      lua_Number n = lua_tonumber(L, idx);
-      luaL_addchar(buf, LUA_TNUMBER);
-      luaL_addlstring(buf, (const char *)&n, sizeof(lua_Number));
+    case LUA_TNUMBER:
+      encodenumber(lua_tonumber(L, idx), enc);
       break;
-    }
     case LUA_TSTRING: {
       size_t len;
-      uint32_t serlen;
       const char *str = lua_tolstring(L, idx, &len);
-      if (len > UINT32_MAX) {
-          luaL_error(L, "string too long");
+      if (enc->refmin > 0 && len >= enc->refmin) {
+        /* keep the string alive until the other side copied it */
+        lua_pushvalue(L, idx);
+        lua_rawseti(L, enc->anchors, ++enc->nanchors);
+        addchar(enc, LUASER_STRREF);
+        addlstring(enc, (const char *)&str, sizeof(const char *));
+        addvarint(enc, len);
+        break;
       }
-
-      serlen = len; /* be sure of the size */
-      luaL_addchar(buf, LUA_TSTRING);
-      luaL_addlstring(buf, (const char *)&serlen, sizeof(uint32_t));
-      luaL_addlstring(buf, str, len);
+      if (len <= LUASER_FIXSTR_MAX) {
+        addchar(enc, (char)(LUASER_FIXSTR | len));
+      } else {
+        addchar(enc, LUASER_STR);
+        addvarint(enc, len);
+      }
+      addlstring(enc, str, len);
       break;
     }
-    case LUA_TTABLE:
+    case LUA_TTABLE: {
+      size_t narr, nhash, i;
+      luaL_checkstack(L, 4, "table too deep");
+
+      /* shared tables and cycles: only the first occurence is encoded */
+      lua_pushvalue(L, idx);
+      lua_rawget(L, enc->seen);
+      if (!lua_isnil(L, -1)) {
+        addchar(enc, LUASER_TABLEREF);
+        addvarint(enc, (uint64_t)lua_tonumber(L, -1));
+        lua_pop(L, 1);
+        break;
+      }
+      lua_pop(L, 1);
+      if (++enc->depth > LUASER_MAX_DEPTH) {
+        luaL_error(L, "table too deep");
+      }
+      lua_pushvalue(L, idx);
+      lua_pushnumber(L, ++enc->ntables);
+      lua_rawset(L, enc->seen);
+
       if (lua_getmetatable(L, idx)) {
-          /* TODO: why not ? */
+        /* only metatables registered by name are sent */
+        size_t namelen;
+        const char *name;
+        if (enc->metatables == 0) {
+          lua_getfield(L, LUA_REGISTRYINDEX, LUASER_METATABLES);
+          if (lua_isnil(L, -1)) {
+            luaL_error(L, "cannot serialize table with metatable");
+          }
+          lua_replace(L, enc->seen + 1);
+          enc->metatables = enc->seen + 1;
+        }
+        lua_rawget(L, enc->metatables);
+        name = lua_tolstring(L, -1, &namelen);
+        if (lua_type(L, -1) != LUA_TSTRING) {
           luaL_error(L, "cannot serialize table with metatable");
+        }
+        addchar(enc, LUASER_TABLEMT);
+        addvarint(enc, namelen);
+        addlstring(enc, name, namelen);
+        lua_pop(L, 1);
+      } else {
+        addchar(enc, LUASER_TABLE);
       }
-      luaL_addchar(buf, LUA_TTABLE);
+
+      /* sizes first, so the decoder can preallocate the table */
+      narr = arraysize(L, idx);
+      nhash = 0;
       lua_pushnil(L);
       while(lua_next(L, idx) != 0) {
-        encodevalue(L, -2, buf);
-        encodevalue(L, -1, buf);
         lua_pop(L, 1);
+        if (!inarray(L, narr)) {
+          nhash++;
+        }
       }
-      /* signal end of table (key cannot be nil) */
-      luaL_addchar(buf, LUA_TNIL);
+
+      addvarint(enc, narr);
+      addvarint(enc, nhash);
+      for (i = 1; i <= narr; i++) {
+        lua_rawgeti(L, idx, (int)i);
+        encodevalue(L, -1, enc);
+        lua_pop(L, 1);
+      }
+      lua_pushnil(L);
+      while(lua_next(L, idx) != 0) {
+        lua_pushvalue(L, -2);
+        if (!inarray(L, narr)) {
+          encodevalue(L, -1, enc);
+          encodevalue(L, -2, enc);
+        }
+        lua_pop(L, 2);
+      }
+      enc->depth--;
       break;
+    }
     case LUA_TFUNCTION: {
-      luaL_Buffer dumpbuf;
       lua_Debug ar;
-      uint32_t dumplen;
+      size_t pos;
 
       lua_pushvalue(L, idx);
       if (lua_iscfunction(L, idx)) {
@@ -123,84 +673,267 @@ static void encodevalue(lua_State *L, int idx, luaL_Buffer *buf) {
       if (lua_getinfo(L, ">u", &ar) == 0 || ar.nups > 0) {
         luaL_error(L, "cannot serialize function with upvalues");
       }
-      
-      /* we need to get the size of the dump, before dump itself:
-         use a separate buffer for dumping */
+
+      /* the size of the dump is only known afterwards: reserve room for it
+         and dump in place */
       /* TODO: save function name */
+      addchar(enc, LUASER_FUNC);
+      pos = enc->out->len;
+      addlstring(enc, "\0\0\0\0\0", 5);
       lua_pushvalue(L, idx);
-      luaL_buffinit(L, &dumpbuf);
-      if (lua_dump(L, writer, &dumpbuf) != 0) {
+      if (lua_dump(L, writer, enc) != 0) {
         luaL_error(L, "unable to dump function");
       }
-      luaL_pushresult(&dumpbuf);
-
-      dumplen = lua_objlen(L, -1);
-      luaL_addchar(buf, LUA_TFUNCTION);
-      luaL_addlstring(buf, (const char *)&dumplen, sizeof(uint32_t));
-      lua_xmove(L, buf->L, 1);
-      luaL_addvalue(buf);
       lua_pop(L, 1); /* pops function */
+      if (enc->out->len - pos - 5 > UINT32_MAX) {
+        luaL_error(L, "function too big");
+      }
+      setvarint32(enc->out, pos, (uint32_t)(enc->out->len - pos - 5));
+      break;
+    }
+    case LUA_TUSERDATA: {
+      bytesblock **ud = tohandle(L, idx), *b;
+      if (ud == NULL) {
+        luaL_error(L, "cannot serialize userdata");
+      }
+      if (*ud == NULL) {
+        luaL_error(L, "cannot serialize a buffer moved to another state");
+      }
+      b = *ud;
+      if (enc->anchors) {
+        /* moved: the anchor is a buffer of its own, which keeps the memory
+           alive until the other side took its own reference, and maps to
+           the original one, detached once the frame has been handed over
+           (see luaser_move_bytes) */
+        luaL_checkstack(L, 3, "too many values");
+        (void)__sync_add_and_fetch(&b->refs, 1);
+        pushbytes(L, b);
+        lua_pushvalue(L, -1);
+        lua_pushvalue(L, idx);
+        lua_rawset(L, enc->anchors);
+        lua_rawseti(L, enc->anchors, ++enc->nanchors);
+        addchar(enc, LUASER_BYTESREF);
+        addlstring(enc, (const char *)&b, sizeof(bytesblock *));
+        break;
+      }
+      addchar(enc, LUASER_BYTES);
+      addvarint(enc, b->len);
+      addlstring(enc, b->data, b->len);
       break;
     }
     default:
+      if (lua_type(L, idx) == LUASER_TCDATA) {
+        encodecdata(L, idx, enc);
+        break;
+      }
       luaL_error(L, "cannot serialize %s", luaL_typename(L, idx));
   }
 }
 
 #define checkbuffer(cur, end, n) do { \
-  if (cur + n > end) luaL_error(L, "wrong code"); \
+  if ((size_t)(end - cur) < (size_t)(n)) luaL_error(L, "wrong code"); \
 } while(0)
 
-static const char* decodevalue(lua_State *L, const char *buf, const char *end) {
+static const char* getvarint(lua_State *L, const char *buf, const char *end,
+                             uint64_t *v) {
+  unsigned shift = 0;
+  *v = 0;
+  for (;;) {
+    unsigned char c;
+    checkbuffer(buf, end, 1);
+    if (shift > 63) luaL_error(L, "wrong code");
+    c = (unsigned char)*buf++;
+    *v |= (uint64_t)(c & 0x7f) << shift;
+    if (!(c & 0x80)) return buf;
+    shift += 7;
+  }
+}
+
+static const char* decodevalue(decoder *dec, const char *buf);
+
+static const char* decodetable(decoder *dec, const char *buf, int hasmt) {
+  lua_State *L = dec->L;
+  const char *end = dec->end;
+  uint64_t narr, nhash, i, v;
+
+  if (++dec->depth > LUASER_MAX_DEPTH) {
+    luaL_error(L, "table too deep");
+  }
+  if (dec->nrefs >= dec->ntables) {
+    luaL_error(L, "wrong code");
+  }
+
+  if (hasmt) {
+    buf = getvarint(L, buf, end, &v);
+    checkbuffer(buf, end, v);
+    lua_pushlstring(L, buf, v);
+    buf += v;
+  }
+
+  buf = getvarint(L, buf, end, &narr);
+  buf = getvarint(L, buf, end, &nhash);
+  /* each entry takes at least one byte: do not trust the sizes blindly */
+  checkbuffer(buf, end, narr + nhash);
+  lua_createtable(L, (int)narr, (int)nhash);
+  lua_pushvalue(L, -1);
+  lua_rawseti(L, dec->refs, ++dec->nrefs);
+
+  if (hasmt) {
+    /* L = (name, table) */
+    if (dec->metatables == 0) {
+      lua_getfield(L, LUA_REGISTRYINDEX, LUASER_METATABLES);
+      if (lua_isnil(L, -1)) {
+        luaL_error(L, "unknown metatable '%s'", lua_tostring(L, -3));
+      }
+      lua_replace(L, dec->refs + 1);
+      dec->metatables = dec->refs + 1;
+    }
+    lua_pushvalue(L, -2);
+    lua_rawget(L, dec->metatables);
+    if (!lua_istable(L, -1)) {
+      luaL_error(L, "unknown metatable '%s'", lua_tostring(L, -3));
+    }
+    lua_setmetatable(L, -2);
+    lua_remove(L, -2);
+  }
+
+  for (i = 1; i <= narr; i++) {
+    buf = decodevalue(dec, buf);
+    lua_rawseti(L, -2, (int)i);
+  }
+  for (i = 0; i < nhash; i++) {
+    buf = decodevalue(dec, buf);
+    buf = decodevalue(dec, buf);
+    if (lua_isnil(L, -2)) {
+      luaL_error(L, "wrong code");
+    }
+    lua_rawset(L, -3);
+  }
+
+  dec->depth--;
+  return buf;
+}
+
+static const char* decodevalue(decoder *dec, const char *buf) {
+  lua_State *L = dec->L;
+  const char *end = dec->end;
+  unsigned char tag;
+  uint64_t v;
+
   checkbuffer(buf, end, 1);
-  switch (*buf++) {
-    case LUA_TNIL:
+  luaL_checkstack(L, 3, "table too deep");
+  tag = (unsigned char)*buf++;
+
+  if (tag >= LUASER_FIXSTR && tag <= (LUASER_FIXSTR | LUASER_FIXSTR_MAX)) {
+    v = tag & LUASER_FIXSTR_MAX;
+    checkbuffer(buf, end, v);
+    lua_pushlstring(L, buf, v);
+    return buf + v;
+  }
+  if (tag >= LUASER_FIXINT && tag <= (LUASER_FIXINT | LUASER_FIXINT_MAX)) {
+    lua_pushnumber(L, (lua_Number)(tag & LUASER_FIXINT_MAX));
+    return buf;
+  }
+
+  switch (tag) {
+    case LUASER_NIL:
       lua_pushnil(L);
       break;
-    case LUA_TBOOLEAN:
-      checkbuffer(buf, end, 1);
-      lua_pushboolean(L, *buf != 0);
-      buf++;
+    case LUASER_FALSE:
+    case LUASER_TRUE:
+      lua_pushboolean(L, tag == LUASER_TRUE);
       break;
-    case LUA_TNUMBER:
+    case LUASER_INT:
+      buf = getvarint(L, buf, end, &v);
+      /* zigzag decoding */
+      lua_pushnumber(L, (lua_Number)(int64_t)((v >> 1) ^ (~(v & 1) + 1)));
+      break;
+    case LUASER_NUM: {
+      lua_Number n;
       checkbuffer(buf, end, sizeof(lua_Number));
-      lua_pushnumber(L, *(const lua_Number *)buf);
+      memcpy(&n, buf, sizeof(lua_Number));
+      lua_pushnumber(L, n);
       buf += sizeof(lua_Number);
       break;
-    case LUA_TSTRING: {
-      uint32_t serlen;
-      checkbuffer(buf, end, sizeof(uint32_t));
-      serlen = *(const uint32_t*)(buf);
-      buf += sizeof(uint32_t);
-      checkbuffer(buf, end, serlen);
-      lua_pushlstring(L, buf, serlen);
-      buf += serlen;
+    }
+    case LUASER_STR:
+      buf = getvarint(L, buf, end, &v);
+      checkbuffer(buf, end, v);
+      lua_pushlstring(L, buf, v);
+      buf += v;
+      break;
+    case LUASER_TABLE:
+    case LUASER_TABLEMT:
+      buf = decodetable(dec, buf, tag == LUASER_TABLEMT);
+      break;
+    case LUASER_TABLEREF:
+      buf = getvarint(L, buf, end, &v);
+      if (v == 0 || v > dec->nrefs) {
+        luaL_error(L, "wrong code");
+      }
+      lua_rawgeti(L, dec->refs, (int)v);
+      break;
+    case LUASER_STRREF: {
+      const char *str;
+      checkbuffer(buf, end, sizeof(const char *));
+      memcpy(&str, buf, sizeof(const char *));
+      buf = getvarint(L, buf + sizeof(const char *), end, &v);
+      lua_pushlstring(L, str, v);
       break;
     }
-    case LUA_TTABLE:
-      lua_newtable(L);
-      checkbuffer(buf, end, 1);
-      while (*buf != LUA_TNIL) {
-        buf = decodevalue(L, buf, end);
-        checkbuffer(buf, end, 1);
-        buf = decodevalue(L, buf, end);
-        checkbuffer(buf, end, 1);
-        lua_settable(L, -3);
+    case LUASER_BYTES: {
+      bytesblock *b;
+      buf = getvarint(L, buf, end, &v);
+      checkbuffer(buf, end, v);
+      b = newblock(L, v);
+      memcpy(b->data, buf, v);
+      pushbytes(L, b);
+      buf += v;
+      break;
+    }
+    case LUASER_BYTESREF: {
+      bytesblock *b;
+      checkbuffer(buf, end, sizeof(bytesblock *));
+      memcpy(&b, buf, sizeof(bytesblock *));
+      (void)__sync_add_and_fetch(&b->refs, 1);
+      pushbytes(L, b);
+      buf += sizeof(bytesblock *);
+      break;
+    }
+    case LUASER_CDATA: {
+      uint64_t size;
+      luaL_checkstack(L, 4, "table too deep");
+      buf = getvarint(L, buf, end, &v);
+      checkbuffer(buf, end, v);
+      if (!cdataallowed(L, buf, v)) {
+        luaL_error(L, "cdata type not allowed");
       }
-      buf++; /* skip the final TNIL token */
+      pushffi(L);
+      lua_getfield(L, -1, "new");
+      lua_pushlstring(L, buf, v);
+      lua_call(L, 1, 1);
+      buf = getvarint(L, buf + v, end, &size);
+      checkbuffer(buf, end, size);
+      lua_getfield(L, -2, "sizeof");
+      lua_pushvalue(L, -2);
+      lua_call(L, 1, 1);
+      if (lua_tonumber(L, -1) != (lua_Number)size) {
+        luaL_error(L, "cdata size mismatch");
+      }
+      lua_pop(L, 1);
+      memcpy((void *)lua_topointer(L, -1), buf, size);
+      lua_remove(L, -2);
+      buf += size;
       break;
-    case LUA_TFUNCTION: {
-      uint32_t dumplen;
-      checkbuffer(buf, end, sizeof(uint32_t));
-      dumplen = *(const uint32_t*)(buf);
-      buf += sizeof(uint32_t);
-      checkbuffer(buf, end, dumplen);
-      if (luaL_loadbuffer(L, buf, dumplen, "unserialized") != LUA_OK) {
+    }
+    case LUASER_FUNC:
+      buf = getvarint(L, buf, end, &v);
+      checkbuffer(buf, end, v);
+      if (luaL_loadbuffer(L, buf, v, "unserialized") != LUA_OK) {
         luaL_error(L, "failed to load function");
       }
-      buf += dumplen;
+      buf += v;
       break;
-    }
     default:
       luaL_error(L, "wrong type identifier");
   }
@@ -208,26 +941,239 @@ static const char* decodevalue(lua_State *L, const char *buf, const char *end) {
   return buf;
 }
 
+#define BUFFER_MT "luaser.buffer"
+
+static int buffer_gc(lua_State *L) {
+  luaser_buffer_free((luaser_buffer *)lua_touserdata(L, 1));
+  return 0;
+}
+
 /* public API */
+/* serializes the n values starting at index first into a single frame,
+ * written in out (previous content is kept, so several frames can be stored
+ * one after the other). Memory of out is owned by the caller, and is not
+ * leaked on errors. */
+void luaser_encode_values(lua_State *L, int first, int n, luaser_buffer *out)
+{
+  luaser_encode_values_ref(L, first, n, out, 0, 0);
+}
+
+/* same as luaser_encode_values, but strings of at least refmin bytes are not
+ * copied: the frame points to them, and they are stored into the table at
+ * index anchors to keep them alive. That table must be kept untouched until
+ * the frame has been decoded, and only inside the same process. Byte buffers
+ * are not copied either but moved: the table keeps their memory alive too,
+ * and luaser_move_bytes detaches them once the frame has been handed over.
+ * Until then, they can still be used (and encoded again, if the frame is
+ * dropped). */
+void luaser_encode_values_ref(lua_State *L, int first, int n,
+                              luaser_buffer *out, size_t refmin, int anchors)
+{
+  encoder enc;
+  size_t pos;
+  int i;
+
+  first = lua_absindex(L, first);
+  enc.L = L;
+  enc.out = out;
+  enc.refmin = refmin;
+  enc.anchors = anchors ? lua_absindex(L, anchors) : 0;
+  enc.nanchors = anchors ? (int)lua_objlen(L, enc.anchors) : 0;
+  enc.ntables = 0;
+  enc.metatables = 0;
+  enc.depth = 0;
+
+  /* the seen tables, and a slot for the metatables if needed (only when
+   * there are tables to encode) */
+  enc.seen = 0;
+  for (i = first; i < first + n; i++) {
+    if (lua_type(L, i) == LUA_TTABLE) {
+      luaL_checkstack(L, 2, "too many values");
+      lua_newtable(L);
+      enc.seen = lua_gettop(L);
+      lua_pushnil(L);
+      break;
+    }
+  }
+
+  addchar(&enc, LUASER_VERSION);
+  addvarint(&enc, (uint64_t)n);
+  pos = out->len;
+  addlstring(&enc, "\0\0\0\0\0", 5);
+  for (i = first; i < first + n; i++) {
+    encodevalue(L, i, &enc);
+  }
+  setvarint32(out, pos, enc.ntables);
+  if (enc.seen) {
+    lua_pop(L, 2);
+  }
+}
+
+/* detaches the buffers anchored from index first to last of the table at
+ * index anchors (see luaser_encode_values_ref): the receiving side is the
+ * only one left using their memory, using them here raises an error */
+void luaser_move_bytes(lua_State *L, int anchors, int first, int last)
+{
+  bytesblock **ud, *b;
+  int i;
+
+  anchors = lua_absindex(L, anchors);
+  for (i = first; i <= last; i++) {
+    lua_rawgeti(L, anchors, i);
+    lua_rawget(L, anchors);
+    ud = tohandle(L, -1);
+    if (ud != NULL && *ud != NULL) {
+      b = *ud;
+      *ud = NULL;
+      unrefblock(b);
+    }
+    lua_pop(L, 1);
+  }
+}
+
 /* serialize value at index idx, pushes resulting string into the stack */
 void luaser_encode(lua_State *L, int idx)
 {
-  luaL_Buffer buf;
-  lua_State  *bufL;
+  luaser_buffer *out;
 
   idx = lua_absindex(L, idx);
-  bufL = lua_newthread(L);
-  luaL_buffinit(bufL, &buf);
-  encodevalue(L, idx, &buf);
+  /* the buffer is freed by the GC if the serialization fails */
+  out = lua_newuserdata(L, sizeof(luaser_buffer));
+  memset(out, 0, sizeof(luaser_buffer));
+  if (luaL_newmetatable(L, BUFFER_MT)) {
+    lua_pushcfunction(L, buffer_gc);
+    lua_setfield(L, -2, "__gc");
+  }
+  lua_setmetatable(L, -2);
+
+  luaser_encode_values(L, idx, 1, out);
+  lua_pushlstring(L, out->data, out->len);
+  luaser_buffer_free(out);
+  lua_remove(L, -2); /* remove the buffer */
+}
+
+/* Lua function: creates a byte buffer of the given size (zero filled), or
+ * holding a copy of the given string */
+int luaser_bytes_new(lua_State *L)
+{
+  bytesblock *b;
+  size_t len;
+  const char *str;
+
+  if (lua_type(L, 1) == LUA_TSTRING) {
+    str = lua_tolstring(L, 1, &len);
+    b = newblock(L, len);
+    memcpy(b->data, str, len);
+  } else {
+    lua_Number n = luaL_checknumber(L, 1);
+    if (n < 0) {
+      luaL_argerror(L, 1, "negative size");
+    }
+    b = newblock(L, (size_t)n);
+    memset(b->data, 0, b->len);
+  }
+  pushbytes(L, b);
+  return 1;
+}
+
+void luaser_buffer_free(luaser_buffer *buf)
+{
+  free(buf->data);
+  buf->data = NULL;
+  buf->len = 0;
+  buf->size = 0;
+}
+
+/* registers the metatable at index idx under the given name: tables using it
+ * can be serialized, the decoding side must have registered the same name */
+void luaser_register_metatable(lua_State *L, const char *name, int idx)
+{
+  idx = lua_absindex(L, idx);
+  luaL_checktype(L, idx, LUA_TTABLE);
+
+  lua_getfield(L, LUA_REGISTRYINDEX, LUASER_METATABLES);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, LUASER_METATABLES);
+  }
+
+  lua_pushstring(L, name);
+  lua_pushvalue(L, idx);
+  lua_rawset(L, -3);
+  lua_pushvalue(L, idx);
+  lua_pushstring(L, name);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+}
+
+/* allows values of the struct or union type name ("struct point") to be
+ * serialized, as their bytes: the type must be plain data, without pointers,
+ * and the decoding side must have registered the same name */
+void luaser_register_cdata(lua_State *L, const char *name)
+{
+  if (!isrecord(name, strlen(name))) {
+    luaL_error(L, "invalid cdata type name \"%s\"", name);
+  }
+
+  lua_getfield(L, LUA_REGISTRYINDEX, LUASER_CDATATYPES);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, LUASER_CDATATYPES);
+  }
 
-  luaL_pushresult(&buf);
-  lua_xmove(bufL, L, 1);
-  lua_remove(L, -2); /* remove the thread */
+  lua_pushstring(L, name);
+  lua_pushboolean(L, 1);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
 }
 
-/* deserializes the given value and pushes it ot the stack */
-void luaser_decode(lua_State *L, const char *buf, size_t len)
+/* deserializes the frame at the start of buf and pushes its values to the
+ * stack, returns the number of bytes consumed (several frames can be stored
+ * one after the other) */
+size_t luaser_decode(lua_State *L, const char *buf, size_t len)
 {
-  const char *end = buf + len;  
-  decodevalue(L, buf, end);
+  const char *p = buf, *end = buf + len;
+  decoder dec;
+  uint64_t n, ntables;
+  int base;
+
+  checkbuffer(p, end, 1);
+  if (*p++ != LUASER_VERSION) {
+    luaL_error(L, "unsupported serialization version");
+  }
+  p = getvarint(L, p, end, &n);
+  p = getvarint(L, p, end, &ntables);
+  /* each value takes at least one byte */
+  checkbuffer(p, end, n);
+  checkbuffer(p, end, ntables);
+  luaL_checkstack(L, (int)n + 2, "too many values");
+
+  /* decoded tables (for references), and a slot for the metatables */
+  base = 0;
+  if (ntables > 0) {
+    lua_createtable(L, (int)ntables, 0);
+    base = lua_gettop(L);
+    lua_pushnil(L);
+  }
+
+  dec.L = L;
+  dec.end = end;
+  dec.refs = base;
+  dec.ntables = (uint32_t)ntables;
+  dec.nrefs = 0;
+  dec.metatables = 0;
+  dec.depth = 0;
+  while (n-- > 0) {
+    p = decodevalue(&dec, p);
+  }
+
+  if (base) {
+    lua_remove(L, base);
+    lua_remove(L, base);
+  }
+  return p - buf;
 }
@@ -28,7 +28,22 @@ OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef _SERIALIZE_H_INCLUDED_
 #define _SERIALIZE_H_INCLUDED_
 
+typedef struct {
+  char   *data;
+  size_t  len;
+  size_t  size;
+  size_t  max;   /* size limit, 0 for none */
+} luaser_buffer;
+
 void luaser_encode(lua_State *L, int idx);
-void luaser_decode(lua_State *L, const char *buf, size_t len);
+void luaser_encode_values(lua_State *L, int first, int n, luaser_buffer *out);
+void luaser_encode_values_ref(lua_State *L, int first, int n,
+                              luaser_buffer *out, size_t refmin, int anchors);
+void luaser_move_bytes(lua_State *L, int anchors, int first, int last);
+void luaser_buffer_free(luaser_buffer *buf);
+void luaser_register_metatable(lua_State *L, const char *name, int idx);
+void luaser_register_cdata(lua_State *L, const char *name);
+size_t luaser_decode(lua_State *L, const char *buf, size_t len);
+int luaser_bytes_new(lua_State *L);
 
 #endif /* _SERIALIZE_H_INCLUDED_ */